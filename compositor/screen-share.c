@@ -33,7 +33,9 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <signal.h>
+#include <pthread.h>
 #include <linux/input.h>
 #include <errno.h>
 #include <ctype.h>
@@ -47,6 +49,10 @@
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 
+/* Size of the tiles the worker compares against the previously sent frame,
+ * in downscaled frame coordinates. */
+#define SS_TILE_SIZE 64
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -66,7 +72,7 @@ struct shared_output {
 	} parent;
 
 	struct wl_event_source *event_source;
-	struct wl_listener frame_listener;
+	struct weston_capture_subscriber *capture;
 
 	struct {
 		int32_t width, height;
@@ -76,9 +82,47 @@ struct shared_output {
 	} shm;
 
 	int cache_dirty;
+
+	/* The captured frame the worker reads from, and an image of its
+	 * pixels set up to sample them in frame coordinates.  Both are
+	 * held while the worker is busy. */
+	struct weston_capture_frame *capture_frame;
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	int capture_pending;
+
+	/* Downscale factor and frame rate cap from the [screen-share]
+	 * section. */
+	int scale;
+	int32_t min_frame_interval; /* msec, 0 if not capped */
+	struct timespec last_capture;
+	struct wl_event_source *capture_timer;
+	int capture_timer_armed;
+
+	/* Damage in output coordinates not yet read back */
+	pixman_region32_t pending_damage;
+
+	/* Downscaled, transformed copy of the last frame handed to the
+	 * parent, owned by the worker while it is busy. */
+	pixman_image_t *frame_image;
+
+	struct {
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		int has_job;
+		int done;
+		int destroying;
+		int fd; /* eventfd signalled when a job is done */
+
+		/* Only touched by the compositor thread */
+		int busy;
+		struct wl_event_source *source;
+
+		/* Input and output of a job, in frame coordinates */
+		pixman_region32_t damage;
+		pixman_region32_t changed;
+		pixman_image_t *tile_image;
+	} worker;
 };
 
 struct ss_seat {
@@ -112,6 +156,8 @@ struct ss_shm_buffer {
 struct screen_share {
 	struct weston_compositor *compositor;
 	char *command;
+	int scale;
+	int max_fps;
 };
 
 static void
@@ -141,15 +187,18 @@ ss_seat_handle_motion(void *data, struct wl_pointer *pointer,
 		      uint32_t time, wl_fixed_t x, wl_fixed_t y)
 {
 	struct ss_seat *seat = data;
+	int scale = seat->output->scale;
 	struct timespec ts;
 
 	timespec_from_msec(&ts, time);
 
-	/* No transformation of input position is required here because we are
-	 * always receiving the input in the same coordinates as the output. */
+	/* The parent surface is the output downscaled by the share scale
+	 * factor; other than that we are receiving the input in the same
+	 * coordinates as the output. */
 
 	notify_motion_absolute(&seat->base, &ts,
-			       wl_fixed_to_double(x), wl_fixed_to_double(y));
+			       wl_fixed_to_double(x) * scale,
+			       wl_fixed_to_double(y) * scale);
 	notify_pointer_frame(&seat->base);
 }
 
@@ -421,17 +470,25 @@ static const struct wl_buffer_listener buffer_listener = {
 	buffer_release
 };
 
+static void
+shared_output_get_frame_size(struct shared_output *so,
+			     int32_t *width, int32_t *height)
+{
+	*width = (so->output->width + so->scale - 1) / so->scale;
+	*height = (so->output->height + so->scale - 1) / so->scale;
+}
+
 static struct ss_shm_buffer *
 shared_output_get_shm_buffer(struct shared_output *so)
 {
 	struct ss_shm_buffer *sb, *bnext;
 	struct wl_shm_pool *pool;
-	int width, height, stride;
+	int32_t width, height;
+	int stride;
 	int fd;
 	unsigned char *data;
 
-	width = so->output->width;
-	height = so->output->height;
+	shared_output_get_frame_size(so, &width, &height);
 	stride = width * 4;
 
 	/* If the size of the output changed, we free the old buffers and
@@ -567,42 +624,6 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
 shared_output_update(struct shared_output *so);
 
@@ -630,10 +651,12 @@ shared_output_update(struct shared_output *so)
 	struct ss_shm_buffer *sb;
 	pixman_box32_t *r;
 	int i, nrects;
-	pixman_transform_t transform;
+	int32_t width, height;
 
-	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
+	/* Only update if we need to.  While the worker is busy it is
+	 * writing to frame_image; it will call back here when done. */
+	if (!so->cache_dirty || so->parent.frame_cb || so->worker.busy ||
+	    !so->frame_image)
 		return;
 
 	sb = shared_output_get_shm_buffer(so);
@@ -642,30 +665,23 @@ shared_output_update(struct shared_output *so)
 		return;
 	}
 
-	output_compute_transform(so->output, &transform);
-	pixman_image_set_transform(so->cache_image, &transform);
+	/* frame_image is already transformed and scaled, so this is a plain
+	 * copy of the tiles that changed since sb was last attached. */
+	width = pixman_image_get_width(so->frame_image);
+	height = pixman_image_get_height(so->frame_image);
 
 	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
 
-	if (so->output->current_scale == 1) {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_NEAREST, NULL, 0);
-	} else {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_BILINEAR, NULL, 0);
-	}
-
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 so->cache_image, /* src */
+				 so->frame_image, /* src */
 				 NULL, /* mask */
 				 sb->pm_image, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 so->output->width, /* width */
-				 so->output->height /* height */);
+				 width, /* width */
+				 height /* height */);
 
-	pixman_image_set_transform(sb->pm_image, NULL);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
 
 	r = pixman_region32_rectangles(&sb->damage, &nrects);
@@ -686,6 +702,180 @@ shared_output_update(struct shared_output *so)
 	/* Clear the buffer damage */
 	pixman_region32_fini(&sb->damage);
 	pixman_region32_init(&sb->damage);
+
+	so->cache_dirty = 0;
+}
+
+/* Copy a tile into the frame if it differs from what is there.  Returns
+ * whether anything was copied. */
+static int
+shared_output_apply_tile(uint32_t *dst, int dst_stride,
+			 const uint32_t *src, int src_stride,
+			 int width, int height)
+{
+	int y;
+
+	for (y = 0; y < height; y++) {
+		if (memcmp(dst, src, width * 4) != 0)
+			break;
+
+		dst += dst_stride;
+		src += src_stride;
+	}
+
+	if (y == height)
+		return 0;
+
+	for (; y < height; y++) {
+		memcpy(dst, src, width * 4);
+		dst += dst_stride;
+		src += src_stride;
+	}
+
+	return 1;
+}
+
+/* Runs on the worker thread: transform and downscale the damaged tiles of
+ * cache_image and fold the ones that actually changed into frame_image.
+ * The damage is tile aligned, see shared_output_frame_damage(). */
+static void
+shared_output_process_damage(struct shared_output *so)
+{
+	pixman_image_t *tile = so->worker.tile_image;
+	uint32_t *tile_data = pixman_image_get_data(tile);
+	int tile_stride = pixman_image_get_stride(tile) / 4;
+	uint32_t *frame_data = pixman_image_get_data(so->frame_image);
+	int frame_stride = pixman_image_get_stride(so->frame_image) / 4;
+	pixman_box32_t *r;
+	int i, nrects, x, y, width, height;
+
+	pixman_region32_fini(&so->worker.changed);
+	pixman_region32_init(&so->worker.changed);
+
+	r = pixman_region32_rectangles(&so->worker.damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		for (y = r[i].y1; y < r[i].y2; y += SS_TILE_SIZE) {
+			for (x = r[i].x1; x < r[i].x2; x += SS_TILE_SIZE) {
+				width = MIN(SS_TILE_SIZE, r[i].x2 - x);
+				height = MIN(SS_TILE_SIZE, r[i].y2 - y);
+
+				pixman_image_composite32(PIXMAN_OP_SRC,
+							 so->cache_image, NULL,
+							 tile,
+							 x, y, 0, 0, 0, 0,
+							 width, height);
+
+				if (!shared_output_apply_tile(
+						frame_data + y * frame_stride + x,
+						frame_stride,
+						tile_data, tile_stride,
+						width, height))
+					continue;
+
+				pixman_region32_union_rect(&so->worker.changed,
+							   &so->worker.changed,
+							   x, y, width, height);
+			}
+		}
+	}
+}
+
+static void *
+shared_output_worker(void *data)
+{
+	struct shared_output *so = data;
+	uint64_t value = 1;
+
+	pthread_mutex_lock(&so->worker.mutex);
+
+	while (!so->worker.destroying) {
+		if (!so->worker.has_job) {
+			pthread_cond_wait(&so->worker.cond, &so->worker.mutex);
+			continue;
+		}
+
+		/* The compositor thread leaves cache_image, frame_image and
+		 * the job regions alone until we report back, so the lock is
+		 * not needed while processing. */
+		so->worker.has_job = 0;
+		pthread_mutex_unlock(&so->worker.mutex);
+
+		shared_output_process_damage(so);
+
+		pthread_mutex_lock(&so->worker.mutex);
+		so->worker.done = 1;
+		if (write(so->worker.fd, &value, sizeof value) < 0)
+			weston_log("screen-share: worker notify failed: %m\n");
+	}
+
+	pthread_mutex_unlock(&so->worker.mutex);
+
+	return NULL;
+}
+
+static void
+shared_output_release_frame(struct shared_output *so)
+{
+	if (so->cache_image) {
+		pixman_image_unref(so->cache_image);
+		so->cache_image = NULL;
+	}
+
+	if (so->capture_frame) {
+		weston_capture_frame_unref(so->capture_frame);
+		so->capture_frame = NULL;
+	}
+}
+
+static int
+shared_output_worker_done(int fd, uint32_t mask, void *data)
+{
+	struct shared_output *so = data;
+	struct ss_shm_buffer *sb;
+	uint64_t value;
+	int done;
+
+	if (read(fd, &value, sizeof value) != sizeof value)
+		return 0;
+
+	pthread_mutex_lock(&so->worker.mutex);
+	done = so->worker.done;
+	so->worker.done = 0;
+	pthread_mutex_unlock(&so->worker.mutex);
+
+	if (!done)
+		return 0;
+
+	so->worker.busy = 0;
+	shared_output_release_frame(so);
+
+	if (pixman_region32_not_empty(&so->worker.changed)) {
+		/* Apply damage to all buffers */
+		wl_list_for_each(sb, &so->shm.buffers, link)
+			pixman_region32_union(&sb->damage, &sb->damage,
+					      &so->worker.changed);
+		so->cache_dirty = 1;
+	}
+
+	/* Damage that came in while the worker was busy was not read back;
+	 * get another frame for it. */
+	if (pixman_region32_not_empty(&so->pending_damage))
+		weston_output_schedule_repaint(so->output);
+
+	shared_output_update(so);
+
+	return 1;
+}
+
+static int
+shared_output_capture_timer_handler(void *data)
+{
+	struct shared_output *so = data;
+
+	so->capture_timer_armed = 0;
+	weston_output_schedule_repaint(so->output);
+
+	return 0;
 }
 
 static void
@@ -800,99 +990,227 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+/* Convert damage in output coordinates to frame coordinates, grown by the
+ * filter footprint and snapped to the tile grid the worker compares on. */
 static void
-shared_output_repainted(struct wl_listener *listener, void *data)
+shared_output_frame_damage(struct shared_output *so,
+			   pixman_region32_t *damage, pixman_region32_t *result)
 {
-	struct shared_output *so =
-		container_of(listener, struct shared_output, frame_listener);
-	pixman_region32_t damage;
-	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
 	pixman_box32_t *r;
-	uint32_t *cache_data;
+	int32_t width, height, x1, y1, x2, y2;
+	int i, nrects;
+
+	shared_output_get_frame_size(so, &width, &height);
+
+	pixman_region32_fini(result);
+	pixman_region32_init(result);
+
+	r = pixman_region32_rectangles(damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		x1 = r[i].x1 / so->scale - 1;
+		y1 = r[i].y1 / so->scale - 1;
+		x2 = (r[i].x2 + so->scale - 1) / so->scale + 1;
+		y2 = (r[i].y2 + so->scale - 1) / so->scale + 1;
+
+		x1 = MAX(x1, 0) / SS_TILE_SIZE * SS_TILE_SIZE;
+		y1 = MAX(y1, 0) / SS_TILE_SIZE * SS_TILE_SIZE;
+		x2 = MIN((x2 + SS_TILE_SIZE - 1) / SS_TILE_SIZE * SS_TILE_SIZE,
+			 width);
+		y2 = MIN((y2 + SS_TILE_SIZE - 1) / SS_TILE_SIZE * SS_TILE_SIZE,
+			 height);
+
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		pixman_region32_union_rect(result, result,
+					   x1, y1, x2 - x1, y2 - y1);
+	}
+}
+
+static int
+shared_output_ensure_frame_image(struct shared_output *so)
+{
+	int32_t width, height;
+
+	shared_output_get_frame_size(so, &width, &height);
+
+	if (so->frame_image &&
+	    pixman_image_get_width(so->frame_image) == width &&
+	    pixman_image_get_height(so->frame_image) == height)
+		return 0;
+
+	if (so->frame_image)
+		pixman_image_unref(so->frame_image);
+
+	so->frame_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						   width, height, NULL, 0);
+	if (!so->frame_image)
+		return -1;
+
+	/* New SHM buffers start out fully damaged, so the old frame
+	 * content does not need to be carried over. */
+	pixman_region32_fini(&so->pending_damage);
+	pixman_region32_init_rect(&so->pending_damage, 0, 0,
+				  so->output->width, so->output->height);
+
+	return 0;
+}
+
+/* The part of the framebuffer the worker samples for the given frame
+ * damage: the tiles in output coordinates, grown by a pixel for the
+ * filter footprint, in framebuffer coordinates. */
+static void
+shared_output_source_region(struct shared_output *so,
+			    pixman_region32_t *tiles, pixman_region32_t *result)
+{
+	pixman_region32_t region;
+	pixman_box32_t *r;
+	int i, nrects;
+
+	pixman_region32_init(&region);
+
+	r = pixman_region32_rectangles(tiles, &nrects);
+	for (i = 0; i < nrects; ++i)
+		pixman_region32_union_rect(&region, &region,
+					   r[i].x1 * so->scale - 1,
+					   r[i].y1 * so->scale - 1,
+					   (r[i].x2 - r[i].x1) * so->scale + 2,
+					   (r[i].y2 - r[i].y1) * so->scale + 2);
+
+	pixman_region32_intersect_rect(&region, &region, 0, 0,
+				       so->output->width, so->output->height);
+	weston_transformed_region(so->output->width, so->output->height,
+				  so->output->transform,
+				  so->output->current_scale,
+				  &region, result);
+	pixman_region32_fini(&region);
+}
+
+/* Hand a captured frame to the worker.  Must only be called while the
+ * worker is idle. */
+static int
+shared_output_start_job(struct shared_output *so,
+			struct weston_capture_frame *frame)
+{
+	pixman_transform_t transform, downscale;
+
+	so->cache_image =
+		pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					 pixman_image_get_width(frame->image),
+					 pixman_image_get_height(frame->image),
+					 pixman_image_get_data(frame->image),
+					 pixman_image_get_stride(frame->image));
+	if (!so->cache_image)
+		return -1;
+
+	so->capture_frame = weston_capture_frame_ref(frame);
+
+	/* The worker samples cache_image in frame coordinates: undo the
+	 * share scale first, then the output transform and scale. */
+	output_compute_transform(so->output, &transform);
+	pixman_transform_init_scale(&downscale,
+				    pixman_int_to_fixed(so->scale),
+				    pixman_int_to_fixed(so->scale));
+	pixman_transform_multiply(&transform, &transform, &downscale);
+	pixman_image_set_transform(so->cache_image, &transform);
+
+	if (so->output->current_scale == 1 && so->scale == 1) {
+		pixman_image_set_filter(so->cache_image,
+					PIXMAN_FILTER_NEAREST, NULL, 0);
+	} else {
+		pixman_image_set_filter(so->cache_image,
+					PIXMAN_FILTER_BILINEAR, NULL, 0);
+	}
+
+	so->worker.busy = 1;
+
+	pthread_mutex_lock(&so->worker.mutex);
+	so->worker.has_job = 1;
+	pthread_cond_signal(&so->worker.cond);
+	pthread_mutex_unlock(&so->worker.mutex);
+
+	return 0;
+}
+
+/* Called after every repaint: collect the damage, and if the worker is
+ * ready for another frame, ask for the pixels it will need. */
+static void
+shared_output_capture_prepare(void *data, struct weston_output *output,
+			      const pixman_region32_t *fb_damage,
+			      pixman_region32_t *region)
+{
+	struct shared_output *so = data;
+	pixman_region32_t damage;
+	struct timespec now;
+	int64_t elapsed;
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
 	pixman_region32_intersect(&damage, &so->output->region,
 				  &so->output->previous_damage);
 	pixman_region32_translate(&damage, -so->output->x, -so->output->y);
+	pixman_region32_union(&so->pending_damage,
+			      &so->pending_damage, &damage);
+	pixman_region32_fini(&damage);
 
-	/* Apply damage to all buffers */
-	wl_list_for_each(sb, &so->shm.buffers, link)
-		pixman_region32_union(&sb->damage, &sb->damage, &damage);
+	if (!pixman_region32_not_empty(&so->pending_damage))
+		return;
 
-	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
-
-	width = so->output->current_mode->width;
-	height = so->output->current_mode->height;
-	stride = width;
-
-	if (!so->cache_image ||
-	    pixman_image_get_width(so->cache_image) != width ||
-	    pixman_image_get_height(so->cache_image) != height) {
-		if (so->cache_image)
-			pixman_image_unref(so->cache_image);
-
-		so->cache_image =
-			pixman_image_create_bits(PIXMAN_a8r8g8b8,
-						 width, height, NULL,
-						 stride);
-		if (!so->cache_image) {
-			shared_output_destroy(so);
+	/* The worker still holds the previous frame; once it is done it
+	 * schedules another repaint to pick up the damage accumulated
+	 * meanwhile. */
+	if (so->worker.busy)
+		return;
+
+	if (so->min_frame_interval > 0) {
+		weston_compositor_read_presentation_clock(so->output->compositor,
+							  &now);
+		elapsed = timespec_sub_to_msec(&now, &so->last_capture);
+		if (elapsed < so->min_frame_interval) {
+			if (!so->capture_timer_armed) {
+				wl_event_source_timer_update(so->capture_timer,
+							     so->min_frame_interval - elapsed);
+				so->capture_timer_armed = 1;
+			}
 			return;
 		}
-
-		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
+		so->last_capture = now;
 	}
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
+	if (shared_output_ensure_frame_image(so) < 0) {
 		shared_output_destroy(so);
 		return;
 	}
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	shared_output_frame_damage(so, &so->pending_damage,
+				   &so->worker.damage);
+	shared_output_source_region(so, &so->worker.damage, region);
 
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
-	}
+	pixman_region32_fini(&so->pending_damage);
+	pixman_region32_init(&so->pending_damage);
 
-	pixman_region32_fini(&damage);
+	so->capture_pending = 1;
+}
+
+static void
+shared_output_captured(void *data, struct weston_capture_frame *frame)
+{
+	struct shared_output *so = data;
 
-	so->cache_dirty = 1;
+	if (!so->capture_pending)
+		return;
 
-	shared_output_update(so);
+	so->capture_pending = 0;
+
+	if (!frame || shared_output_start_job(so, frame) < 0) {
+		shared_output_release_frame(so);
+		shared_output_destroy(so);
+	}
 }
 
 static struct shared_output *
-shared_output_create(struct weston_output *output, int parent_fd)
+shared_output_create(struct weston_output *output, int parent_fd,
+		     struct screen_share *ss)
 {
 	struct shared_output *so;
 	struct wl_event_loop *loop;
@@ -905,6 +1223,10 @@ shared_output_create(struct weston_output *output, int parent_fd)
 
 	wl_list_init(&so->seat_list);
 
+	so->scale = ss->scale;
+	if (ss->max_fps > 0)
+		so->min_frame_interval = 1000 / ss->max_fps;
+
 	so->parent.display = wl_display_connect_to_fd(parent_fd);
 	if (!so->parent.display)
 		goto err_alloc;
@@ -944,18 +1266,27 @@ shared_output_create(struct weston_output *output, int parent_fd)
 		goto err_display;
 	}
 
-	so->parent.mode_feedback =
-		zwp_fullscreen_shell_v1_present_surface_for_mode(so->parent.fshell,
-								 so->parent.surface,
-								 so->parent.output,
-								 output->current_mode->refresh);
-	if (!so->parent.mode_feedback) {
-		weston_log("Screen share failed: %m\n");
-		goto err_display;
+	if (so->scale == 1) {
+		so->parent.mode_feedback =
+			zwp_fullscreen_shell_v1_present_surface_for_mode(so->parent.fshell,
+									 so->parent.surface,
+									 so->parent.output,
+									 output->current_mode->refresh);
+		if (!so->parent.mode_feedback) {
+			weston_log("Screen share failed: %m\n");
+			goto err_display;
+		}
+		zwp_fullscreen_shell_mode_feedback_v1_add_listener(so->parent.mode_feedback,
+								   &mode_feedback_listener,
+								   so);
+	} else {
+		/* A downscaled surface never matches the parent's mode;
+		 * let it zoom the surface up instead. */
+		zwp_fullscreen_shell_v1_present_surface(so->parent.fshell,
+							so->parent.surface,
+							ZWP_FULLSCREEN_SHELL_V1_PRESENT_METHOD_ZOOM,
+							so->parent.output);
 	}
-	zwp_fullscreen_shell_mode_feedback_v1_add_listener(so->parent.mode_feedback,
-							   &mode_feedback_listener,
-							   so);
 
 	loop = wl_display_get_event_loop(output->compositor->wl_display);
 
@@ -968,6 +1299,50 @@ shared_output_create(struct weston_output *output, int parent_fd)
 		goto err_display;
 	}
 
+	so->capture_timer =
+		wl_event_loop_add_timer(loop,
+					shared_output_capture_timer_handler,
+					so);
+	if (!so->capture_timer) {
+		weston_log("Screen share failed: %m\n");
+		goto err_event_source;
+	}
+
+	so->worker.tile_image =
+		pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					 SS_TILE_SIZE, SS_TILE_SIZE, NULL, 0);
+	if (!so->worker.tile_image) {
+		weston_log("Screen share failed: out of memory\n");
+		goto err_timer;
+	}
+
+	so->worker.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (so->worker.fd < 0) {
+		weston_log("Screen share failed: eventfd: %m\n");
+		goto err_tile;
+	}
+
+	so->worker.source =
+		wl_event_loop_add_fd(loop, so->worker.fd, WL_EVENT_READABLE,
+				     shared_output_worker_done, so);
+	if (!so->worker.source) {
+		weston_log("Screen share failed: %m\n");
+		goto err_eventfd;
+	}
+
+	pixman_region32_init(&so->pending_damage);
+	pixman_region32_init(&so->worker.damage);
+	pixman_region32_init(&so->worker.changed);
+
+	pthread_mutex_init(&so->worker.mutex, NULL);
+	pthread_cond_init(&so->worker.cond, NULL);
+	if (pthread_create(&so->worker.thread, NULL,
+			   shared_output_worker, so) != 0) {
+		weston_log("Screen share failed: "
+			   "could not start worker thread\n");
+		goto err_worker;
+	}
+
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
@@ -976,13 +1351,41 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	so->output_destroyed.notify = output_destroyed;
 	wl_signal_add(&so->output->destroy_signal, &so->output_destroyed);
 
-	so->frame_listener.notify = shared_output_repainted;
-	wl_signal_add(&output->frame_signal, &so->frame_listener);
+	so->capture = weston_capture_subscribe(output,
+					       shared_output_capture_prepare,
+					       shared_output_captured, so);
+	if (!so->capture) {
+		weston_log("Screen share failed: out of memory\n");
+		wl_list_remove(&so->output_destroyed.link);
+		goto err_capture;
+	}
+
 	output->disable_planes++;
 	weston_output_damage(output);
 
 	return so;
 
+err_capture:
+	pthread_mutex_lock(&so->worker.mutex);
+	so->worker.destroying = 1;
+	pthread_cond_signal(&so->worker.cond);
+	pthread_mutex_unlock(&so->worker.mutex);
+	pthread_join(so->worker.thread, NULL);
+err_worker:
+	pthread_cond_destroy(&so->worker.cond);
+	pthread_mutex_destroy(&so->worker.mutex);
+	pixman_region32_fini(&so->worker.changed);
+	pixman_region32_fini(&so->worker.damage);
+	pixman_region32_fini(&so->pending_damage);
+	wl_event_source_remove(so->worker.source);
+err_eventfd:
+	close(so->worker.fd);
+err_tile:
+	pixman_image_unref(so->worker.tile_image);
+err_timer:
+	wl_event_source_remove(so->capture_timer);
+err_event_source:
+	wl_event_source_remove(so->event_source);
 err_display:
 	wl_list_for_each_safe(seat, tmp, &so->seat_list, link)
 		ss_seat_destroy(seat);
@@ -1001,6 +1404,20 @@ shared_output_destroy(struct shared_output *so)
 
 	so->output->disable_planes--;
 
+	pthread_mutex_lock(&so->worker.mutex);
+	so->worker.destroying = 1;
+	pthread_cond_signal(&so->worker.cond);
+	pthread_mutex_unlock(&so->worker.mutex);
+
+	pthread_join(so->worker.thread, NULL);
+
+	pthread_cond_destroy(&so->worker.cond);
+	pthread_mutex_destroy(&so->worker.mutex);
+
+	wl_event_source_remove(so->worker.source);
+	close(so->worker.fd);
+	wl_event_source_remove(so->capture_timer);
+
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
 	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, free_link)
@@ -1010,16 +1427,22 @@ shared_output_destroy(struct shared_output *so)
 	wl_event_source_remove(so->event_source);
 
 	wl_list_remove(&so->output_destroyed.link);
-	wl_list_remove(&so->frame_listener.link);
+	weston_capture_unsubscribe(so->capture);
+	shared_output_release_frame(so);
+
+	pixman_region32_fini(&so->worker.changed);
+	pixman_region32_fini(&so->worker.damage);
+	pixman_region32_fini(&so->pending_damage);
 
-	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
+	pixman_image_unref(so->worker.tile_image);
+	if (so->frame_image)
+		pixman_image_unref(so->frame_image);
 
 	free(so);
 }
 
 static struct shared_output *
-weston_output_share(struct weston_output *output, const char* command)
+weston_output_share(struct weston_output *output, struct screen_share *ss)
 {
 	int sv[2];
 	char str[32];
@@ -1028,7 +1451,7 @@ weston_output_share(struct weston_output *output, const char* command)
 	char *const argv[] = {
 	  "/bin/sh",
 	  "-c",
-	  (char*)command,
+	  ss->command,
 	  NULL
 	};
 
@@ -1072,7 +1495,7 @@ weston_output_share(struct weston_output *output, const char* command)
 		abort();
 	} else {
 		close(sv[1]);
-		return shared_output_create(output, sv[0]);
+		return shared_output_create(output, sv[0], ss);
 	}
 
 	return NULL;
@@ -1115,7 +1538,7 @@ share_output_binding(struct weston_keyboard *keyboard,
 		return;
 	}
 
-	weston_output_share(output, ss->command);
+	weston_output_share(output, ss);
 }
 
 WL_EXPORT int
@@ -1134,6 +1557,10 @@ wet_module_init(struct weston_compositor *compositor,
 	section = weston_config_get_section(config, "screen-share", NULL, NULL);
 
 	weston_config_section_get_string(section, "command", &ss->command, "");
+	weston_config_section_get_int(section, "scale", &ss->scale, 1);
+	if (ss->scale < 1)
+		ss->scale = 1;
+	weston_config_section_get_int(section, "max-fps", &ss->max_fps, 0);
 
 	weston_compositor_add_key_binding(compositor, KEY_S,
 				          MODIFIER_CTRL | MODIFIER_ALT,
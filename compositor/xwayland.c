@@ -153,6 +153,15 @@ spawn_xserver(void *user_data, const char *display, int abstract_fd, int unix_fd
 	return pid;
 }
 
+static void
+xserver_prestart(void *data)
+{
+	struct wet_xwayland *wxw = data;
+
+	if (wxw->api->spawn(wxw->xwayland) < 0)
+		weston_log("Failed to prestart the Xwayland server.\n");
+}
+
 static void
 xserver_cleanup(struct weston_process *process, int status)
 {
@@ -174,6 +183,9 @@ wet_load_xwayland(struct weston_compositor *comp)
 	struct weston_xwayland *xwayland;
 	struct wet_xwayland *wxw;
 	struct wl_event_loop *loop;
+	struct weston_config *config = wet_get_config(comp);
+	struct weston_config_section *section;
+	int prestart, idle_timeout;
 
 	if (weston_compositor_load_xwayland(comp) < 0)
 		return -1;
@@ -205,5 +217,18 @@ wet_load_xwayland(struct weston_compositor *comp)
 	wxw->sigusr1_source = wl_event_loop_add_signal(loop, SIGUSR1,
 						       handle_sigusr1, wxw);
 
+	section = weston_config_get_section(config, "xwayland", NULL, NULL);
+	weston_config_section_get_bool(section, "prestart", &prestart, 0);
+	weston_config_section_get_int(section, "idle-timeout",
+				      &idle_timeout, 0);
+
+	if (idle_timeout > 0)
+		api->set_idle_timeout(xwayland, idle_timeout * 60);
+
+	/* Start the server once the compositor is up and idle, so the
+	 * first X client does not have to wait for it. */
+	if (prestart)
+		wl_event_loop_add_idle(loop, xserver_prestart, wxw);
+
 	return 0;
 }
@@ -993,6 +993,21 @@ view_translate(struct workspace *ws, struct weston_view *view, double d)
 	weston_view_geometry_dirty(view);
 }
 
+/* Surfaces on a workspace out of sight get no repaints and only throttled
+ * frame callbacks; see weston_surface_set_suspended(). */
+static void
+workspace_set_suspended(struct workspace *ws, bool suspended)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &ws->layer.view_list.link, layer_link.link) {
+		if (is_focus_view(view))
+			continue;
+
+		weston_surface_set_suspended(view->surface, suspended);
+	}
+}
+
 static void
 workspace_translate_out(struct workspace *ws, double fraction)
 {
@@ -1091,6 +1106,7 @@ finish_workspace_change_animation(struct desktop_shell *shell,
 	shell->workspaces.anim_to = NULL;
 
 	weston_layer_unset_position(&shell->workspaces.anim_from->layer);
+	workspace_set_suspended(shell->workspaces.anim_from, true);
 }
 
 static void
@@ -1175,6 +1191,7 @@ animate_workspace_change(struct desktop_shell *shell,
 
 	weston_layer_set_position(&to->layer, WESTON_LAYER_POSITION_NORMAL);
 	weston_layer_set_position(&from->layer, WESTON_LAYER_POSITION_NORMAL - 1);
+	workspace_set_suspended(to, false);
 
 	workspace_translate_in(to, 0);
 
@@ -1190,6 +1207,8 @@ update_workspace(struct desktop_shell *shell, unsigned int index,
 	shell->workspaces.current = index;
 	weston_layer_set_position(&to->layer, WESTON_LAYER_POSITION_NORMAL);
 	weston_layer_unset_position(&from->layer);
+	workspace_set_suspended(to, false);
+	workspace_set_suspended(from, true);
 }
 
 static void
@@ -1938,6 +1957,8 @@ shell_surface_update_layer(struct shell_surface *shsurf)
 	weston_layer_entry_remove(&shsurf->view->layer_link);
 	weston_layer_entry_insert(new_layer_link, &shsurf->view->layer_link);
 	weston_view_geometry_dirty(shsurf->view);
+	/* This also brings minimized surfaces back */
+	weston_surface_set_suspended(surface, false);
 	weston_surface_damage(surface);
 
 	shell_surface_update_child_surface_layers(shsurf);
@@ -2059,6 +2080,8 @@ set_minimized(struct weston_surface *surface)
 
 	shell_surface_update_child_surface_layers(shsurf);
 	weston_view_damage_below(view);
+
+	weston_surface_set_suspended(surface, true);
 }
 
 
@@ -4420,6 +4443,7 @@ switcher_next(struct switcher *switcher)
 	wl_list_for_each_safe(view, tmp, &switcher->shell->minimized_layer.view_list.link, layer_link.link) {
 		weston_layer_entry_remove(&view->layer_link);
 		weston_layer_entry_insert(&ws->layer.view_list, &view->layer_link);
+		weston_surface_set_suspended(view->surface, false);
 		minimized = wl_array_add(&switcher->minimized_array, sizeof *minimized);
 		*minimized = view;
 	}
@@ -4505,6 +4529,7 @@ switcher_destroy(struct switcher *switcher)
 			weston_layer_entry_remove(&(*minimized)->layer_link);
 			weston_layer_entry_insert(&switcher->shell->minimized_layer.view_list, &(*minimized)->layer_link);
 			weston_view_damage_below(*minimized);
+			weston_surface_set_suspended((*minimized)->surface, true);
 		}
 	}
 	wl_array_release(&switcher->minimized_array);
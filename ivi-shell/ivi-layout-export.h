@@ -141,6 +141,14 @@ enum ivi_layout_transition_type{
 	IVI_LAYOUT_TRANSITION_MAX,
 };
 
+typedef void (*ivi_layout_surface_iterator_func_t)(
+			struct ivi_layout_surface *ivisurf,
+			void *data);
+
+typedef void (*ivi_layout_layer_iterator_func_t)(
+			struct ivi_layout_layer *ivilayer,
+			void *data);
+
 #define IVI_LAYOUT_API_NAME "ivi_layout_api_v1"
 
 struct ivi_layout_interface {
@@ -573,6 +581,36 @@ struct ivi_layout_interface {
 	 */
 	int32_t (*screen_remove_layer)(struct weston_output *output,
 				       struct ivi_layout_layer *removelayer);
+
+	/**
+	 * \brief Call func for each ivi_surface on the given ivi_layer, in
+	 * the same order as get_surfaces_on_layer() returns them, without
+	 * allocating an array.
+	 *
+	 * func must not commit changes or destroy ivi_surfaces.
+	 *
+	 * \return IVI_SUCCEEDED if the method call was successful
+	 * \return IVI_FAILED if the method call was failed
+	 */
+	int32_t (*for_each_surface_on_layer)(
+			struct ivi_layout_layer *ivilayer,
+			ivi_layout_surface_iterator_func_t func,
+			void *data);
+
+	/**
+	 * \brief Call func for each ivi_layer on the given weston_output, in
+	 * the same order as get_layers_on_screen() returns them, without
+	 * allocating an array.
+	 *
+	 * func must not commit changes or destroy ivi_layers.
+	 *
+	 * \return IVI_SUCCEEDED if the method call was successful
+	 * \return IVI_FAILED if the method call was failed
+	 */
+	int32_t (*for_each_layer_on_screen)(
+			struct weston_output *output,
+			ivi_layout_layer_iterator_func_t func,
+			void *data);
 };
 
 static inline const struct ivi_layout_interface *
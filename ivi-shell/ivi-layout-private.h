@@ -95,6 +95,9 @@ struct ivi_layout {
 	struct wl_list screen_list;	/* ivi_layout_screen::link */
 	struct wl_list view_list;	/* ivi_layout_view::link */
 
+	struct hash_table *surface_id_table;	/* id_surface -> ivi_layout_surface */
+	struct hash_table *layer_id_table;	/* id_layer -> ivi_layout_layer */
+
 	struct {
 		struct wl_signal created;
 		struct wl_signal removed;
@@ -47,7 +47,7 @@ struct ivi_layout_surface*
 ivi_layout_surface_create(struct weston_surface *wl_surface,
 			  uint32_t id_surface);
 
-void
+int
 ivi_layout_init_with_compositor(struct weston_compositor *ec);
 
 void
@@ -68,6 +68,7 @@
 #include "ivi-layout-private.h"
 #include "ivi-layout-shell.h"
 
+#include "shared/hash.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
 
@@ -111,31 +112,15 @@ get_instance(void)
  * Internal API to add/remove an ivi_layer to/from ivi_screen.
  */
 static struct ivi_layout_surface *
-get_surface(struct wl_list *surf_list, uint32_t id_surface)
+get_surface(struct ivi_layout *layout, uint32_t id_surface)
 {
-	struct ivi_layout_surface *ivisurf;
-
-	wl_list_for_each(ivisurf, surf_list, link) {
-		if (ivisurf->id_surface == id_surface) {
-			return ivisurf;
-		}
-	}
-
-	return NULL;
+	return hash_table_lookup(layout->surface_id_table, id_surface);
 }
 
 static struct ivi_layout_layer *
-get_layer(struct wl_list *layer_list, uint32_t id_layer)
+get_layer(struct ivi_layout *layout, uint32_t id_layer)
 {
-	struct ivi_layout_layer *ivilayer;
-
-	wl_list_for_each(ivilayer, layer_list, link) {
-		if (ivilayer->id_layer == id_layer) {
-			return ivilayer;
-		}
-	}
-
-	return NULL;
+	return hash_table_lookup(layout->layer_id_table, id_layer);
 }
 
 static bool
@@ -238,6 +223,9 @@ ivi_layout_surface_destroy(struct ivi_layout_surface *ivisurf)
 	}
 
 	wl_list_remove(&ivisurf->link);
+	if (get_surface(layout, ivisurf->id_surface) == ivisurf)
+		hash_table_remove(layout->surface_id_table,
+				  ivisurf->id_surface);
 
 	wl_list_for_each_safe(ivi_view, next, &ivisurf->view_list, surf_link) {
 		ivi_view_destroy(ivi_view);
@@ -982,31 +970,13 @@ ivi_layout_get_id_of_layer(struct ivi_layout_layer *ivilayer)
 static struct ivi_layout_layer *
 ivi_layout_get_layer_from_id(uint32_t id_layer)
 {
-	struct ivi_layout *layout = get_instance();
-	struct ivi_layout_layer *ivilayer = NULL;
-
-	wl_list_for_each(ivilayer, &layout->layer_list, link) {
-		if (ivilayer->id_layer == id_layer) {
-			return ivilayer;
-		}
-	}
-
-	return NULL;
+	return get_layer(get_instance(), id_layer);
 }
 
 struct ivi_layout_surface *
 ivi_layout_get_surface_from_id(uint32_t id_surface)
 {
-	struct ivi_layout *layout = get_instance();
-	struct ivi_layout_surface *ivisurf = NULL;
-
-	wl_list_for_each(ivisurf, &layout->surface_list, link) {
-		if (ivisurf->id_surface == id_surface) {
-			return ivisurf;
-		}
-	}
-
-	return NULL;
+	return get_surface(get_instance(), id_surface);
 }
 
 static int32_t
@@ -1135,6 +1105,32 @@ ivi_layout_get_layers_on_screen(struct weston_output *output,
 	return IVI_SUCCEEDED;
 }
 
+static int32_t
+ivi_layout_for_each_layer_on_screen(struct weston_output *output,
+				    ivi_layout_layer_iterator_func_t func,
+				    void *data)
+{
+	struct ivi_layout_screen *iviscrn = NULL;
+	struct ivi_layout_layer *ivilayer, *next;
+
+	if (output == NULL || func == NULL) {
+		weston_log("ivi_layout_for_each_layer_on_screen: invalid argument\n");
+		return IVI_FAILED;
+	}
+
+	iviscrn = get_screen_from_output(output);
+	if (iviscrn == NULL) {
+		weston_log("ivi_layout_for_each_layer_on_screen: invalid argument\n");
+		return IVI_FAILED;
+	}
+
+	wl_list_for_each_safe(ivilayer, next,
+			      &iviscrn->order.layer_list, order.link)
+		func(ivilayer, data);
+
+	return IVI_SUCCEEDED;
+}
+
 static int32_t
 ivi_layout_get_layers_under_surface(struct ivi_layout_surface *ivisurf,
 				    int32_t *pLength,
@@ -1244,6 +1240,25 @@ ivi_layout_get_surfaces_on_layer(struct ivi_layout_layer *ivilayer,
 	return IVI_SUCCEEDED;
 }
 
+static int32_t
+ivi_layout_for_each_surface_on_layer(struct ivi_layout_layer *ivilayer,
+				     ivi_layout_surface_iterator_func_t func,
+				     void *data)
+{
+	struct ivi_layout_view *ivi_view, *next;
+
+	if (ivilayer == NULL || func == NULL) {
+		weston_log("ivi_layout_for_each_surface_on_layer: invalid argument\n");
+		return IVI_FAILED;
+	}
+
+	wl_list_for_each_safe(ivi_view, next,
+			      &ivilayer->order.view_list, order_link)
+		func(ivi_view->ivisurf, data);
+
+	return IVI_SUCCEEDED;
+}
+
 static struct ivi_layout_layer *
 ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 				       int32_t width, int32_t height)
@@ -1251,7 +1266,7 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 	struct ivi_layout *layout = get_instance();
 	struct ivi_layout_layer *ivilayer = NULL;
 
-	ivilayer = get_layer(&layout->layer_list, id_layer);
+	ivilayer = get_layer(layout, id_layer);
 	if (ivilayer != NULL) {
 		weston_log("id_layer is already created\n");
 		++ivilayer->ref_count;
@@ -1278,6 +1293,12 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 	wl_list_init(&ivilayer->order.view_list);
 	wl_list_init(&ivilayer->order.link);
 
+	if (hash_table_insert(layout->layer_id_table, id_layer, ivilayer) < 0) {
+		weston_log("fails to allocate memory\n");
+		free(ivilayer);
+		return NULL;
+	}
+
 	wl_list_insert(&layout->layer_list, &ivilayer->link);
 
 	wl_signal_emit(&layout->layer_notification.created, ivilayer);
@@ -1310,6 +1331,7 @@ ivi_layout_layer_destroy(struct ivi_layout_layer *ivilayer)
 	wl_list_remove(&ivilayer->pending.link);
 	wl_list_remove(&ivilayer->order.link);
 	wl_list_remove(&ivilayer->link);
+	hash_table_remove(layout->layer_id_table, ivilayer->id_layer);
 
 	free(ivilayer);
 }
@@ -1873,7 +1895,7 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 		return NULL;
 	}
 
-	ivisurf = get_surface(&layout->surface_list, id_surface);
+	ivisurf = get_surface(layout, id_surface);
 	if (ivisurf != NULL) {
 		if (ivisurf->surface != NULL) {
 			weston_log("id_surface(%d) is already created\n", id_surface);
@@ -1902,6 +1924,13 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 
 	wl_list_init(&ivisurf->view_list);
 
+	if (hash_table_insert(layout->surface_id_table,
+			      id_surface, ivisurf) < 0) {
+		weston_log("fails to allocate memory\n");
+		free(ivisurf);
+		return NULL;
+	}
+
 	wl_list_insert(&layout->surface_list, &ivisurf->link);
 
 	wl_signal_emit(&layout->surface_notification.created, ivisurf);
@@ -1911,13 +1940,24 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 
 static struct ivi_layout_interface ivi_layout_interface;
 
-void
+int
 ivi_layout_init_with_compositor(struct weston_compositor *ec)
 {
 	struct ivi_layout *layout = get_instance();
 
 	layout->compositor = ec;
 
+	layout->surface_id_table = hash_table_create();
+	layout->layer_id_table = hash_table_create();
+	if (!layout->surface_id_table || !layout->layer_id_table) {
+		weston_log("fails to allocate memory\n");
+		hash_table_destroy(layout->surface_id_table);
+		hash_table_destroy(layout->layer_id_table);
+		layout->surface_id_table = NULL;
+		layout->layer_id_table = NULL;
+		return -1;
+	}
+
 	wl_list_init(&layout->surface_list);
 	wl_list_init(&layout->layer_list);
 	wl_list_init(&layout->screen_list);
@@ -1943,6 +1983,8 @@ ivi_layout_init_with_compositor(struct weston_compositor *ec)
 	weston_plugin_api_register(ec, IVI_LAYOUT_API_NAME,
 				   &ivi_layout_interface,
 				   sizeof(struct ivi_layout_interface));
+
+	return 0;
 }
 
 static struct ivi_layout_interface ivi_layout_interface = {
@@ -2014,4 +2056,10 @@ static struct ivi_layout_interface ivi_layout_interface = {
 	 */
 	.surface_get_size		= ivi_layout_surface_get_size,
 	.surface_dump			= ivi_layout_surface_dump,
+
+	/**
+	 * iteration without allocating
+	 */
+	.for_each_surface_on_layer	= ivi_layout_for_each_surface_on_layer,
+	.for_each_layer_on_screen	= ivi_layout_for_each_layer_on_screen,
 };
@@ -492,7 +492,9 @@ wet_shell_init(struct weston_compositor *compositor,
 			     shell, bind_ivi_application) == NULL)
 		goto out;
 
-	ivi_layout_init_with_compositor(compositor);
+	if (ivi_layout_init_with_compositor(compositor) < 0)
+		goto out;
+
 	shell_add_bindings(compositor, shell);
 
 	retval = 0;
@@ -173,6 +173,7 @@ weston_view_animation_frame(struct weston_animation *base,
 			     struct weston_view_animation, animation);
 	struct weston_compositor *compositor =
 		animation->view->surface->compositor;
+	double previous = animation->spring.current;
 
 	if (base->frame_counter <= 1)
 		animation->spring.timestamp = *time;
@@ -185,6 +186,12 @@ weston_view_animation_frame(struct weston_animation *base,
 		return;
 	}
 
+	/* The spring did not move since the last sample, e.g. because less
+	 * than one integration step has elapsed; the output keeps sampling
+	 * us without a repaint, so there is nothing to damage. */
+	if (base->frame_counter > 0 && animation->spring.current == previous)
+		return;
+
 	if (animation->frame)
 		animation->frame(animation);
 
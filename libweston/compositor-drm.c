@@ -41,6 +41,8 @@
 #include <sys/mman.h>
 #include <dlfcn.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -57,6 +59,7 @@
 #include "weston-egl-ext.h"
 #include "pixman-renderer.h"
 #include "pixel-formats.h"
+#include "timeline.h"
 #include "libbacklight.h"
 #include "libinput-seat.h"
 #include "launcher-util.h"
@@ -87,6 +90,23 @@
 
 #define MAX_CLONED_CONNECTORS 4
 
+/* Most views per output considered for planes by the TEST_ONLY search */
+#define DRM_PLANE_SEARCH_MAX_VIEWS 8
+
+/* Most TEST_ONLY commits per output and frame; each trial also imports the
+ * buffers of its views again */
+#define DRM_PLANE_SEARCH_MAX_TESTS 16
+
+/* Most views blended on top of a direct copy into a dumb buffer */
+#define DRM_DIRECT_COPY_MAX_ABOVE 4
+
+/* Buffer commits per second from which a view is worth a plane of its own,
+ * and below which a view already on one goes back to the renderer; apart,
+ * so that rates around the threshold do not restart the plane search every
+ * few frames */
+#define DRM_PLANE_HOT_ENTER_RATE 12.0f
+#define DRM_PLANE_HOT_LEAVE_RATE 8.0f
+
 /**
  * Represents the values of an enum-type KMS property
  */
@@ -131,6 +151,7 @@ enum wdrm_plane_property {
 	WDRM_PLANE_CRTC_H,
 	WDRM_PLANE_FB_ID,
 	WDRM_PLANE_CRTC_ID,
+	WDRM_PLANE_FB_DAMAGE_CLIPS,
 	WDRM_PLANE__COUNT
 };
 
@@ -172,6 +193,7 @@ static const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_CRTC_H] = { .name = "CRTC_H", },
 	[WDRM_PLANE_FB_ID] = { .name = "FB_ID", },
 	[WDRM_PLANE_CRTC_ID] = { .name = "CRTC_ID", },
+	[WDRM_PLANE_FB_DAMAGE_CLIPS] = { .name = "FB_DAMAGE_CLIPS", },
 };
 
 /**
@@ -248,6 +270,9 @@ struct drm_backend {
 
 	struct wl_list plane_list;
 	int sprites_are_broken;
+
+	/* Framebuffers of client buffers, see drm_fb_cache_add() */
+	struct wl_list fb_cache;
 	int sprites_hidden;
 
 	void *repaint_data;
@@ -273,6 +298,24 @@ struct drm_backend {
 	uint32_t pageflip_timeout;
 
 	bool shutting_down;
+
+	/* Asynchronous atomic commits are handed to this thread, so that
+	 * slow driver ioctls do not hold up the event loop. Finished jobs
+	 * are signalled back through the eventfd. */
+	struct {
+		bool running;
+		bool destroying;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t queue_cond;
+		pthread_cond_t idle_cond;
+		struct wl_list queue;
+		struct wl_list done;
+		struct drm_commit_job *current;
+		int in_flight;
+		int eventfd;
+		struct wl_event_source *source;
+	} commit_worker;
 };
 
 struct drm_mode {
@@ -306,6 +349,11 @@ struct drm_fb {
 
 	/* Used by dumb fbs */
 	void *map;
+
+	/* Used by client fbs in the fb cache */
+	struct weston_buffer *cache_buffer;
+	struct wl_listener cache_buffer_destroy;
+	struct wl_list cache_link;
 };
 
 struct drm_edid {
@@ -357,12 +405,16 @@ struct drm_plane_state {
 	struct drm_output_state *output_state;
 
 	struct drm_fb *fb;
+	struct weston_view *ev; /**< view shown on the plane, if any */
 
 	int32_t src_x, src_y;
 	uint32_t src_w, src_h;
 	int32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
 
+	/* FB_DAMAGE_CLIPS blob; 0 if the whole plane is damaged */
+	uint32_t damage_blob_id;
+
 	bool complete;
 
 	struct wl_list link; /* drm_output_state::plane_list */
@@ -457,7 +509,20 @@ struct drm_output {
 	struct drm_fb *dumb[2];
 	pixman_image_t *image[2];
 	int current_image;
-	pixman_region32_t previous_damage;
+	/* What each dumb buffer is missing, in global coordinates */
+	pixman_region32_t image_damage[2];
+	/* The shadow image missed frames copied directly from a client */
+	bool shadow_stale;
+
+	/* Views the last plane search put on planes, reused without a new
+	 * search or test as long as the scene hash does not change and no
+	 * commit of the output fails. */
+	struct {
+		bool valid;
+		uint32_t scene_hash;
+		struct weston_view *views[DRM_PLANE_SEARCH_MAX_VIEWS];
+		int count;
+	} plane_cache;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
@@ -1022,8 +1087,13 @@ err_free:
 static void
 drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
 {
-	assert(fb->buffer_ref.buffer == NULL);
 	assert(fb->type == BUFFER_CLIENT);
+
+	/* A cached fb may already be on another plane */
+	if (fb->buffer_ref.buffer == buffer)
+		return;
+
+	assert(fb->buffer_ref.buffer == NULL);
 	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
 
@@ -1034,8 +1104,13 @@ drm_fb_unref(struct drm_fb *fb)
 		return;
 
 	assert(fb->refcnt > 0);
-	if (--fb->refcnt > 0)
+	if (--fb->refcnt > 0) {
+		/* Only the cache is left holding it: nothing scans the
+		 * buffer out any more, so let the client have it back. */
+		if (fb->refcnt == 1 && fb->cache_buffer)
+			weston_buffer_reference(&fb->buffer_ref, NULL);
 		return;
+	}
 
 	switch (fb->type) {
 	case BUFFER_PIXMAN_DUMB:
@@ -1054,6 +1129,90 @@ drm_fb_unref(struct drm_fb *fb)
 	}
 }
 
+static void
+drm_fb_cache_remove(struct drm_fb *fb)
+{
+	wl_list_remove(&fb->cache_buffer_destroy.link);
+	wl_list_remove(&fb->cache_link);
+	fb->cache_buffer = NULL;
+	drm_fb_unref(fb);
+}
+
+static void
+drm_fb_cache_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct drm_fb *fb = container_of(listener, struct drm_fb,
+					 cache_buffer_destroy);
+
+	drm_fb_cache_remove(fb);
+}
+
+/**
+ * Keep a client buffer's framebuffer around for as long as the buffer lives
+ *
+ * Clients cycle through a handful of buffers, so after the first round
+ * putting one of them on a plane again costs no import and no AddFB. The
+ * cache holds a reference to the fb; the buffer itself is only held while
+ * some plane state uses the fb.
+ */
+static void
+drm_fb_cache_add(struct drm_backend *b, struct drm_fb *fb,
+		 struct weston_buffer *buffer)
+{
+	assert(fb->type == BUFFER_CLIENT);
+	assert(!fb->cache_buffer);
+
+	fb->cache_buffer = buffer;
+	fb->cache_buffer_destroy.notify = drm_fb_cache_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &fb->cache_buffer_destroy);
+	wl_list_insert(&b->fb_cache, &fb->cache_link);
+	drm_fb_ref(fb);
+}
+
+static struct drm_fb *
+drm_fb_cache_find(struct weston_buffer *buffer)
+{
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 drm_fb_cache_handle_buffer_destroy);
+	if (!listener)
+		return NULL;
+
+	return container_of(listener, struct drm_fb, cache_buffer_destroy);
+}
+
+/**
+ * Find the cached fb of a client buffer, if it fits the format wanted
+ *
+ * An fb whose format no longer fits, e.g. because the opaque region of an
+ * ARGB buffer changed, is dropped so the caller can import it anew.
+ */
+static struct drm_fb *
+drm_fb_cache_get(struct weston_buffer *buffer, uint32_t format)
+{
+	struct drm_fb *fb = drm_fb_cache_find(buffer);
+
+	if (!fb)
+		return NULL;
+
+	if (fb->format->format != format) {
+		drm_fb_cache_remove(fb);
+		return NULL;
+	}
+
+	return drm_fb_ref(fb);
+}
+
+static void
+drm_fb_cache_release(struct drm_backend *b)
+{
+	struct drm_fb *fb, *tmp;
+
+	wl_list_for_each_safe(fb, tmp, &b->fb_cache, cache_link)
+		drm_fb_cache_remove(fb);
+}
+
 /**
  * Allocate a new, empty, plane state.
  */
@@ -1098,6 +1257,9 @@ drm_plane_state_free(struct drm_plane_state *state, bool force)
 	state->output_state = NULL;
 
 	if (force || state != state->plane->state_cur) {
+		if (state->damage_blob_id != 0)
+			drmModeDestroyPropertyBlob(state->plane->backend->drm.fd,
+						   state->damage_blob_id);
 		drm_fb_unref(state->fb);
 		free(state);
 	}
@@ -1132,6 +1294,7 @@ drm_plane_state_duplicate(struct drm_output_state *state_output,
 	wl_list_insert(&state_output->plane_list, &dst->link);
 	if (src->fb)
 		dst->fb = drm_fb_ref(src->fb);
+	dst->damage_blob_id = 0;
 	dst->output_state = state_output;
 	dst->complete = false;
 
@@ -1555,6 +1718,7 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 	struct drm_plane_state *state;
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct drm_fb *cached;
 	struct gbm_bo *bo;
 	uint32_t format;
 
@@ -1602,29 +1766,48 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 		return NULL;
 	}
 
-	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   buffer->resource, GBM_BO_USE_SCANOUT);
-
-	/* Unable to use the buffer for scanout */
-	if (!bo)
-		return NULL;
-
-	format = drm_output_check_scanout_format(output, ev->surface, bo);
-	if (format == 0) {
-		drm_plane_state_put_back(state);
-		gbm_bo_destroy(bo);
-		return NULL;
+	cached = drm_fb_cache_find(buffer);
+	if (cached) {
+		format = drm_output_check_scanout_format(output, ev->surface,
+							 cached->bo);
+		if (format == 0) {
+			drm_plane_state_put_back(state);
+			return NULL;
+		}
+		state->fb = drm_fb_cache_get(buffer, format);
 	}
 
-	state->fb = drm_fb_get_from_bo(bo, b, format, BUFFER_CLIENT);
 	if (!state->fb) {
-		drm_plane_state_put_back(state);
-		gbm_bo_destroy(bo);
-		return NULL;
+		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
+				   buffer->resource, GBM_BO_USE_SCANOUT);
+
+		/* Unable to use the buffer for scanout */
+		if (!bo) {
+			drm_plane_state_put_back(state);
+			return NULL;
+		}
+
+		format = drm_output_check_scanout_format(output, ev->surface,
+							 bo);
+		if (format == 0) {
+			drm_plane_state_put_back(state);
+			gbm_bo_destroy(bo);
+			return NULL;
+		}
+
+		state->fb = drm_fb_get_from_bo(bo, b, format, BUFFER_CLIENT);
+		if (!state->fb) {
+			drm_plane_state_put_back(state);
+			gbm_bo_destroy(bo);
+			return NULL;
+		}
+
+		drm_fb_cache_add(b, state->fb, buffer);
 	}
 
 	drm_fb_set_buffer(state->fb, buffer);
 
+	state->ev = ev;
 	state->output = output;
 
 	state->src_x = 0;
@@ -1668,23 +1851,266 @@ drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage)
 	return ret;
 }
 
+/**
+ * Check that the layer mask of a view does not clip the given box
+ *
+ * The layer mask clips the view like a scissor does.
+ */
+static bool
+drm_view_layer_mask_contains(struct weston_view *ev, pixman_box32_t *box)
+{
+	struct weston_view *root;
+	struct weston_layer *layer;
+
+	for (root = ev; root->parent_view; root = root->parent_view)
+		;
+	layer = root->layer_link.layer;
+
+	return layer &&
+	       layer->mask.x1 <= box->x1 && layer->mask.y1 <= box->y1 &&
+	       layer->mask.x2 >= box->x2 && layer->mask.y2 >= box->y2;
+}
+
+/**
+ * Get the SHM buffer of a view that shows it unscaled and untransformed
+ *
+ * \return The XRGB or ARGB buffer of the view, or NULL if pixman would have
+ * to do more than an offset blit to draw it.
+ */
+static struct wl_shm_buffer *
+drm_view_get_plain_shm_buffer(struct weston_view *ev)
+{
+	struct weston_surface *es = ev->surface;
+	struct weston_buffer_viewport *viewport = &es->buffer_viewport;
+	struct wl_shm_buffer *shmbuf;
+
+	if (!es->buffer_ref.buffer)
+		return NULL;
+	shmbuf = wl_shm_buffer_get(es->buffer_ref.buffer->resource);
+	if (!shmbuf)
+		return NULL;
+
+	if (ev->alpha != 1.0f || ev->transform.enabled ||
+	    ev->geometry.scissor_enabled)
+		return NULL;
+	if (viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.scale != 1)
+		return NULL;
+	if (wl_shm_buffer_get_width(shmbuf) != es->width ||
+	    wl_shm_buffer_get_height(shmbuf) != es->height)
+		return NULL;
+
+	switch (wl_shm_buffer_get_format(shmbuf)) {
+	case WL_SHM_FORMAT_XRGB8888:
+	case WL_SHM_FORMAT_ARGB8888:
+		return shmbuf;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Find a view whose buffer can be copied into a dumb buffer as is
+ *
+ * That is a rendered view of the output with an opaque XRGB or ARGB SHM
+ * buffer covering the output exactly, without any scaling, transform or
+ * clipping. Nothing below it can be visible then. The views above it, which
+ * is usually just the cursor as pixman leaves that on the primary plane,
+ * are blended on top of the copy, so they have to be plain SHM views too and
+ * at most DRM_DIRECT_COPY_MAX_ABOVE of them.
+ *
+ * \param output The output to find the view for.
+ * \param above Filled with the views above the returned one, topmost first.
+ * \param n_above Filled with the number of views in above.
+ * \return The view to copy, or NULL if the output has to be rendered.
+ */
+static struct weston_view *
+drm_output_find_direct_copy_view(struct drm_output *output,
+				 struct weston_view **above, int *n_above)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_view *ev;
+	struct weston_surface *es;
+	struct wl_shm_buffer *shmbuf;
+	pixman_box32_t box = {
+		output->base.x, output->base.y,
+		output->base.x + output->base.width,
+		output->base.y + output->base.height
+	};
+	pixman_box32_t *extents;
+	pixman_region32_t opaque;
+	bool covered;
+
+	*n_above = 0;
+
+	if (output->gbm_format != GBM_FORMAT_XRGB8888 ||
+	    output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    output->base.current_scale != 1)
+		return NULL;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->base.id)))
+			continue;
+
+		es = ev->surface;
+		shmbuf = drm_view_get_plain_shm_buffer(ev);
+		if (!shmbuf)
+			return NULL;
+
+		/* Untransformed, so the bounding box is where it is drawn */
+		extents = pixman_region32_extents(&ev->transform.boundingbox);
+		if (extents->x1 == box.x1 && extents->y1 == box.y1 &&
+		    es->width == output->base.current_mode->width &&
+		    es->height == output->base.current_mode->height &&
+		    drm_view_layer_mask_contains(ev, &box))
+			break;
+
+		/* Something to blend on top of the copy */
+		if (*n_above == DRM_DIRECT_COPY_MAX_ABOVE ||
+		    !drm_view_layer_mask_contains(ev, extents))
+			return NULL;
+		above[(*n_above)++] = ev;
+	}
+	if (&ev->link == &ec->view_list)
+		return NULL;
+
+	if (wl_shm_buffer_get_format(shmbuf) == WL_SHM_FORMAT_XRGB8888)
+		return ev;
+
+	pixman_region32_init_rect(&opaque, 0, 0, es->width, es->height);
+	pixman_region32_subtract(&opaque, &opaque, &es->opaque);
+	covered = !pixman_region32_not_empty(&opaque);
+	pixman_region32_fini(&opaque);
+
+	return covered ? ev : NULL;
+}
+
+/**
+ * Composite the SHM buffer of a view into a dumb buffer
+ */
+static void
+drm_output_blit_view_pixman(struct drm_output *output,
+			    struct weston_view *ev,
+			    pixman_op_t op)
+{
+	struct wl_shm_buffer *shmbuf =
+		wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
+	pixman_image_t *dst = output->image[output->current_image];
+	pixman_box32_t *extents =
+		pixman_region32_extents(&ev->transform.boundingbox);
+	pixman_image_t *src;
+	pixman_format_code_t format;
+	int width = wl_shm_buffer_get_width(shmbuf);
+	int height = wl_shm_buffer_get_height(shmbuf);
+
+	if (wl_shm_buffer_get_format(shmbuf) == WL_SHM_FORMAT_ARGB8888)
+		format = PIXMAN_a8r8g8b8;
+	else
+		format = PIXMAN_x8r8g8b8;
+
+	wl_shm_buffer_begin_access(shmbuf);
+	src = pixman_image_create_bits(format, width, height,
+				       wl_shm_buffer_get_data(shmbuf),
+				       wl_shm_buffer_get_stride(shmbuf));
+	pixman_image_composite32(op, src, NULL, dst, 0, 0, 0, 0,
+				 extents->x1 - output->base.x,
+				 extents->y1 - output->base.y,
+				 width, height);
+	pixman_image_unref(src);
+	wl_shm_buffer_end_access(shmbuf);
+}
+
+/**
+ * Copy a region of a client SHM buffer straight into a dumb buffer
+ *
+ * The views above it are blended on top within the same region. Stands in
+ * for the renderer, including what it does for screen capture.
+ */
+static void
+drm_output_copy_view_pixman(struct drm_output *output,
+			    struct weston_view *ev,
+			    struct weston_view **above, int n_above,
+			    pixman_region32_t *region,
+			    pixman_region32_t *damage)
+{
+	pixman_image_t *dst = output->image[output->current_image];
+	pixman_region32_t local;
+	int i;
+
+	pixman_region32_init(&local);
+	pixman_region32_copy(&local, region);
+	pixman_region32_translate(&local, -output->base.x, -output->base.y);
+
+	pixman_image_set_clip_region32(dst, &local);
+	drm_output_blit_view_pixman(output, ev, PIXMAN_OP_SRC);
+	for (i = n_above - 1; i >= 0; i--)
+		drm_output_blit_view_pixman(output, above[i], PIXMAN_OP_OVER);
+	pixman_image_set_clip_region32(dst, NULL);
+
+	pixman_region32_fini(&local);
+
+	pixman_renderer_output_set_buffer(&output->base, dst);
+	pixman_region32_copy(&output->base.previous_damage, damage);
+	wl_signal_emit(&output->base.frame_signal, &output->base);
+}
+
+/**
+ * Bring the next dumb buffer up to date
+ *
+ * Each dumb buffer tracks the damage it missed while the other one was
+ * shown, so only that plus this frame's damage is copied out of the shadow
+ * image, or straight out of a client buffer that covers the whole output.
+ */
 static struct drm_fb *
 drm_output_render_pixman(struct drm_output_state *state,
 			 pixman_region32_t *damage)
 {
 	struct drm_output *output = state->output;
 	struct weston_compositor *ec = output->base.compositor;
+	struct drm_backend *b = to_drm_backend(ec);
+	pixman_region32_t *stale;
+	pixman_region32_t region;
+	struct weston_view *ev;
+	struct weston_view *above[DRM_DIRECT_COPY_MAX_ABOVE];
+	int n_above;
+	unsigned int i;
 
 	output->current_image ^= 1;
+	stale = &output->image_damage[output->current_image];
+
+	ev = drm_output_find_direct_copy_view(output, above, &n_above);
+	if (ev) {
+		pixman_region32_init(&region);
+		pixman_region32_union(&region, damage, stale);
+		drm_output_copy_view_pixman(output, ev, above, n_above,
+					    &region, damage);
+		pixman_region32_fini(&region);
+
+		if (b->use_pixman_shadow)
+			output->shadow_stale = true;
+	} else {
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->image[output->current_image]);
+		pixman_renderer_output_set_hw_extra_damage(&output->base,
+							   stale);
+
+		/* The shadow has to be redrawn fully after direct copies */
+		if (output->shadow_stale) {
+			output->shadow_stale = false;
+			ec->renderer->repaint_output(&output->base,
+						     &output->base.region);
+		} else {
+			ec->renderer->repaint_output(&output->base, damage);
+		}
+	}
 
-	pixman_renderer_output_set_buffer(&output->base,
-					  output->image[output->current_image]);
-	pixman_renderer_output_set_hw_extra_damage(&output->base,
-						   &output->previous_damage);
-
-	ec->renderer->repaint_output(&output->base, damage);
-
-	pixman_region32_copy(&output->previous_damage, damage);
+	pixman_region32_clear(stale);
+	for (i = 0; i < ARRAY_LENGTH(output->image_damage); i++) {
+		if (i == (unsigned int) output->current_image)
+			continue;
+		pixman_region32_union(&output->image_damage[i],
+				      &output->image_damage[i], damage);
+	}
 
 	return drm_fb_ref(output->dumb[output->current_image]);
 }
@@ -1744,6 +2170,206 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 				 &c->primary_plane.damage, damage);
 }
 
+/* Layout of struct drm_mode_rect, which older kernel headers lack */
+struct drm_damage_clip {
+	int32_t x1, y1, x2, y2;
+};
+
+/* Beyond this many clips, the extents are sent instead */
+#define DRM_PLANE_MAX_DAMAGE_CLIPS 32
+
+/**
+ * Map damage in global coordinates to the buffer of a view on a plane
+ *
+ * Only views with at most a translation and scale get put on planes, so each
+ * damage rectangle maps to one rectangle in the surface; the viewport and
+ * buffer transform are then applied by weston_surface_to_buffer_region.
+ */
+static void
+drm_view_damage_to_buffer(struct weston_view *ev, pixman_region32_t *global,
+			  pixman_region32_t *out)
+{
+	struct weston_surface *es = ev->surface;
+	pixman_region32_t clipped, surface_damage;
+	pixman_box32_t *rects, box;
+	wl_fixed_t sx1, sy1, sx2, sy2;
+	int i, n;
+
+	pixman_region32_init(&clipped);
+	pixman_region32_init(&surface_damage);
+	pixman_region32_intersect(&clipped, global, &ev->transform.boundingbox);
+	rects = pixman_region32_rectangles(&clipped, &n);
+
+	for (i = 0; i < n; i++) {
+		weston_view_from_global_fixed(ev,
+					      wl_fixed_from_int(rects[i].x1),
+					      wl_fixed_from_int(rects[i].y1),
+					      &sx1, &sy1);
+		weston_view_from_global_fixed(ev,
+					      wl_fixed_from_int(rects[i].x2),
+					      wl_fixed_from_int(rects[i].y2),
+					      &sx2, &sy2);
+
+		box.x1 = MAX(wl_fixed_to_int(sx1), 0);
+		box.y1 = MAX(wl_fixed_to_int(sy1), 0);
+		box.x2 = MIN(wl_fixed_to_int(sx2 + wl_fixed_from_int(1) - 1),
+			     es->width);
+		box.y2 = MIN(wl_fixed_to_int(sy2 + wl_fixed_from_int(1) - 1),
+			     es->height);
+		if (box.x1 >= box.x2 || box.y1 >= box.y2)
+			continue;
+
+		pixman_region32_union_rect(&surface_damage, &surface_damage,
+					   box.x1, box.y1,
+					   box.x2 - box.x1, box.y2 - box.y1);
+	}
+
+	weston_surface_to_buffer_region(es, &surface_damage, out);
+
+	pixman_region32_fini(&surface_damage);
+	pixman_region32_fini(&clipped);
+}
+
+/**
+ * Check whether anything on the output is stacked above a view
+ *
+ * The damage accumulated on a view's plane has the opaque parts of the views
+ * above it taken out, so it says nothing about those parts of the buffer.
+ */
+static bool
+drm_view_is_covered(struct drm_output *output, struct weston_view *ev)
+{
+	struct weston_view *above;
+	pixman_region32_t overlap;
+	bool covered = false;
+
+	pixman_region32_init(&overlap);
+
+	wl_list_for_each(above, &output->base.compositor->view_list, link) {
+		if (above == ev)
+			break;
+
+		if (!(above->output_mask & (1u << output->base.id)))
+			continue;
+
+		pixman_region32_intersect(&overlap,
+					  &above->transform.boundingbox,
+					  &ev->transform.boundingbox);
+		if (pixman_region32_not_empty(&overlap)) {
+			covered = true;
+			break;
+		}
+	}
+
+	pixman_region32_fini(&overlap);
+
+	return covered;
+}
+
+/**
+ * Attach damage, in framebuffer coordinates, to a plane state
+ */
+static void
+drm_plane_state_set_damage(struct drm_plane_state *state,
+			   pixman_region32_t *damage)
+{
+	struct drm_backend *b = state->plane->backend;
+	struct drm_damage_clip *clips;
+	pixman_box32_t *rects;
+	int i, n;
+
+	/* No clips would mean everything is damaged; a single empty clip
+	 * says nothing is. */
+	rects = pixman_region32_rectangles(damage, &n);
+	if (n == 0 || n > DRM_PLANE_MAX_DAMAGE_CLIPS) {
+		rects = pixman_region32_extents(damage);
+		n = 1;
+	}
+
+	clips = calloc(n, sizeof *clips);
+	if (!clips)
+		return;
+
+	for (i = 0; i < n; i++) {
+		clips[i].x1 = rects[i].x1;
+		clips[i].y1 = rects[i].y1;
+		clips[i].x2 = rects[i].x2;
+		clips[i].y2 = rects[i].y2;
+	}
+
+	if (drmModeCreatePropertyBlob(b->drm.fd, clips, n * sizeof *clips,
+				      &state->damage_blob_id) != 0)
+		state->damage_blob_id = 0;
+
+	free(clips);
+}
+
+/**
+ * Tell the kernel which parts of each plane changed since the last frame
+ *
+ * Drivers which have to copy or transmit the framebuffer contents, such as
+ * USB, SPI and virtual displays, can then skip everything else. A plane
+ * gets no clips, and so counts as fully damaged, unless it shows the same
+ * thing in the same place as in the current state, and, for a client
+ * buffer, nothing else on the output is stacked above it.
+ */
+static void
+drm_output_state_set_damage(struct drm_output_state *state,
+			    pixman_region32_t *output_damage)
+{
+	struct drm_output *output = state->output;
+	struct drm_plane_state *ps, *cur;
+	pixman_region32_t damage;
+
+	wl_list_for_each(ps, &state->plane_list, link) {
+		struct drm_plane *plane = ps->plane;
+
+		if (!ps->fb || plane->type == WDRM_PLANE_TYPE_CURSOR)
+			continue;
+
+		cur = plane->state_cur;
+		if (!cur->fb || cur->ev != ps->ev ||
+		    cur->fb->width != ps->fb->width ||
+		    cur->fb->height != ps->fb->height ||
+		    cur->src_x != ps->src_x || cur->src_y != ps->src_y ||
+		    cur->src_w != ps->src_w || cur->src_h != ps->src_h ||
+		    cur->dest_x != ps->dest_x || cur->dest_y != ps->dest_y ||
+		    cur->dest_w != ps->dest_w || cur->dest_h != ps->dest_h)
+			goto next;
+
+		if (plane->props[WDRM_PLANE_FB_DAMAGE_CLIPS].prop_id == 0)
+			goto next;
+
+		if (ps->ev && drm_view_is_covered(output, ps->ev))
+			goto next;
+
+		pixman_region32_init(&damage);
+		if (ps->ev) {
+			drm_view_damage_to_buffer(ps->ev, &plane->base.damage,
+						  &damage);
+		} else {
+			/* Renderer output on the scanout plane */
+			pixman_region32_intersect(&damage, output_damage,
+						  &output->base.region);
+			pixman_region32_translate(&damage, -output->base.x,
+						  -output->base.y);
+			weston_transformed_region(output->base.width,
+						  output->base.height,
+						  output->base.transform,
+						  output->base.current_scale,
+						  &damage, &damage);
+		}
+		drm_plane_state_set_damage(ps, &damage);
+		pixman_region32_fini(&damage);
+
+next:
+		if (ps->ev) {
+			pixman_region32_fini(&plane->base.damage);
+			pixman_region32_init(&plane->base.damage);
+		}
+	}
+}
+
 static void
 drm_output_set_gamma(struct weston_output *output_base,
 		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b)
@@ -1980,20 +2606,420 @@ err:
 }
 
 #ifdef HAVE_DRM_ATOMIC
-static int
-crtc_add_prop(drmModeAtomicReq *req, struct drm_output *output,
-	      enum wdrm_crtc_property prop, uint64_t val)
-{
-	struct drm_property_info *info = &output->props_crtc[prop];
-	int ret;
-
-	if (info->prop_id == 0)
-		return -1;
+/**
+ * An atomic commit queued on the commit worker
+ *
+ * The request is compiled on the compositor thread; the worker only issues
+ * the ioctl. The CRTCs are kept rather than the outputs, as an output may
+ * be gone by the time the job comes back.
+ */
+struct drm_commit_job {
+	struct wl_list link;
+	drmModeAtomicReq *req;
+	uint32_t flags;
+	struct wl_array outputs; /* struct drm_commit_job_output */
+	int error;
+};
 
-	ret = drmModeAtomicAddProperty(req, output->crtc_id, info->prop_id,
-				       val);
-	return (ret <= 0) ? -1 : 0;
-}
+/**
+ * One output touched by a queued commit
+ *
+ * state_prev is the state which was current when the job was queued, i.e.
+ * what is still on screen if the commit fails.
+ */
+struct drm_commit_job_output {
+	uint32_t crtc_id;
+	struct drm_output_state *state;
+	struct drm_output_state *state_prev;
+};
+
+static void *
+drm_commit_worker_thread(void *data)
+{
+	struct drm_backend *b = data;
+	struct drm_commit_job *job;
+	uint64_t one = 1;
+	int ret;
+
+	pthread_mutex_lock(&b->commit_worker.mutex);
+
+	while (!b->commit_worker.destroying) {
+		if (wl_list_empty(&b->commit_worker.queue)) {
+			pthread_cond_wait(&b->commit_worker.queue_cond,
+					  &b->commit_worker.mutex);
+			continue;
+		}
+
+		job = container_of(b->commit_worker.queue.next,
+				   struct drm_commit_job, link);
+		wl_list_remove(&job->link);
+		b->commit_worker.current = job;
+		pthread_mutex_unlock(&b->commit_worker.mutex);
+
+		ret = drmModeAtomicCommit(b->drm.fd, job->req, job->flags, b);
+		job->error = (ret != 0) ? errno : 0;
+
+		pthread_mutex_lock(&b->commit_worker.mutex);
+		b->commit_worker.current = NULL;
+		wl_list_insert(b->commit_worker.done.prev, &job->link);
+		b->commit_worker.in_flight--;
+		pthread_cond_broadcast(&b->commit_worker.idle_cond);
+
+		if (write(b->commit_worker.eventfd, &one, sizeof one) < 0)
+			weston_log("atomic: couldn't signal commit: %m\n");
+	}
+
+	pthread_mutex_unlock(&b->commit_worker.mutex);
+
+	return NULL;
+}
+
+/**
+ * Hand a compiled atomic request over to the commit worker
+ *
+ * Takes ownership of req. The output states are assigned by the caller
+ * straight away, as if the commit had already succeeded; a failure is
+ * dealt with once the job comes back. Must be called before the states are
+ * assigned, so the previous states can be recorded.
+ */
+static void
+drm_commit_worker_queue(struct drm_backend *b,
+			struct drm_pending_state *pending_state,
+			drmModeAtomicReq *req, uint32_t flags)
+{
+	struct drm_output_state *output_state;
+	struct drm_commit_job *job;
+	struct drm_commit_job_output *jo;
+
+	job = zalloc(sizeof *job);
+	if (!job) {
+		weston_log("atomic: out of memory, committing synchronously\n");
+		if (drmModeAtomicCommit(b->drm.fd, req, flags, b) != 0)
+			weston_log("atomic: couldn't commit new state: %m\n");
+		drmModeAtomicFree(req);
+		return;
+	}
+
+	job->req = req;
+	job->flags = flags;
+	wl_array_init(&job->outputs);
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		jo = wl_array_add(&job->outputs, sizeof *jo);
+		if (jo) {
+			jo->crtc_id = output_state->output->crtc_id;
+			jo->state = output_state;
+			jo->state_prev = output_state->output->state_cur;
+		}
+		TL_POINT("drm_commit_queued",
+			 TLP_OUTPUT(&output_state->output->base), TLP_END);
+	}
+
+	pthread_mutex_lock(&b->commit_worker.mutex);
+	wl_list_insert(b->commit_worker.queue.prev, &job->link);
+	b->commit_worker.in_flight++;
+	pthread_cond_signal(&b->commit_worker.queue_cond);
+	pthread_mutex_unlock(&b->commit_worker.mutex);
+}
+
+/**
+ * Put back the state a failed commit was meant to replace
+ *
+ * drm_output_assign_state made the failed state current and kept the
+ * previous one as state_last. Swap them back, including the plane states,
+ * so that the state which gets freed on completion is the one which never
+ * reached the screen.
+ */
+static void
+drm_output_restore_state(struct drm_output *output)
+{
+	struct drm_output_state *failed = output->state_cur;
+	struct drm_output_state *prev = output->state_last;
+	struct drm_plane_state *ps;
+
+	wl_list_for_each(ps, &failed->plane_list, link)
+		ps->plane->state_cur = NULL;
+
+	wl_list_for_each(ps, &prev->plane_list, link)
+		ps->plane->state_cur = ps;
+
+	/* Planes the failed state took over from another output or from
+	 * nothing get a fresh orphaned state; the previous one is gone, and
+	 * state_invalid makes the next commit program them from scratch. */
+	wl_list_for_each(ps, &failed->plane_list, link) {
+		if (!ps->plane->state_cur)
+			ps->plane->state_cur =
+				drm_plane_state_alloc(NULL, ps->plane);
+	}
+
+	output->state_cur = prev;
+	output->state_last = failed;
+}
+
+static void
+drm_commit_job_complete(struct drm_backend *b, struct drm_commit_job *job)
+{
+	struct drm_output *output;
+	struct drm_commit_job_output *jo;
+	struct timespec now;
+
+	if (job->error != 0) {
+		weston_log("atomic: couldn't commit new state: %s\n",
+			   strerror(job->error));
+		/* Whatever we believe is on screen now is wrong; send
+		 * everything again with the next commit. */
+		b->state_invalid = true;
+	}
+
+	wl_array_for_each(jo, &job->outputs) {
+		output = drm_output_find_by_crtc(b, jo->crtc_id);
+		if (!output)
+			continue;
+
+		TL_POINT("drm_commit_done", TLP_OUTPUT(&output->base),
+			 TLP_END);
+
+		/* Cached plane assignments are not tested again */
+		if (job->error != 0)
+			output->plane_cache.valid = false;
+
+		/* No event will come for a failed commit, so finish the
+		 * frame here to keep the repaint loop running. */
+		if (job->error == 0 || !output->atomic_complete_pending)
+			continue;
+
+		if (output->state_cur == jo->state &&
+		    output->state_last == jo->state_prev)
+			drm_output_restore_state(output);
+
+		output->atomic_complete_pending = 0;
+		weston_compositor_read_presentation_clock(b->compositor, &now);
+		drm_output_update_complete(output, 0, now.tv_sec,
+					   now.tv_nsec / 1000);
+	}
+
+	wl_array_release(&job->outputs);
+	drmModeAtomicFree(job->req);
+	free(job);
+}
+
+/**
+ * Process the jobs the commit worker has finished with
+ */
+static void
+drm_commit_worker_dispatch(struct drm_backend *b)
+{
+	struct drm_commit_job *job, *tmp;
+	struct wl_list done;
+
+	wl_list_init(&done);
+
+	pthread_mutex_lock(&b->commit_worker.mutex);
+	wl_list_insert_list(&done, &b->commit_worker.done);
+	wl_list_init(&b->commit_worker.done);
+	pthread_mutex_unlock(&b->commit_worker.mutex);
+
+	wl_list_for_each_safe(job, tmp, &done, link) {
+		wl_list_remove(&job->link);
+		drm_commit_job_complete(b, job);
+	}
+}
+
+/**
+ * Wait for all queued commits to reach the kernel
+ *
+ * Must be called before anything which needs the KMS state to be what the
+ * compositor thinks it is, such as synchronous commits or VT switches.
+ */
+static void
+drm_commit_worker_flush(struct drm_backend *b)
+{
+	if (!b->commit_worker.running)
+		return;
+
+	pthread_mutex_lock(&b->commit_worker.mutex);
+	while (b->commit_worker.in_flight > 0)
+		pthread_cond_wait(&b->commit_worker.idle_cond,
+				  &b->commit_worker.mutex);
+	pthread_mutex_unlock(&b->commit_worker.mutex);
+
+	drm_commit_worker_dispatch(b);
+}
+
+static bool
+drm_commit_job_has_crtc(struct drm_commit_job *job, uint32_t crtc_id)
+{
+	struct drm_commit_job_output *jo;
+
+	wl_array_for_each(jo, &job->outputs) {
+		if (jo->crtc_id == crtc_id)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Whether a commit touching a CRTC is queued or being issued
+ *
+ * Must be called with the commit worker mutex held.
+ */
+static bool
+drm_commit_worker_has_crtc(struct drm_backend *b, uint32_t crtc_id)
+{
+	struct drm_commit_job *job;
+
+	if (b->commit_worker.current &&
+	    drm_commit_job_has_crtc(b->commit_worker.current, crtc_id))
+		return true;
+
+	wl_list_for_each(job, &b->commit_worker.queue, link) {
+		if (drm_commit_job_has_crtc(job, crtc_id))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Wait for the queued commits touching an output to reach the kernel
+ *
+ * Commits for other outputs are left alone: planes they touch stay
+ * unavailable until their commits complete, see drm_plane_is_available, so
+ * nothing a TEST_ONLY commit for this output uses depends on them.
+ */
+static void
+drm_commit_worker_flush_output(struct drm_backend *b,
+			       struct drm_output *output)
+{
+	if (!b->commit_worker.running)
+		return;
+
+	pthread_mutex_lock(&b->commit_worker.mutex);
+	while (drm_commit_worker_has_crtc(b, output->crtc_id))
+		pthread_cond_wait(&b->commit_worker.idle_cond,
+				  &b->commit_worker.mutex);
+	pthread_mutex_unlock(&b->commit_worker.mutex);
+
+	drm_commit_worker_dispatch(b);
+}
+
+static int
+on_drm_commit_done(int fd, uint32_t mask, void *data)
+{
+	struct drm_backend *b = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		weston_log("atomic: couldn't read commit eventfd: %m\n");
+
+	drm_commit_worker_dispatch(b);
+
+	return 1;
+}
+
+static void
+drm_commit_worker_start(struct drm_backend *b, struct wl_event_loop *loop)
+{
+	if (!b->atomic_modeset || getenv("WESTON_DISABLE_COMMIT_THREAD"))
+		return;
+
+	b->commit_worker.eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (b->commit_worker.eventfd < 0) {
+		weston_log("atomic: couldn't create eventfd: %m\n");
+		return;
+	}
+
+	b->commit_worker.source =
+		wl_event_loop_add_fd(loop, b->commit_worker.eventfd,
+				     WL_EVENT_READABLE, on_drm_commit_done, b);
+	if (!b->commit_worker.source)
+		goto err_eventfd;
+
+	wl_list_init(&b->commit_worker.queue);
+	wl_list_init(&b->commit_worker.done);
+	b->commit_worker.current = NULL;
+	b->commit_worker.in_flight = 0;
+	b->commit_worker.destroying = false;
+	pthread_mutex_init(&b->commit_worker.mutex, NULL);
+	pthread_cond_init(&b->commit_worker.queue_cond, NULL);
+	pthread_cond_init(&b->commit_worker.idle_cond, NULL);
+
+	if (pthread_create(&b->commit_worker.thread, NULL,
+			   drm_commit_worker_thread, b) != 0) {
+		weston_log("atomic: couldn't start commit thread\n");
+		pthread_mutex_destroy(&b->commit_worker.mutex);
+		pthread_cond_destroy(&b->commit_worker.queue_cond);
+		pthread_cond_destroy(&b->commit_worker.idle_cond);
+		wl_event_source_remove(b->commit_worker.source);
+		goto err_eventfd;
+	}
+
+	b->commit_worker.running = true;
+	weston_log("DRM: atomic commits run on a separate thread\n");
+	return;
+
+err_eventfd:
+	close(b->commit_worker.eventfd);
+	b->commit_worker.eventfd = -1;
+}
+
+static void
+drm_commit_worker_stop(struct drm_backend *b)
+{
+	if (!b->commit_worker.running)
+		return;
+
+	drm_commit_worker_flush(b);
+
+	pthread_mutex_lock(&b->commit_worker.mutex);
+	b->commit_worker.destroying = true;
+	pthread_cond_signal(&b->commit_worker.queue_cond);
+	pthread_mutex_unlock(&b->commit_worker.mutex);
+
+	pthread_join(b->commit_worker.thread, NULL);
+	b->commit_worker.running = false;
+
+	pthread_mutex_destroy(&b->commit_worker.mutex);
+	pthread_cond_destroy(&b->commit_worker.queue_cond);
+	pthread_cond_destroy(&b->commit_worker.idle_cond);
+
+	wl_event_source_remove(b->commit_worker.source);
+	close(b->commit_worker.eventfd);
+	b->commit_worker.eventfd = -1;
+}
+#else
+static void
+drm_commit_worker_flush(struct drm_backend *b)
+{
+}
+
+static void
+drm_commit_worker_start(struct drm_backend *b, struct wl_event_loop *loop)
+{
+}
+
+static void
+drm_commit_worker_stop(struct drm_backend *b)
+{
+}
+#endif
+
+#ifdef HAVE_DRM_ATOMIC
+static int
+crtc_add_prop(drmModeAtomicReq *req, struct drm_output *output,
+	      enum wdrm_crtc_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &output->props_crtc[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, output->crtc_id, info->prop_id,
+				       val);
+	return (ret <= 0) ? -1 : 0;
+}
 
 static int
 connector_add_prop(drmModeAtomicReq *req, struct drm_head *head,
@@ -2107,6 +3133,10 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 				      plane_state->dest_w);
 		ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_H,
 				      plane_state->dest_h);
+		if (plane_state->damage_blob_id != 0)
+			ret |= plane_add_prop(req, plane,
+					      WDRM_PLANE_FB_DAMAGE_CLIPS,
+					      plane_state->damage_blob_id);
 
 		if (ret != 0) {
 			weston_log("couldn't set plane state\n");
@@ -2135,6 +3165,10 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 	if (!req)
 		return -1;
 
+	/* Anything still queued has to hit the kernel before this does */
+	if (mode == DRM_STATE_APPLY_SYNC)
+		drm_commit_worker_flush(b);
+
 	if (b->state_invalid) {
 		struct weston_head *head_base;
 		struct drm_head *head;
@@ -2243,10 +3277,18 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 		break;
 	}
 
-	ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
-	if (ret != 0) {
-		weston_log("atomic: couldn't commit new state: %m\n");
-		goto out;
+	if (mode == DRM_STATE_APPLY_ASYNC && b->commit_worker.running) {
+		drm_commit_worker_queue(b, pending_state, req, flags);
+		req = NULL;
+	} else {
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
+		if (ret != 0) {
+			weston_log("atomic: couldn't commit new state: %m\n");
+			wl_list_for_each(output_state,
+					 &pending_state->output_list, link)
+				output_state->output->plane_cache.valid = false;
+			goto out;
+		}
 	}
 
 	wl_list_for_each_safe(output_state, tmp, &pending_state->output_list,
@@ -2258,7 +3300,8 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 	assert(wl_list_empty(&pending_state->output_list));
 
 out:
-	drmModeAtomicFree(req);
+	if (req)
+		drmModeAtomicFree(req);
 	drm_pending_state_free(pending_state);
 	return ret;
 }
@@ -2375,6 +3418,7 @@ drm_output_repaint(struct weston_output *output_base,
 {
 	struct drm_pending_state *pending_state = repaint_data;
 	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *b = to_drm_backend(output_base->compositor);
 	struct drm_output_state *state = NULL;
 	struct drm_plane_state *scanout_state;
 
@@ -2399,6 +3443,9 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!scanout_state || !scanout_state->fb)
 		goto err;
 
+	if (b->atomic_modeset)
+		drm_output_state_set_damage(state, damage);
+
 	return 0;
 
 err:
@@ -2671,7 +3718,9 @@ drm_output_prepare_overlay_view(struct drm_output_state *output_state,
 	struct drm_plane *p;
 	struct drm_plane_state *state = NULL;
 	struct linux_dmabuf_buffer *dmabuf;
-	struct gbm_bo *bo;
+	struct weston_buffer *buffer;
+	struct drm_fb *cached;
+	struct gbm_bo *bo = NULL;
 	pixman_region32_t dest_rect, src_rect;
 	pixman_box32_t *box, tbox;
 	uint32_t format;
@@ -2688,9 +3737,10 @@ drm_output_prepare_overlay_view(struct drm_output_state *output_state,
 	if (b->gbm == NULL)
 		return NULL;
 
-	if (ev->surface->buffer_ref.buffer == NULL)
+	buffer = ev->surface->buffer_ref.buffer;
+	if (buffer == NULL)
 		return NULL;
-	buffer_resource = ev->surface->buffer_ref.buffer->resource;
+	buffer_resource = buffer->resource;
 	if (wl_shm_buffer_get(buffer_resource))
 		return NULL;
 
@@ -2724,6 +3774,16 @@ drm_output_prepare_overlay_view(struct drm_output_state *output_state,
 	if (!state)
 		return NULL;
 
+	cached = drm_fb_cache_find(buffer);
+	if (cached) {
+		format = drm_output_check_plane_format(p, ev, cached->bo);
+		if (format == 0)
+			goto err;
+		state->fb = drm_fb_cache_get(buffer, format);
+		if (state->fb)
+			goto have_fb;
+	}
+
 	if ((dmabuf = linux_dmabuf_buffer_get(buffer_resource))) {
 #ifdef HAVE_GBM_FD_IMPORT
 		/* XXX: TODO:
@@ -2775,8 +3835,12 @@ drm_output_prepare_overlay_view(struct drm_output_state *output_state,
 	if (!state->fb)
 		goto err;
 
-	drm_fb_set_buffer(state->fb, ev->surface->buffer_ref.buffer);
+	drm_fb_cache_add(b, state->fb, buffer);
 
+have_fb:
+	drm_fb_set_buffer(state->fb, buffer);
+
+	state->ev = ev;
 	state->output = output;
 
 	box = pixman_region32_extents(&ev->transform.boundingbox);
@@ -2844,203 +3908,684 @@ drm_output_prepare_overlay_view(struct drm_output_state *output_state,
 	state->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
 
-	return &p->base;
+	return &p->base;
+
+err:
+	drm_plane_state_put_back(state);
+	if (bo)
+		gbm_bo_destroy(bo);
+	return NULL;
+}
+
+/**
+ * Update the image for the current cursor surface
+ *
+ * @param b DRM backend structure
+ * @param bo GBM buffer object to write into
+ * @param ev View to use for cursor image
+ */
+static void
+cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
+		 struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	uint32_t buf[b->cursor_width * b->cursor_height];
+	int32_t stride;
+	uint8_t *s;
+	int i;
+
+	assert(buffer && buffer->shm_buffer);
+	assert(buffer->shm_buffer == wl_shm_buffer_get(buffer->resource));
+	assert(ev->surface->width <= b->cursor_width);
+	assert(ev->surface->height <= b->cursor_height);
+
+	memset(buf, 0, sizeof buf);
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	s = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < ev->surface->height; i++)
+		memcpy(buf + i * b->cursor_width,
+		       s + i * stride,
+		       ev->surface->width * 4);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
+		weston_log("failed update cursor: %m\n");
+}
+
+static struct weston_plane *
+drm_output_prepare_cursor_view(struct drm_output_state *output_state,
+			       struct weston_view *ev)
+{
+	struct drm_output *output = output_state->output;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *plane = output->cursor_plane;
+	struct drm_plane_state *plane_state;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct wl_shm_buffer *shmbuf;
+	int cursor;
+	float x, y;
+
+	if (!plane)
+		return NULL;
+
+	if (b->cursors_are_broken)
+		return NULL;
+
+	if (!plane->state_cur->complete)
+		return NULL;
+
+	if (plane->state_cur->output && plane->state_cur->output != output)
+		return NULL;
+
+	/* Don't import buffers which span multiple outputs. */
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	/* We use GBM to import SHM buffers. */
+	if (b->gbm == NULL)
+		return NULL;
+
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return NULL;
+	shmbuf = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
+	if (!shmbuf)
+		return NULL;
+	if (wl_shm_buffer_get_format(shmbuf) != WL_SHM_FORMAT_ARGB8888)
+		return NULL;
+
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return NULL;
+	if (ev->transform.enabled &&
+	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
+		return NULL;
+	if (viewport->buffer.scale != output->base.current_scale)
+		return NULL;
+	if (ev->geometry.scissor_enabled)
+		return NULL;
+
+	if (ev->surface->width > b->cursor_width ||
+	    ev->surface->height > b->cursor_height)
+		return NULL;
+
+	plane_state =
+		drm_output_state_get_plane(output_state, output->cursor_plane);
+
+	if (plane_state && plane_state->fb)
+		return NULL;
+
+	/* Since we're setting plane state up front, we need to work out
+	 * whether or not we need to upload a new cursor. We can't use the
+	 * plane damage, since the planes haven't actually been calculated
+	 * yet: instead try to figure it out directly. KMS cursor planes are
+	 * pretty unique here, in that they lie partway between a Weston plane
+	 * (direct scanout) and a renderer.
+	 *
+	 * The state may only be a candidate, so just pick the other buffer
+	 * here; drm_output_commit_cursor() uploads the image once the state
+	 * is final. */
+	cursor = output->current_cursor;
+	if (ev != output->cursor_view ||
+	    pixman_region32_not_empty(&ev->surface->damage))
+		cursor = (cursor + 1) % ARRAY_LENGTH(output->gbm_cursor_fb);
+
+	weston_view_to_global_float(ev, 0, 0, &x, &y);
+	plane->base.x = x;
+	plane->base.y = y;
+
+	plane_state->fb = drm_fb_ref(output->gbm_cursor_fb[cursor]);
+	plane_state->ev = ev;
+	plane_state->output = output;
+	plane_state->src_x = 0;
+	plane_state->src_y = 0;
+	plane_state->src_w = b->cursor_width << 16;
+	plane_state->src_h = b->cursor_height << 16;
+	plane_state->dest_x = (x - output->base.x) * output->base.current_scale;
+	plane_state->dest_y = (y - output->base.y) * output->base.current_scale;
+	plane_state->dest_w = b->cursor_width;
+	plane_state->dest_h = b->cursor_height;
+
+	return &plane->base;
+}
+
+/**
+ * Make the cursor plane of the final output state current
+ *
+ * Uploads the cursor image if drm_output_prepare_cursor_view() picked the
+ * other cursor buffer, and tracks the view shown on the cursor plane.
+ */
+static void
+drm_output_commit_cursor(struct drm_output *output,
+			 struct drm_output_state *state)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane_state *plane_state = NULL;
+
+	if (output->cursor_plane)
+		plane_state =
+			drm_output_state_get_existing_plane(state,
+							    output->cursor_plane);
+
+	/* We rely on output->cursor_view being both an accurate reflection
+	 * of the cursor plane's state, but also being maintained across
+	 * repaints to avoid unnecessary damage uploads, per the comment in
+	 * drm_output_prepare_cursor_view. */
+	if (!plane_state || !plane_state->fb) {
+		output->cursor_view = NULL;
+		return;
+	}
+
+	if (plane_state->fb != output->gbm_cursor_fb[output->current_cursor]) {
+		output->current_cursor = (output->current_cursor + 1) %
+			ARRAY_LENGTH(output->gbm_cursor_fb);
+		assert(plane_state->fb ==
+		       output->gbm_cursor_fb[output->current_cursor]);
+		cursor_bo_update(b, plane_state->fb->bo, plane_state->ev);
+	}
+
+	output->cursor_view = plane_state->ev;
+}
+
+static void
+drm_output_set_cursor(struct drm_output_state *output_state)
+{
+	struct drm_output *output = output_state->output;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *plane = output->cursor_plane;
+	struct drm_plane_state *state;
+	EGLint handle;
+	struct gbm_bo *bo;
+
+	if (!plane)
+		return;
+
+	state = drm_output_state_get_existing_plane(output_state, plane);
+	if (!state)
+		return;
+
+	if (!state->fb) {
+		pixman_region32_fini(&plane->base.damage);
+		pixman_region32_init(&plane->base.damage);
+		drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+		return;
+	}
+
+	assert(state->fb == output->gbm_cursor_fb[output->current_cursor]);
+	assert(!plane->state_cur->output || plane->state_cur->output == output);
+
+	if (plane->state_cur->fb != state->fb) {
+		bo = state->fb->bo;
+		handle = gbm_bo_get_handle(bo).s32;
+		if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
+				     b->cursor_width, b->cursor_height)) {
+			weston_log("failed to set cursor: %m\n");
+			goto err;
+		}
+	}
+
+	pixman_region32_fini(&plane->base.damage);
+	pixman_region32_init(&plane->base.damage);
+
+	if (drmModeMoveCursor(b->drm.fd, output->crtc_id,
+	                      state->dest_x, state->dest_y)) {
+		weston_log("failed to move cursor: %m\n");
+		goto err;
+	}
+
+	return;
+
+err:
+	b->cursors_are_broken = 1;
+	drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+}
+
+static bool
+drm_view_list_contains(struct weston_view **views, int count,
+		       struct weston_view *ev)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (views[i] == ev)
+			return true;
+
+	return false;
+}
+
+/**
+ * Build an output state placing views on planes
+ *
+ * Walks the views from the top down, like the classic heuristics: a view
+ * overlapping anything left to the renderer above it must be rendered as
+ * well, and nothing can be shown below a scanout view. Only views from
+ * 'allowed' are considered for planes, or all of them if 'allowed' is NULL.
+ * Every plane state showing a view records it in drm_plane_state::ev;
+ * nothing outside the returned state is modified.
+ *
+ * The state is not linked into a pending state.
+ */
+static struct drm_output_state *
+drm_output_propose_state(struct drm_output *output,
+			 struct weston_view **allowed, int n_allowed)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_output_state *state;
+	struct weston_view *ev;
+	pixman_region32_t surface_overlap, renderer_region;
+	struct weston_plane *next_plane;
+	bool picked_scanout = false;
+
+	state = drm_output_state_duplicate(output->state_cur, NULL,
+					   DRM_OUTPUT_STATE_CLEAR_PLANES);
+
+	pixman_region32_init(&renderer_region);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		pixman_region32_init(&surface_overlap);
+		pixman_region32_intersect(&surface_overlap, &renderer_region,
+					  &ev->transform.boundingbox);
+
+		next_plane = NULL;
+		if (pixman_region32_not_empty(&surface_overlap) || picked_scanout)
+			next_plane = &ec->primary_plane;
+		if (allowed && !drm_view_list_contains(allowed, n_allowed, ev))
+			next_plane = &ec->primary_plane;
+		if (next_plane == NULL)
+			next_plane = drm_output_prepare_cursor_view(state, ev);
+
+		/* If a higher-stacked view already got assigned to scanout, it's incorrect to
+		 * assign a subsequent (lower-stacked) view to scanout.
+		 */
+		if (next_plane == NULL) {
+			next_plane = drm_output_prepare_scanout_view(state, ev);
+			if (next_plane)
+				picked_scanout = true;
+		}
+
+		if (next_plane == NULL)
+			next_plane = drm_output_prepare_overlay_view(state, ev);
+
+		if (next_plane == NULL)
+			next_plane = &ec->primary_plane;
+
+		if (next_plane == &ec->primary_plane)
+			pixman_region32_union(&renderer_region,
+					      &renderer_region,
+					      &ev->transform.boundingbox);
+
+		pixman_region32_fini(&surface_overlap);
+	}
+	pixman_region32_fini(&renderer_region);
+
+	return state;
+}
+
+static struct drm_plane_state *
+drm_output_state_find_view(struct drm_output_state *state,
+			   struct weston_view *ev)
+{
+	struct drm_plane_state *ps;
+
+	wl_list_for_each(ps, &state->plane_list, link) {
+		if (ps->fb && ps->ev == ev)
+			return ps;
+	}
+
+	return NULL;
+}
+
+static bool
+drm_output_state_has_views(struct drm_output_state *state,
+			   struct weston_view **views, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (!drm_output_state_find_view(state, views[i]))
+			return false;
+
+	return true;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * Check whether the kernel would accept an output state
+ *
+ * Runs a TEST_ONLY atomic commit of the state. The scanout plane is not yet
+ * filled if the renderer is going to be used; the last scanout buffer stands
+ * in for the renderer's buffer for the test. Without a suitable stand-in
+ * nothing can be tested, and the state counts as rejected.
+ *
+ * @returns 0 if the state can be applied
+ */
+static int
+drm_output_state_test(struct drm_output_state *state)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *scanout_plane = output->scanout_plane;
+	struct drm_plane_state *scanout_state;
+	struct drm_fb *stand_in = NULL;
+	drmModeAtomicReq *req;
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	int ret;
+
+	scanout_state = drm_output_state_get_plane(state, scanout_plane);
+	if (!scanout_state->fb) {
+		stand_in = scanout_plane->state_cur->fb;
+		if (!stand_in ||
+		    stand_in->width != output->base.current_mode->width ||
+		    stand_in->height != output->base.current_mode->height)
+			return -1;
+
+		scanout_state->fb = drm_fb_ref(stand_in);
+		scanout_state->output = output;
+		scanout_state->src_x = 0;
+		scanout_state->src_y = 0;
+		scanout_state->src_w = stand_in->width << 16;
+		scanout_state->src_h = stand_in->height << 16;
+		scanout_state->dest_x = 0;
+		scanout_state->dest_y = 0;
+		scanout_state->dest_w = stand_in->width;
+		scanout_state->dest_h = stand_in->height;
+	}
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = drm_output_apply_state_atomic(state, req, &flags);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
+
+	drmModeAtomicFree(req);
+
+out:
+	if (stand_in) {
+		drm_fb_unref(scanout_state->fb);
+		scanout_state->fb = NULL;
+		scanout_state->output = NULL;
+	}
 
-err:
-	drm_plane_state_put_back(state);
-	if (bo)
-		gbm_bo_destroy(bo);
-	return NULL;
+	return ret;
 }
 
 /**
- * Update the image for the current cursor surface
+ * Whether a view updates often enough to be worth an overlay plane
  *
- * @param b DRM backend structure
- * @param bo GBM buffer object to write into
- * @param ev View to use for cursor image
+ * Static views stay in the composited primary plane, where they cost
+ * nothing once rendered. Cursor sized views are exempt, as the cursor
+ * plane saves rendering when they move rather than when they update.
+ * Views filling the output are not filtered by this at all, see
+ * drm_view_fills_output.
+ *
+ * A view still on the plane it got last frame stays hot down to a lower
+ * rate than it takes to become hot.
  */
-static void
-cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
-		 struct weston_view *ev)
+static bool
+drm_view_is_hot(struct drm_backend *b, struct weston_view *ev)
 {
-	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
-	uint32_t buf[b->cursor_width * b->cursor_height];
-	int32_t stride;
-	uint8_t *s;
-	int i;
+	float threshold;
 
-	assert(buffer && buffer->shm_buffer);
-	assert(buffer->shm_buffer == wl_shm_buffer_get(buffer->resource));
-	assert(ev->surface->width <= b->cursor_width);
-	assert(ev->surface->height <= b->cursor_height);
-
-	memset(buf, 0, sizeof buf);
-	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
-	s = wl_shm_buffer_get_data(buffer->shm_buffer);
+	if (ev->surface->width <= b->cursor_width &&
+	    ev->surface->height <= b->cursor_height)
+		return true;
 
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < ev->surface->height; i++)
-		memcpy(buf + i * b->cursor_width,
-		       s + i * stride,
-		       ev->surface->width * 4);
-	wl_shm_buffer_end_access(buffer->shm_buffer);
+	if (ev->plane == &b->compositor->primary_plane)
+		threshold = DRM_PLANE_HOT_ENTER_RATE;
+	else
+		threshold = DRM_PLANE_HOT_LEAVE_RATE;
 
-	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-		weston_log("failed update cursor: %m\n");
+	return weston_surface_get_commit_rate(ev->surface) >= threshold;
 }
 
-static struct weston_plane *
-drm_output_prepare_cursor_view(struct drm_output_state *output_state,
-			       struct weston_view *ev)
+/**
+ * Whether a view could be scanned out directly
+ *
+ * A view which covers the whole output saves compositing altogether on the
+ * scanout plane, however rarely it updates, so it is always a candidate.
+ * This is only the cheap part of drm_output_prepare_scanout_view's checks.
+ */
+static bool
+drm_view_fills_output(struct drm_output *output, struct weston_view *ev)
 {
-	struct drm_output *output = output_state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct drm_plane *plane = output->cursor_plane;
-	struct drm_plane_state *plane_state;
-	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct wl_shm_buffer *shmbuf;
-	bool needs_update = false;
-	float x, y;
-
-	if (!plane)
-		return NULL;
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 
-	if (b->cursors_are_broken)
-		return NULL;
+	return buffer &&
+	       ev->geometry.x == output->base.x &&
+	       ev->geometry.y == output->base.y &&
+	       buffer->width == output->base.current_mode->width &&
+	       buffer->height == output->base.current_mode->height &&
+	       !ev->transform.enabled;
+}
 
-	if (!plane->state_cur->complete)
-		return NULL;
+/**
+ * Score how much putting a view on a plane saves the renderer
+ *
+ * Roughly the pixels per second the renderer would otherwise redraw: the
+ * area of the output the view covers, times its commit rate and the part
+ * of the surface each commit damages. The area alone is added so that
+ * views with no statistics yet still rank by size.
+ */
+static uint64_t
+drm_view_plane_score(struct drm_output *output, struct weston_view *ev)
+{
+	struct weston_surface_stats *stats = &ev->surface->stats;
+	pixman_region32_t visible;
+	pixman_box32_t *box;
+	uint64_t area;
+	float rate;
 
-	if (plane->state_cur->output && plane->state_cur->output != output)
-		return NULL;
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &ev->transform.boundingbox,
+				  &output->base.region);
+	box = pixman_region32_extents(&visible);
+	area = (uint64_t) (box->x2 - box->x1) * (box->y2 - box->y1);
+	pixman_region32_fini(&visible);
 
-	/* Don't import buffers which span multiple outputs. */
-	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
+	rate = weston_surface_get_commit_rate(ev->surface);
+	if (rate > output->base.current_mode->refresh / 1000.0f)
+		rate = output->base.current_mode->refresh / 1000.0f;
 
-	/* We use GBM to import SHM buffers. */
-	if (b->gbm == NULL)
-		return NULL;
+	return area + (uint64_t) (area * rate * stats->damage_fraction);
+}
 
-	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-	shmbuf = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
-	if (!shmbuf)
-		return NULL;
-	if (wl_shm_buffer_get_format(shmbuf) != WL_SHM_FORMAT_ARGB8888)
-		return NULL;
+static uint32_t
+drm_hash_add(uint32_t hash, uint32_t value)
+{
+	/* FNV-1a, one 32-bit word at a time */
+	return (hash ^ value) * 16777619u;
+}
 
-	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
-		return NULL;
-	if (ev->transform.enabled &&
-	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
-		return NULL;
-	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
-	if (ev->geometry.scissor_enabled)
-		return NULL;
+/**
+ * Hash everything the plane assignment of an output depends on, other than
+ * buffer contents: which views are on the output, in which order, their
+ * placement and buffer kind, and whether they update often. Cursor sized
+ * views are hashed without their position, so that moving the pointer does
+ * not restart the search.
+ */
+static uint32_t
+drm_output_scene_hash(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_view *ev;
+	struct weston_buffer *buffer;
+	pixman_box32_t *box;
+	uint32_t hash = 2166136261u;
 
-	if (ev->surface->width > b->cursor_width ||
-	    ev->surface->height > b->cursor_height)
-		return NULL;
+	hash = drm_hash_add(hash, output->base.current_mode->width);
+	hash = drm_hash_add(hash, output->base.current_mode->height);
 
-	plane_state =
-		drm_output_state_get_plane(output_state, output->cursor_plane);
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->base.id)))
+			continue;
 
-	if (plane_state && plane_state->fb)
-		return NULL;
+		buffer = ev->surface->buffer_ref.buffer;
+		box = pixman_region32_extents(&ev->transform.boundingbox);
 
-	/* Since we're setting plane state up front, we need to work out
-	 * whether or not we need to upload a new cursor. We can't use the
-	 * plane damage, since the planes haven't actually been calculated
-	 * yet: instead try to figure it out directly. KMS cursor planes are
-	 * pretty unique here, in that they lie partway between a Weston plane
-	 * (direct scanout) and a renderer. */
-	if (ev != output->cursor_view ||
-	    pixman_region32_not_empty(&ev->surface->damage)) {
-		output->current_cursor++;
-		output->current_cursor =
-			output->current_cursor %
-				ARRAY_LENGTH(output->gbm_cursor_fb);
-		needs_update = true;
+		hash = drm_hash_add(hash, ev->id);
+		if (ev->surface->width > b->cursor_width ||
+		    ev->surface->height > b->cursor_height) {
+			hash = drm_hash_add(hash, box->x1);
+			hash = drm_hash_add(hash, box->y1);
+			hash = drm_hash_add(hash, box->x2);
+			hash = drm_hash_add(hash, box->y2);
+		}
+		hash = drm_hash_add(hash, ev->output_mask);
+		hash = drm_hash_add(hash, ev->alpha != 1.0f);
+		hash = drm_hash_add(hash, ev->transform.enabled);
+		hash = drm_hash_add(hash, ev->surface->width);
+		hash = drm_hash_add(hash, ev->surface->height);
+		hash = drm_hash_add(hash, !buffer ? 0 :
+				    wl_shm_buffer_get(buffer->resource) ? 1 : 2);
+		hash = drm_hash_add(hash, drm_view_is_hot(b, ev));
 	}
 
-	output->cursor_view = ev;
-	weston_view_to_global_float(ev, 0, 0, &x, &y);
-	plane->base.x = x;
-	plane->base.y = y;
-
-	plane_state->fb =
-		drm_fb_ref(output->gbm_cursor_fb[output->current_cursor]);
-	plane_state->output = output;
-	plane_state->src_x = 0;
-	plane_state->src_y = 0;
-	plane_state->src_w = b->cursor_width << 16;
-	plane_state->src_h = b->cursor_height << 16;
-	plane_state->dest_x = (x - output->base.x) * output->base.current_scale;
-	plane_state->dest_y = (y - output->base.y) * output->base.current_scale;
-	plane_state->dest_w = b->cursor_width;
-	plane_state->dest_h = b->cursor_height;
-
-	if (needs_update)
-		cursor_bo_update(b, plane_state->fb->bo, ev);
-
-	return &plane->base;
+	return hash;
 }
 
-static void
-drm_output_set_cursor(struct drm_output_state *output_state)
+/**
+ * Search for the best plane assignment the kernel accepts
+ *
+ * Candidate views are those the plane code could take at all and that either
+ * fill the output, making them fit for scanout, or update often enough for
+ * an overlay to pay off. Starting from
+ * everything rendered, they are added in order of decreasing score, each
+ * time building the state for the new set and keeping it only if every view
+ * of the set got a plane and a TEST_ONLY commit succeeds. A view stacked
+ * below another candidate may only become possible once that one is on a
+ * plane, hence a second pass.
+ *
+ * The winning set is cached on the output; while the scene hash stays the
+ * same, it is rebuilt instead of searching again, and used without another
+ * TEST_ONLY commit. A failed commit of the output drops the cached set. At most
+ * DRM_PLANE_SEARCH_MAX_TESTS commits are tested per frame; the best set found
+ * by then is used, but not cached, so the search goes on next frame.
+ */
+static struct drm_output_state *
+drm_output_search_planes(struct drm_output *output)
 {
-	struct drm_output *output = output_state->output;
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct drm_plane *plane = output->cursor_plane;
-	struct drm_plane_state *state;
-	EGLint handle;
-	struct gbm_bo *bo;
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_view *candidates[DRM_PLANE_SEARCH_MAX_VIEWS];
+	uint64_t scores[DRM_PLANE_SEARCH_MAX_VIEWS];
+	struct weston_view *chosen[DRM_PLANE_SEARCH_MAX_VIEWS];
+	bool rejected[DRM_PLANE_SEARCH_MAX_VIEWS] = { false };
+	struct drm_output_state *best, *trial;
+	struct weston_buffer *buffer;
+	struct weston_view *ev;
+	uint32_t hash;
+	uint64_t score;
+	int n_candidates = 0, n_chosen = 0, n_tests = 0;
+	int i, j, pass;
+	bool changed;
 
-	if (!plane)
-		return;
+	hash = drm_output_scene_hash(output);
 
-	state = drm_output_state_get_existing_plane(output_state, plane);
-	if (!state)
-		return;
+	if (output->plane_cache.valid && output->plane_cache.scene_hash == hash) {
+		trial = drm_output_propose_state(output,
+						 output->plane_cache.views,
+						 output->plane_cache.count);
+		if (drm_output_state_has_views(trial,
+					       output->plane_cache.views,
+					       output->plane_cache.count))
+			return trial;
 
-	if (!state->fb) {
-		pixman_region32_fini(&plane->base.damage);
-		pixman_region32_init(&plane->base.damage);
-		drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
-		return;
+		drm_output_state_free(trial);
 	}
 
-	assert(state->fb == output->gbm_cursor_fb[output->current_cursor]);
-	assert(!plane->state_cur->output || plane->state_cur->output == output);
+	output->plane_cache.valid = false;
 
-	if (plane->state_cur->fb != state->fb) {
-		bo = state->fb->bo;
-		handle = gbm_bo_get_handle(bo).s32;
-		if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
-				     b->cursor_width, b->cursor_height)) {
-			weston_log("failed to set cursor: %m\n");
-			goto err;
+	/* Collect the best scoring candidates, sorted by score */
+	wl_list_for_each(ev, &ec->view_list, link) {
+		buffer = ev->surface->buffer_ref.buffer;
+		if (ev->output_mask != (1u << output->base.id) || !buffer)
+			continue;
+		if (wl_shm_buffer_get(buffer->resource) &&
+		    (ev->surface->width > b->cursor_width ||
+		     ev->surface->height > b->cursor_height))
+			continue;
+		if (!drm_view_is_hot(b, ev) &&
+		    !drm_view_fills_output(output, ev))
+			continue;
+
+		score = drm_view_plane_score(output, ev);
+		if (score == 0)
+			continue;
+
+		if (n_candidates == DRM_PLANE_SEARCH_MAX_VIEWS) {
+			if (score <= scores[n_candidates - 1])
+				continue;
+			n_candidates--;
 		}
+
+		for (i = n_candidates; i > 0 && scores[i - 1] < score; i--) {
+			candidates[i] = candidates[i - 1];
+			scores[i] = scores[i - 1];
+		}
+		candidates[i] = ev;
+		scores[i] = score;
+		n_candidates++;
 	}
 
-	pixman_region32_fini(&plane->base.damage);
-	pixman_region32_init(&plane->base.damage);
+	best = drm_output_propose_state(output, chosen, 0);
 
-	if (drmModeMoveCursor(b->drm.fd, output->crtc_id,
-	                      state->dest_x, state->dest_y)) {
-		weston_log("failed to move cursor: %m\n");
-		goto err;
+	for (pass = 0; pass < 2; pass++) {
+		changed = false;
+
+		for (i = 0; i < n_candidates; i++) {
+			if (n_tests == DRM_PLANE_SEARCH_MAX_TESTS)
+				return best;
+
+			if (rejected[i] ||
+			    drm_view_list_contains(chosen, n_chosen,
+						   candidates[i]))
+				continue;
+
+			chosen[n_chosen] = candidates[i];
+			trial = drm_output_propose_state(output, chosen,
+							 n_chosen + 1);
+
+			if (!drm_output_state_has_views(trial, chosen,
+							n_chosen + 1)) {
+				/* May become possible with views above it
+				 * on planes; give up on the second pass. */
+				if (pass > 0)
+					rejected[i] = true;
+				drm_output_state_free(trial);
+				continue;
+			}
+
+			n_tests++;
+			if (drm_output_state_test(trial) != 0) {
+				rejected[i] = true;
+				drm_output_state_free(trial);
+				continue;
+			}
+
+			drm_output_state_free(best);
+			best = trial;
+			n_chosen++;
+			changed = true;
+		}
+
+		if (!changed)
+			break;
 	}
 
-	return;
+	output->plane_cache.valid = true;
+	output->plane_cache.scene_hash = hash;
+	output->plane_cache.count = n_chosen;
+	for (j = 0; j < n_chosen; j++)
+		output->plane_cache.views[j] = chosen[j];
 
-err:
-	b->cursors_are_broken = 1;
-	drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+	return best;
 }
+#endif
 
 static void
 drm_assign_planes(struct weston_output *output_base, void *repaint_data)
@@ -3048,17 +4593,12 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	struct drm_backend *b = to_drm_backend(output_base->compositor);
 	struct drm_pending_state *pending_state = repaint_data;
 	struct drm_output *output = to_drm_output(output_base);
-	struct drm_output_state *state;
+	struct drm_output_state *state = NULL;
 	struct drm_plane_state *plane_state;
 	struct weston_view *ev;
-	pixman_region32_t surface_overlap, renderer_region;
 	struct weston_plane *primary, *next_plane;
-	bool picked_scanout = false;
 
 	assert(!output->state_last);
-	state = drm_output_state_duplicate(output->state_cur,
-					   pending_state,
-					   DRM_OUTPUT_STATE_CLEAR_PLANES);
 
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
@@ -3072,8 +4612,28 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	 * the main display surface may not need to update at all, and
 	 * the client buffer can be used directly for the sprite surface
 	 * as we do for flipping full screen surfaces.
+	 *
+	 * With atomic modesetting, combinations are validated with the
+	 * kernel instead of being assigned greedily, and the update
+	 * frequency comes from the surface statistics; see
+	 * drm_output_search_planes.
 	 */
-	pixman_region32_init(&renderer_region);
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset && !b->state_invalid && !b->use_pixman &&
+	    output->state_cur->dpms == WESTON_DPMS_ON) {
+		/* The trial commits are checked against the kernel's state,
+		 * so anything still queued for this output has to land
+		 * there first. */
+		drm_commit_worker_flush_output(b, output);
+		state = drm_output_search_planes(output);
+	}
+#endif
+	if (!state)
+		state = drm_output_propose_state(output, NULL, 0);
+
+	state->pending_state = pending_state;
+	wl_list_insert(&pending_state->output_list, &state->link);
+
 	primary = &output_base->compositor->primary_plane;
 
 	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
@@ -3096,38 +4656,11 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 		else
 			es->keep_buffer = false;
 
-		pixman_region32_init(&surface_overlap);
-		pixman_region32_intersect(&surface_overlap, &renderer_region,
-					  &ev->transform.boundingbox);
-
-		next_plane = NULL;
-		if (pixman_region32_not_empty(&surface_overlap) || picked_scanout)
-			next_plane = primary;
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_cursor_view(state, ev);
-
-		/* If a higher-stacked view already got assigned to scanout, it's incorrect to
-		 * assign a subsequent (lower-stacked) view to scanout.
-		 */
-		if (next_plane == NULL) {
-			next_plane = drm_output_prepare_scanout_view(state, ev);
-			if (next_plane)
-				picked_scanout = true;
-		}
-
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_overlay_view(state, ev);
-
-		if (next_plane == NULL)
-			next_plane = primary;
+		plane_state = drm_output_state_find_view(state, ev);
+		next_plane = plane_state ? &plane_state->plane->base : primary;
 
 		weston_view_move_to_plane(ev, next_plane);
 
-		if (next_plane == primary)
-			pixman_region32_union(&renderer_region,
-					      &renderer_region,
-					      &ev->transform.boundingbox);
-
 		if (next_plane == primary ||
 		    (output->cursor_plane &&
 		     next_plane == &output->cursor_plane->base)) {
@@ -3139,23 +4672,9 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 			 */
 			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
 		}
-
-		pixman_region32_fini(&surface_overlap);
 	}
-	pixman_region32_fini(&renderer_region);
 
-	/* We rely on output->cursor_view being both an accurate reflection of
-	 * the cursor plane's state, but also being maintained across repaints
-	 * to avoid unnecessary damage uploads, per the comment in
-	 * drm_output_prepare_cursor_view. In the event that we go from having
-	 * a cursor view to not having a cursor view, we need to clear it. */
-	if (output->cursor_view) {
-		plane_state =
-			drm_output_state_get_existing_plane(state,
-							    output->cursor_plane);
-		if (!plane_state || !plane_state->fb)
-			output->cursor_view = NULL;
-	}
+	drm_output_commit_cursor(output, state);
 }
 
 /**
@@ -4120,8 +5639,12 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 	weston_log("DRM: output %s %s shadow framebuffer.\n", output->base.name,
 		   b->use_pixman_shadow ? "uses" : "does not use");
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	for (i = 0; i < ARRAY_LENGTH(output->image_damage); i++)
+		pixman_region32_init_rect(&output->image_damage[i],
+					  output->base.x, output->base.y,
+					  output->base.width,
+					  output->base.height);
+	output->shadow_stale = false;
 
 	return 0;
 
@@ -4157,9 +5680,9 @@ drm_output_fini_pixman(struct drm_output *output)
 	}
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
 
 	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		pixman_region32_fini(&output->image_damage[i]);
 		pixman_image_unref(output->image[i]);
 		drm_fb_unref(output->dumb[i]);
 		output->dumb[i] = NULL;
@@ -5589,6 +7112,8 @@ drm_destroy(struct weston_compositor *ec)
 	wl_event_source_remove(b->udev_drm_source);
 	wl_event_source_remove(b->drm_source);
 
+	drm_commit_worker_stop(b);
+
 	b->shutting_down = true;
 
 	destroy_sprites(b);
@@ -5598,6 +7123,8 @@ drm_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		drm_head_destroy(to_drm_head(base));
 
+	drm_fb_cache_release(b);
+
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
 
@@ -5631,6 +7158,8 @@ session_notify(struct wl_listener *listener, void *data)
 		weston_log("deactivating session\n");
 		udev_input_disable(&b->input);
 
+		drm_commit_worker_flush(b);
+
 		weston_compositor_offscreen(compositor);
 
 		/* If we have a repaint scheduled (either from a
@@ -6121,6 +7650,8 @@ drm_backend_create(struct weston_compositor *compositor,
 	wl_list_init(&b->plane_list);
 	create_sprites(b);
 
+	wl_list_init(&b->fb_cache);
+
 	if (udev_input_init(&b->input,
 			    compositor, b->udev, seat_id,
 			    config->configure_device) < 0) {
@@ -6143,6 +7674,8 @@ drm_backend_create(struct weston_compositor *compositor,
 		wl_event_loop_add_fd(loop, b->drm.fd,
 				     WL_EVENT_READABLE, on_drm_input, b);
 
+	drm_commit_worker_start(b, loop);
+
 	b->udev_monitor = udev_monitor_new_from_netlink(b->udev, "udev");
 	if (b->udev_monitor == NULL) {
 		weston_log("failed to initialize udev monitor\n");
@@ -6193,6 +7726,7 @@ err_udev_monitor:
 	wl_event_source_remove(b->udev_drm_source);
 	udev_monitor_unref(b->udev_monitor);
 err_drm_source:
+	drm_commit_worker_stop(b);
 	wl_event_source_remove(b->drm_source);
 err_udev_input:
 	udev_input_destroy(&b->input);
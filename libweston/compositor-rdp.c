@@ -30,6 +30,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -89,6 +92,10 @@
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
+#define RDP_TILE_SIZE 64
+#define RDP_MAX_ENCODER_THREADS 4
+#define RDP_DEFAULT_FRAMES_IN_FLIGHT 2
+#define RDP_FRAME_ACK_TIMEOUT 1000 /* msec */
 
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
@@ -102,6 +109,28 @@
 
 struct rdp_output;
 
+/* A unit of work for the encoder threads */
+struct rdp_work {
+	struct wl_list link;
+	void (*run)(struct rdp_work *work);
+};
+
+struct rdp_encoder {
+	pthread_t threads[RDP_MAX_ENCODER_THREADS];
+	int nthreads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct wl_list queue;
+	int outstanding;
+	int destroying;
+
+	/* signalled when outstanding drops to 0 */
+	int fd;
+	struct wl_event_source *source;
+};
+
 struct rdp_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -115,6 +144,9 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+	int32_t min_frame_interval; /* msec, per peer */
+
+	struct rdp_encoder encoder;
 };
 
 enum peer_item_flags {
@@ -134,12 +166,66 @@ struct rdp_head {
 	struct weston_head base;
 };
 
+enum rdp_encode_state {
+	RDP_ENCODE_IDLE,
+	RDP_ENCODE_ANALYZING,	/* finding the tiles that really changed */
+	RDP_ENCODE_ENCODING,	/* encode jobs are running */
+};
+
+enum rdp_codec {
+	RDP_CODEC_RAW,
+	RDP_CODEC_NSC,
+	RDP_CODEC_RFX,
+};
+
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
 	struct wl_list peers;
+
+	enum rdp_encode_state encode_state;
+	struct rdp_work analyze_work;
+	pixman_region32_t frame_damage;
+
+	/* Hash of every RDP_TILE_SIZE tile of shadow_surface as last sent */
+	uint64_t *tile_hashes;
+	int tiles_x, tiles_y;
+	int tile_cache_valid;
+	int analyze_force;
+
+	struct wl_list jobs;		/* rdp_encode_job::link */
+	struct wl_list free_jobs;	/* rdp_encode_job::link */
+
+	/* Wakes up peers held back by the frame rate limit */
+	struct wl_event_source *pacing_timer;
+};
+
+struct rdp_peer_context;
+
+/* One encoded update, sent to every peer in peers. Peers using the same
+ * stateless codec for the same region share a job; RemoteFX contexts
+ * carry per-peer state, so those always get their own. */
+struct rdp_encode_job {
+	struct rdp_work work;
+	struct wl_list link;
+	struct rdp_output *output;
+
+	enum rdp_codec codec;
+	struct rdp_peer_context *encoder;
+	pixman_region32_t region;
+	struct wl_array peers;		/* RdpPeerContext *, NULL once gone */
+
+	/* RemoteFX and NSCodec */
+	wStream *stream;
+	RFX_RECT *rfx_rects;
+	int rfx_rects_size;
+
+	/* raw: bottom-up strips of at most max_request_size bytes */
+	UINT32 max_request_size;
+	BYTE *raw_data;
+	size_t raw_data_size;
 };
 
 struct rdp_peer_context {
@@ -148,10 +234,14 @@ struct rdp_peer_context {
 	struct rdp_backend *rdpBackend;
 	struct wl_event_source *events[MAX_FREERDP_FDS];
 	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
 
+	/* Frame pacing, see rdp_peer_ready() */
+	pixman_region32_t damage;	/* not sent to this peer yet */
+	UINT32 frame_id;		/* last frame sent */
+	UINT32 acked_frame_id;		/* last frame acknowledged */
+	struct timespec last_frame;
+
 	struct rdp_peers_item item;
 };
 typedef struct rdp_peer_context RdpPeerContext;
@@ -174,46 +264,55 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+static enum rdp_codec
+rdp_peer_codec(freerdp_peer *peer)
+{
+	if (peer->settings->RemoteFxCodec)
+		return RDP_CODEC_RFX;
+	else if (peer->settings->NSCodec)
+		return RDP_CODEC_NSC;
+	else
+		return RDP_CODEC_RAW;
+}
+
+static int
+rdp_peer_wants_update(struct rdp_peers_item *item)
+{
+	return (item->flags & RDP_PEER_ACTIVATED) &&
+		(item->flags & RDP_PEER_OUTPUT_ENABLED);
+}
+
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_rfx(struct rdp_encode_job *job, pixman_image_t *image)
 {
+	pixman_region32_t *damage = &job->region;
+	RdpPeerContext *context = job->encoder;
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	Stream_Clear(job->stream);
+	Stream_SetPosition(job->stream, 0);
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
 	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	if (nrects > job->rfx_rects_size) {
+		rfxRect = realloc(job->rfx_rects, nrects * sizeof *rfxRect);
+		if (!rfxRect)
+			return;
+		job->rfx_rects = rfxRect;
+		job->rfx_rects_size = nrects;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+		rfxRect = &job->rfx_rects[i];
 
 		rfxRect->x = (region->x1 - damage->extents.x1);
 		rfxRect->y = (region->y1 - damage->extents.y1);
@@ -221,55 +320,64 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 		rfxRect->height = (region->y2 - region->y1);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
+	rfx_compose_message(context->rfx_context, job->stream, job->rfx_rects, nrects,
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
-
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, cmd);
 }
 
-
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_nsc(struct rdp_encode_job *job, pixman_image_t *image)
 {
+	pixman_region32_t *damage = &job->region;
+	RdpPeerContext *context = job->encoder;
 	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	Stream_Clear(job->stream);
+	Stream_SetPosition(job->stream, 0);
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
+	ptr = pixman_image_get_data(image) + damage->extents.x1 +
+				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+
+	nsc_compose_message(context->nsc_context, job->stream, (BYTE *)ptr,
+			width, height,
+			pixman_image_get_stride(image));
+}
+
+static void
+rdp_peer_send_surface_bits(struct rdp_encode_job *job, freerdp_peer *peer)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	pixman_box32_t *extents = pixman_region32_extents(&job->region);
+
+	if (Stream_GetPosition(job->stream) == 0)
+		return;
+
 #ifdef HAVE_SKIP_COMPRESSION
 	cmd->skipCompression = TRUE;
 #else
 	memset(cmd, 0, sizeof(*cmd));
 #endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
+	cmd->destLeft = extents->x1;
+	cmd->destTop = extents->y1;
+	cmd->destRight = extents->x2;
+	cmd->destBottom = extents->y2;
 	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	if (job->codec == RDP_CODEC_RFX)
+		cmd->codecID = peer->settings->RemoteFxCodecId;
+	else
+		cmd->codecID = peer->settings->NSCodecId;
+	cmd->width = extents->x2 - extents->x1;
+	cmd->height = extents->y2 - extents->y1;
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	cmd->bitmapDataLength = Stream_GetPosition(job->stream);
+	cmd->bitmapData = Stream_Buffer(job->stream);
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
 	update->SurfaceBits(update->context, cmd);
 }
 
@@ -287,77 +395,700 @@ pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BY
 		   memcpy(dest, src, toCopy);
 }
 
+/* Raw rectangles are sent in strips that fit in one request */
+static int
+rdp_raw_strip_height(UINT32 max_request_size, int width)
+{
+	int height = max_request_size / (16 + width * 4);
+
+	return height > 0 ? height : 1;
+}
+
 static void
-rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_raw(struct rdp_encode_job *job, pixman_image_t *image)
+{
+	pixman_box32_t *rect, subrect;
+	int nrects, i, heightIncrement, remainingHeight;
+	size_t size = 0;
+	BYTE *data;
+
+	rect = pixman_region32_rectangles(&job->region, &nrects);
+	for (i = 0; i < nrects; i++)
+		size += (rect[i].x2 - rect[i].x1) * (rect[i].y2 - rect[i].y1) * 4;
+
+	if (size > job->raw_data_size) {
+		data = realloc(job->raw_data, size);
+		if (!data) {
+			pixman_region32_clear(&job->region);
+			return;
+		}
+		job->raw_data = data;
+		job->raw_data_size = size;
+	}
+
+	data = job->raw_data;
+	for (i = 0; i < nrects; i++, rect++) {
+		heightIncrement = rdp_raw_strip_height(job->max_request_size,
+						       rect->x2 - rect->x1);
+		remainingHeight = rect->y2 - rect->y1;
+
+		subrect.x1 = rect->x1;
+		subrect.x2 = rect->x2;
+		subrect.y1 = rect->y1;
+
+		while (remainingHeight) {
+			subrect.y2 = subrect.y1 + MIN(remainingHeight, heightIncrement);
+			pixman_image_flipped_subrect(&subrect, image, data);
+
+			data += (subrect.x2 - subrect.x1) * (subrect.y2 - subrect.y1) * 4;
+			remainingHeight -= subrect.y2 - subrect.y1;
+			subrect.y1 = subrect.y2;
+		}
+	}
+}
+
+static void
+rdp_peer_send_raw(struct rdp_encode_job *job, freerdp_peer *peer)
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
-	pixman_box32_t *rect, subrect;
+	pixman_box32_t *rect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
+	BYTE *data = job->raw_data;
 
-	rect = pixman_region32_rectangles(region, &nrects);
-	if (!nrects)
-		return;
-
-	marker->frameId++;
-	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, marker);
+	rect = pixman_region32_rectangles(&job->region, &nrects);
 
 	memset(cmd, 0, sizeof(*cmd));
 	cmd->bpp = 32;
 	cmd->codecID = 0;
 
 	for (i = 0; i < nrects; i++, rect++) {
-		/*weston_log("rect(%d,%d, %d,%d)\n", rect->x1, rect->y1, rect->x2, rect->y2);*/
 		cmd->destLeft = rect->x1;
 		cmd->destRight = rect->x2;
 		cmd->width = rect->x2 - rect->x1;
 
-		heightIncrement = peer->settings->MultifragMaxRequestSize / (16 + cmd->width * 4);
+		heightIncrement = rdp_raw_strip_height(job->max_request_size, cmd->width);
 		remainingHeight = rect->y2 - rect->y1;
 		top = rect->y1;
 
-		subrect.x1 = rect->x1;
-		subrect.x2 = rect->x2;
-
 		while (remainingHeight) {
 			   cmd->height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
 			   cmd->destTop = top;
 			   cmd->destBottom = top + cmd->height;
 			   cmd->bitmapDataLength = cmd->width * cmd->height * 4;
-			   cmd->bitmapData = (BYTE *)realloc(cmd->bitmapData, cmd->bitmapDataLength);
-
-			   subrect.y1 = top;
-			   subrect.y2 = top + cmd->height;
-			   pixman_image_flipped_subrect(&subrect, image, cmd->bitmapData);
+			   cmd->bitmapData = data;
 
-			   /*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
 			   update->SurfaceBits(peer->context, cmd);
 
+			   data += cmd->bitmapDataLength;
 			   remainingHeight -= cmd->height;
 			   top += cmd->height;
 		}
 	}
 
+	/* The strips belong to the job, don't leave them behind */
+	cmd->bitmapData = NULL;
+}
+
+/* Runs on an encoder thread. Only reads shadow_surface and the codec
+ * context of job->encoder. */
+static void
+rdp_encode_job_run(struct rdp_work *work)
+{
+	struct rdp_encode_job *job = container_of(work, struct rdp_encode_job, work);
+	pixman_image_t *image = job->output->shadow_surface;
+
+	switch (job->codec) {
+	case RDP_CODEC_RFX:
+		rdp_encode_rfx(job, image);
+		break;
+	case RDP_CODEC_NSC:
+		rdp_encode_nsc(job, image);
+		break;
+	case RDP_CODEC_RAW:
+		rdp_encode_raw(job, image);
+		break;
+	}
+}
+
+/* Every update is one frame between markers, so the peer can acknowledge
+ * it, see rdp_peer_ready(). */
+static void
+rdp_encode_job_send(struct rdp_encode_job *job, RdpPeerContext *context)
+{
+	freerdp_peer *peer = context->item.peer;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+
+	if (!pixman_region32_not_empty(&job->region))
+		return;
+
+	marker->frameId = ++context->frame_id;
+	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(peer->context, marker);
+
+	if (job->codec == RDP_CODEC_RAW)
+		rdp_peer_send_raw(job, peer);
+	else
+		rdp_peer_send_surface_bits(job, peer);
+
 	marker->frameAction = SURFACECMD_FRAMEACTION_END;
 	update->SurfaceFrameMarker(peer->context, marker);
 }
 
+static struct rdp_encode_job *
+rdp_output_get_job(struct rdp_output *output)
+{
+	struct rdp_encode_job *job;
+
+	if (!wl_list_empty(&output->free_jobs)) {
+		job = container_of(output->free_jobs.next,
+				   struct rdp_encode_job, link);
+		wl_list_remove(&job->link);
+		return job;
+	}
+
+	job = zalloc(sizeof *job);
+	if (!job)
+		return NULL;
+
+	job->stream = Stream_New(NULL, 65536);
+	if (!job->stream) {
+		free(job);
+		return NULL;
+	}
+
+	job->output = output;
+	job->work.run = rdp_encode_job_run;
+	pixman_region32_init(&job->region);
+	wl_array_init(&job->peers);
+
+	return job;
+}
+
+static void
+rdp_output_release_job(struct rdp_output *output, struct rdp_encode_job *job)
+{
+	job->encoder = NULL;
+	job->peers.size = 0;
+	wl_list_insert(&output->free_jobs, &job->link);
+}
+
+static void
+rdp_encode_job_destroy(struct rdp_encode_job *job)
+{
+	wl_list_remove(&job->link);
+	pixman_region32_fini(&job->region);
+	wl_array_release(&job->peers);
+	Stream_Free(job->stream, TRUE);
+	free(job->rfx_rects);
+	free(job->raw_data);
+	free(job);
+}
+
+static int
+rdp_output_add_peer_to_job(struct rdp_output *output, RdpPeerContext *context,
+			   pixman_region32_t *region)
+{
+	freerdp_peer *peer = context->item.peer;
+	enum rdp_codec codec = rdp_peer_codec(peer);
+	UINT32 max_request_size = 0;
+	struct rdp_encode_job *job;
+	RdpPeerContext **p;
+
+	if (codec == RDP_CODEC_RAW)
+		max_request_size = peer->settings->MultifragMaxRequestSize;
+
+	if (codec != RDP_CODEC_RFX) {
+		wl_list_for_each(job, &output->jobs, link) {
+			if (job->codec == codec &&
+			    job->max_request_size == max_request_size &&
+			    pixman_region32_equal(&job->region, region))
+				goto add_peer;
+		}
+	}
+
+	job = rdp_output_get_job(output);
+	if (!job) {
+		weston_log("%s: out of memory\n", __func__);
+		return -1;
+	}
+
+	job->codec = codec;
+	job->encoder = context;
+	job->max_request_size = max_request_size;
+	pixman_region32_copy(&job->region, region);
+	wl_list_insert(output->jobs.prev, &job->link);
+
+add_peer:
+	p = wl_array_add(&job->peers, sizeof *p);
+	if (!p)
+		return -1;
+
+	*p = context;
+	return 0;
+}
+
+static void
+rdp_encoder_submit(struct rdp_encoder *encoder, struct rdp_work *work)
+{
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert(encoder->queue.prev, &work->link);
+	encoder->outstanding++;
+	pthread_cond_signal(&encoder->work_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void
+rdp_encoder_wait(struct rdp_encoder *encoder)
+{
+	pthread_mutex_lock(&encoder->mutex);
+	while (encoder->outstanding)
+		pthread_cond_wait(&encoder->idle_cond, &encoder->mutex);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+/* Whether a peer can take another frame now. A peer that acknowledges
+ * frames gets at most as many unacknowledged frames as it asked for, which
+ * paces it to its link; on top of that every peer is held to the frame
+ * rate limit. Otherwise *wait is set to the msec until it may be ready
+ * again, or 0 if only an acknowledgement will do. */
+static int
+rdp_peer_ready(struct rdp_backend *b, RdpPeerContext *context,
+	       const struct timespec *now, int64_t *wait)
+{
+	UINT32 window = context->item.peer->settings->FrameAcknowledge;
+	int64_t elapsed = timespec_sub_to_msec(now, &context->last_frame);
+
+	*wait = 0;
+
+	/* Don't wait forever on a client that stopped acknowledging */
+	if (window > 0 && context->frame_id - context->acked_frame_id >= window &&
+	    elapsed < RDP_FRAME_ACK_TIMEOUT) {
+		*wait = RDP_FRAME_ACK_TIMEOUT - elapsed;
+		return 0;
+	}
+
+	if (elapsed < b->min_frame_interval) {
+		*wait = b->min_frame_interval - elapsed;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+rdp_output_queue_encode_jobs(struct rdp_output *output)
+{
+	struct rdp_backend *b = to_rdp_backend(output->base.compositor);
+	struct rdp_peers_item *item;
+	struct rdp_encode_job *job;
+	RdpPeerContext *context;
+	struct timespec now;
+	int64_t wait, min_wait = 0;
+
+	weston_compositor_read_presentation_clock(output->base.compositor, &now);
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!rdp_peer_wants_update(item))
+			continue;
+
+		/* Peers that are behind accumulate damage, so when they are
+		 * ready they get the current content in one frame. */
+		context = (RdpPeerContext *)item->peer->context;
+		pixman_region32_union(&context->damage, &context->damage,
+				      &output->frame_damage);
+		if (!pixman_region32_not_empty(&context->damage))
+			continue;
+
+		if (!rdp_peer_ready(b, context, &now, &wait)) {
+			if (wait > 0 && (min_wait == 0 || wait < min_wait))
+				min_wait = wait;
+			continue;
+		}
+
+		if (rdp_output_add_peer_to_job(output, context,
+					       &context->damage) < 0)
+			continue;
+
+		pixman_region32_clear(&context->damage);
+		context->last_frame = now;
+	}
+
+	if (min_wait > 0)
+		wl_event_source_timer_update(output->pacing_timer, min_wait);
+
+	wl_list_for_each(job, &output->jobs, link)
+		rdp_encoder_submit(&b->encoder, &job->work);
+
+	return !wl_list_empty(&output->jobs);
+}
+
+static void
+rdp_output_send_jobs(struct rdp_output *output)
+{
+	struct rdp_encode_job *job, *next;
+	RdpPeerContext **context;
+
+	wl_list_for_each_safe(job, next, &output->jobs, link) {
+		wl_array_for_each(context, &job->peers) {
+			if (*context)
+				rdp_encode_job_send(job, *context);
+		}
+
+		wl_list_remove(&job->link);
+		rdp_output_release_job(output, job);
+	}
+}
+
+static inline int
+rdp_tile_ceil(int v)
+{
+	return (v + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE * RDP_TILE_SIZE;
+}
+
+static uint64_t
+rdp_hash_tile(const uint32_t *data, int stride, int width, int height)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t h0 = 0xcbf29ce484222325ULL;
+	uint64_t h1 = 0x84222325cbf29ce4ULL;
+	int x, y;
+
+	/* FNV-1a on whole pixels, with two lanes so the multiplies of
+	 * consecutive pixels can overlap. */
+	for (y = 0; y < height; y++) {
+		for (x = 0; x + 1 < width; x += 2) {
+			h0 = (h0 ^ data[x]) * prime;
+			h1 = (h1 ^ data[x + 1]) * prime;
+		}
+		if (x < width)
+			h0 = (h0 ^ data[x]) * prime;
+
+		data += stride;
+	}
+
+	return h0 ^ ((h1 << 32) | (h1 >> 32));
+}
+
+/* Runs on an encoder thread: drop the tiles of frame_damage whose content
+ * is the same as the last time they were sent. */
+static void
+rdp_output_analyze(struct rdp_work *work)
+{
+	struct rdp_output *output =
+		container_of(work, struct rdp_output, analyze_work);
+	pixman_image_t *image = output->shadow_surface;
+	const uint32_t *data = pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	pixman_region32_t tiles, changed;
+	pixman_box32_t *rects;
+	int nrects, i, x, y, w, h;
+	uint64_t hash, *cached;
+
+	if (!output->tile_hashes)
+		return;
+
+	/* Snap the damage to the tile grid first so every tile is hashed
+	 * only once. */
+	pixman_region32_init(&tiles);
+	rects = pixman_region32_rectangles(&output->frame_damage, &nrects);
+	for (i = 0; i < nrects; i++) {
+		x = rects[i].x1 / RDP_TILE_SIZE * RDP_TILE_SIZE;
+		y = rects[i].y1 / RDP_TILE_SIZE * RDP_TILE_SIZE;
+		w = MIN(rdp_tile_ceil(rects[i].x2), width) - x;
+		h = MIN(rdp_tile_ceil(rects[i].y2), height) - y;
+		if (w > 0 && h > 0)
+			pixman_region32_union_rect(&tiles, &tiles, x, y, w, h);
+	}
+
+	pixman_region32_init(&changed);
+	rects = pixman_region32_rectangles(&tiles, &nrects);
+	for (i = 0; i < nrects; i++) {
+		for (y = rects[i].y1; y < rects[i].y2; y += RDP_TILE_SIZE) {
+			for (x = rects[i].x1; x < rects[i].x2; x += RDP_TILE_SIZE) {
+				w = MIN(RDP_TILE_SIZE, rects[i].x2 - x);
+				h = MIN(RDP_TILE_SIZE, rects[i].y2 - y);
+
+				hash = rdp_hash_tile(data + y * stride + x,
+						     stride, w, h);
+				cached = &output->tile_hashes[
+					(y / RDP_TILE_SIZE) * output->tiles_x +
+					x / RDP_TILE_SIZE];
+
+				if (*cached == hash && !output->analyze_force)
+					continue;
+
+				*cached = hash;
+				pixman_region32_union_rect(&changed, &changed,
+							   x, y, w, h);
+			}
+		}
+	}
+
+	pixman_region32_intersect(&output->frame_damage,
+				  &output->frame_damage, &changed);
+
+	pixman_region32_fini(&changed);
+	pixman_region32_fini(&tiles);
+}
+
+static void
+rdp_output_reset_tile_cache(struct rdp_output *output)
+{
+	free(output->tile_hashes);
+
+	output->tiles_x = rdp_tile_ceil(output->base.current_mode->width) /
+		RDP_TILE_SIZE;
+	output->tiles_y = rdp_tile_ceil(output->base.current_mode->height) /
+		RDP_TILE_SIZE;
+	output->tile_hashes = calloc(output->tiles_x * output->tiles_y,
+				     sizeof *output->tile_hashes);
+	output->tile_cache_valid = 0;
+}
+
+static void
+rdp_output_kick(struct rdp_output *output);
+
+/* Advance the encoding of the current frame; only called while the encoder
+ * threads are idle. */
+static void
+rdp_output_encode_step(struct rdp_output *output)
+{
+	switch (output->encode_state) {
+	case RDP_ENCODE_IDLE:
+		break;
+	case RDP_ENCODE_ANALYZING:
+		if (rdp_output_queue_encode_jobs(output))
+			output->encode_state = RDP_ENCODE_ENCODING;
+		else
+			output->encode_state = RDP_ENCODE_IDLE;
+		break;
+	case RDP_ENCODE_ENCODING:
+		rdp_output_send_jobs(output);
+		output->encode_state = RDP_ENCODE_IDLE;
+
+		/* Peers that became ready while this frame was encoded */
+		rdp_output_kick(output);
+		break;
+	}
+}
+
+/* Send accumulated damage to the peers that are ready for it, without
+ * waiting for a repaint. */
+static void
+rdp_output_kick(struct rdp_output *output)
+{
+	/* Otherwise the peers are looked at when the current frame is sent */
+	if (output->encode_state != RDP_ENCODE_IDLE)
+		return;
+
+	pixman_region32_clear(&output->frame_damage);
+	output->encode_state = RDP_ENCODE_ANALYZING;
+	rdp_output_encode_step(output);
+}
+
+static int
+pacing_timer_handler(void *data)
+{
+	struct rdp_output *output = data;
+
+	rdp_output_kick(output);
+
+	return 1;
+}
+
+/* Block until the current frame has been sent to the peers. Needed before
+ * shadow_surface or the codec contexts are touched on this thread. */
+static void
+rdp_output_finish_encoding(struct rdp_output *output)
+{
+	struct rdp_backend *b = to_rdp_backend(output->base.compositor);
+
+	while (output->encode_state != RDP_ENCODE_IDLE) {
+		rdp_encoder_wait(&b->encoder);
+		rdp_output_encode_step(output);
+	}
+}
+
+/* Make sure no pending job still refers to a peer that is going away */
+static void
+rdp_output_forget_peer(struct rdp_output *output, RdpPeerContext *context)
+{
+	struct rdp_backend *b = to_rdp_backend(output->base.compositor);
+	struct rdp_encode_job *job;
+	RdpPeerContext **p;
+
+	rdp_encoder_wait(&b->encoder);
+
+	wl_list_for_each(job, &output->jobs, link) {
+		if (job->encoder == context)
+			job->encoder = NULL;
+		wl_array_for_each(p, &job->peers) {
+			if (*p == context)
+				*p = NULL;
+		}
+	}
+}
+
 static void
 rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
-	rdpSettings *settings = peer->settings;
+	struct rdp_encode_job *job;
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+	/* Synchronous, for the initial full refresh; the caller made sure
+	 * the encoder threads are not using this peer. */
+	job = rdp_output_get_job(output);
+	if (!job) {
+		weston_log("%s: out of memory\n", __func__);
+		return;
+	}
+
+	job->codec = rdp_peer_codec(peer);
+	job->encoder = context;
+	job->max_request_size = peer->settings->MultifragMaxRequestSize;
+	pixman_region32_copy(&job->region, region);
+
+	rdp_encode_job_run(&job->work);
+	rdp_encode_job_send(job, context);
+
+	rdp_output_release_job(output, job);
+}
+
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder *encoder = data;
+	struct rdp_work *work;
+	uint64_t value = 1;
+	ssize_t ret;
+
+	pthread_mutex_lock(&encoder->mutex);
+
+	for (;;) {
+		while (wl_list_empty(&encoder->queue) && !encoder->destroying)
+			pthread_cond_wait(&encoder->work_cond, &encoder->mutex);
+
+		if (encoder->destroying)
+			break;
+
+		work = container_of(encoder->queue.next, struct rdp_work, link);
+		wl_list_remove(&work->link);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		work->run(work);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (--encoder->outstanding == 0) {
+			pthread_cond_broadcast(&encoder->idle_cond);
+			ret = write(encoder->fd, &value, sizeof value);
+			(void) ret;
+		}
+	}
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static int
+rdp_encoder_activity(int fd, uint32_t mask, void *data)
+{
+	struct rdp_backend *b = data;
+	uint64_t value;
+	int idle;
+
+	if (read(fd, &value, sizeof value) != sizeof value)
+		return 0;
+
+	pthread_mutex_lock(&b->encoder.mutex);
+	idle = b->encoder.outstanding == 0;
+	pthread_mutex_unlock(&b->encoder.mutex);
+
+	/* The frame may already have been completed synchronously by
+	 * rdp_output_finish_encoding(), that's fine. */
+	if (idle && b->output)
+		rdp_output_encode_step(b->output);
+
+	return 0;
+}
+
+static int
+rdp_encoder_init(struct rdp_backend *b)
+{
+	struct rdp_encoder *encoder = &b->encoder;
+	struct wl_event_loop *loop;
+	long ncpus;
+	int i;
+
+	wl_list_init(&encoder->queue);
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->work_cond, NULL);
+	pthread_cond_init(&encoder->idle_cond, NULL);
+
+	encoder->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (encoder->fd < 0) {
+		weston_log("unable to create encoder eventfd: %m\n");
+		goto err_sync;
+	}
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	encoder->source = wl_event_loop_add_fd(loop, encoder->fd,
+					       WL_EVENT_READABLE,
+					       rdp_encoder_activity, b);
+	if (!encoder->source)
+		goto err_fd;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpus = MAX(1, MIN(ncpus, RDP_MAX_ENCODER_THREADS));
+
+	for (i = 0; i < ncpus; i++) {
+		if (pthread_create(&encoder->threads[i], NULL,
+				   rdp_encoder_thread, encoder) != 0)
+			break;
+	}
+	if (i == 0) {
+		weston_log("unable to start encoder threads\n");
+		goto err_source;
+	}
+	encoder->nthreads = i;
+
+	return 0;
+
+err_source:
+	wl_event_source_remove(encoder->source);
+err_fd:
+	close(encoder->fd);
+err_sync:
+	pthread_cond_destroy(&encoder->idle_cond);
+	pthread_cond_destroy(&encoder->work_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	return -1;
+}
+
+static void
+rdp_encoder_fini(struct rdp_encoder *encoder)
+{
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->destroying = 1;
+	pthread_cond_broadcast(&encoder->work_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->nthreads; i++)
+		pthread_join(encoder->threads[i], NULL);
+
+	wl_event_source_remove(encoder->source);
+	close(encoder->fd);
+	pthread_cond_destroy(&encoder->idle_cond);
+	pthread_cond_destroy(&encoder->work_cond);
+	pthread_mutex_destroy(&encoder->mutex);
 }
 
 static void
@@ -375,18 +1106,31 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
 	struct rdp_peers_item *outputPeer;
+	int active = 0;
+
+	/* The previous frame is normally long sent by now; if not, the
+	 * encoders must be done reading shadow_surface before we draw. */
+	rdp_output_finish_encoding(output);
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
 	if (pixman_region32_not_empty(damage)) {
-		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+		wl_list_for_each(outputPeer, &output->peers, link)
+			active |= rdp_peer_wants_update(outputPeer);
+
+		if (active) {
+			pixman_region32_copy(&output->frame_damage, damage);
+			output->analyze_force = !output->tile_cache_valid;
+			output->tile_cache_valid = 1;
+			output->encode_state = RDP_ENCODE_ANALYZING;
+			rdp_encoder_submit(&b->encoder, &output->analyze_work);
+		} else {
+			/* Nobody got this frame, so the cached hashes no
+			 * longer describe what the peers have seen. */
+			output->tile_cache_valid = 0;
 		}
 	}
 
@@ -454,6 +1198,8 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	if (local_mode == output->current_mode)
 		return 0;
 
+	rdp_output_finish_encoding(rdpOutput);
+
 	output->current_mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
 
 	output->current_mode = local_mode;
@@ -468,6 +1214,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 			0, 0, 0, 0, 0, 0, target_mode->width, target_mode->height);
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
+	rdp_output_reset_tile_cache(rdpOutput);
 
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
 		settings = rdpPeer->peer->settings;
@@ -554,6 +1301,14 @@ rdp_output_enable(struct weston_output *base)
 
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
+	output->pacing_timer = wl_event_loop_add_timer(loop, pacing_timer_handler, output);
+
+	output->encode_state = RDP_ENCODE_IDLE;
+	output->analyze_work.run = rdp_output_analyze;
+	pixman_region32_init(&output->frame_damage);
+	wl_list_init(&output->jobs);
+	wl_list_init(&output->free_jobs);
+	rdp_output_reset_tile_cache(output);
 
 	b->output = output;
 
@@ -565,14 +1320,23 @@ rdp_output_disable(struct weston_output *base)
 {
 	struct rdp_output *output = to_rdp_output(base);
 	struct rdp_backend *b = to_rdp_backend(base->compositor);
+	struct rdp_encode_job *job, *next;
 
 	if (!output->base.enabled)
 		return 0;
 
+	rdp_output_finish_encoding(output);
+	wl_list_for_each_safe(job, next, &output->free_jobs, link)
+		rdp_encode_job_destroy(job);
+	pixman_region32_fini(&output->frame_damage);
+	free(output->tile_hashes);
+	output->tile_hashes = NULL;
+
 	pixman_image_unref(output->shadow_surface);
 	pixman_renderer_output_destroy(&output->base);
 
 	wl_event_source_remove(output->finish_frame_timer);
+	wl_event_source_remove(output->pacing_timer);
 	b->output = NULL;
 
 	return 0;
@@ -645,6 +1409,8 @@ rdp_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		rdp_head_destroy(to_rdp_head(base));
 
+	rdp_encoder_fini(&b->encoder);
+
 	for (i = 0; i < MAX_FREERDP_FDS; i++)
 		if (b->listener_events[i])
 			wl_event_source_remove(b->listener_events[i]);
@@ -723,16 +1489,12 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 
 	nsc_context_set_pixel_format(context->nsc_context, DEFAULT_PIXEL_FORMAT);
 
-	context->encode_stream = Stream_New(NULL, 65536);
-	if (!context->encode_stream)
-		goto out_error_stream;
+	pixman_region32_init(&context->damage);
 
 	FREERDP_CB_RETURN(TRUE);
 
 out_error_nsc:
 	rfx_context_free(context->rfx_context);
-out_error_stream:
-	nsc_context_free(context->nsc_context);
 	FREERDP_CB_RETURN(FALSE);
 }
 
@@ -743,6 +1505,9 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	if (!context)
 		return;
 
+	if (context->rdpBackend && context->rdpBackend->output)
+		rdp_output_forget_peer(context->rdpBackend->output, context);
+
 	wl_list_remove(&context->item.link);
 	for (i = 0; i < MAX_FREERDP_FDS; i++) {
 		if (context->events[i])
@@ -756,10 +1521,9 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
-	Stream_Free(context->encode_stream, TRUE);
+	pixman_region32_fini(&context->damage);
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
 }
 
 
@@ -950,6 +1714,10 @@ xf_peer_activate(freerdp_peer* client)
 		return FALSE;
 	}
 
+	/* Reactivation resets the codec contexts, which the encoder threads
+	 * may still be using for the current frame. */
+	rdp_output_finish_encoding(output);
+
 	if (output->base.width != (int)settings->DesktopWidth ||
 			output->base.height != (int)settings->DesktopHeight)
 	{
@@ -985,6 +1753,9 @@ xf_peer_activate(freerdp_peer* client)
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
 	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
 
+	/* Frames sent before the reactivation will not be acknowledged */
+	peerCtx->acked_frame_id = peerCtx->frame_id;
+
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
 
@@ -1048,6 +1819,7 @@ xf_peer_activate(freerdp_peer* client)
 	pixman_region32_init_with_extents(&damage, &box);
 
 	rdp_peer_refresh_region(&damage, client);
+	pixman_region32_clear(&peerCtx->damage);
 
 	pixman_region32_fini(&damage);
 
@@ -1145,22 +1917,14 @@ xf_extendedMouseEvent(rdpInput *input, UINT16 flags, UINT16 x, UINT16 y)
 static FREERDP_CB_RET_TYPE
 xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 {
-	freerdp_peer *client = input->context->peer;
 	RdpPeerContext *peerCtx = (RdpPeerContext *)input->context;
 	struct rdp_output *output = peerCtx->rdpBackend->output;
-	pixman_box32_t box;
-	pixman_region32_t damage;
 
-	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
-
-	rdp_peer_refresh_region(&damage, client);
+	/* sends a full refresh, as soon as the peer can take a frame */
+	pixman_region32_union_rect(&peerCtx->damage, &peerCtx->damage, 0, 0,
+				   output->base.width, output->base.height);
+	rdp_output_kick(output);
 
-	pixman_region32_fini(&damage);
 	FREERDP_CB_RETURN(TRUE);
 }
 
@@ -1218,11 +1982,37 @@ static FREERDP_CB_RET_TYPE
 xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
-
-	if (allow)
+	struct rdp_output *output = peerContext->rdpBackend->output;
+
+	if (allow) {
+		/* Nothing was accumulated while the output was suppressed */
+		if (!(peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED) &&
+		    output)
+			pixman_region32_union_rect(&peerContext->damage,
+						   &peerContext->damage, 0, 0,
+						   output->base.width,
+						   output->base.height);
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+		if (output)
+			rdp_output_kick(output);
+	} else {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+	}
+
+	FREERDP_CB_RETURN(TRUE);
+}
+
+static FREERDP_CB_RET_TYPE
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct rdp_output *output = peerContext->rdpBackend->output;
+
+	peerContext->acked_frame_id = frameId;
+
+	/* A peer that was behind may take its accumulated damage now */
+	if (output && pixman_region32_not_empty(&peerContext->damage))
+		rdp_output_kick(output);
 
 	FREERDP_CB_RETURN(TRUE);
 }
@@ -1271,12 +2061,15 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	settings->NSCodec = TRUE;
 	settings->FrameMarkerCommandEnabled = TRUE;
 	settings->SurfaceFrameMarkerEnabled = TRUE;
+	settings->FrameAcknowledge = RDP_DEFAULT_FRAMES_IN_FLIGHT;
 
 	client->Capabilities = xf_peer_capabilities;
 	client->PostConnect = xf_peer_post_connect;
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = (pSuppressOutput)xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge =
+		(pSurfaceFrameAcknowledge)xf_surface_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1343,6 +2136,8 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->base.create_output = rdp_output_create;
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->no_clients_resize = config->no_clients_resize;
+	if (config->max_fps > 0)
+		b->min_frame_interval = 1000 / config->max_fps;
 
 	compositor->backend = &b->base;
 
@@ -1365,6 +2160,9 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (rdp_head_create(compositor, "rdp") < 0)
 		goto err_compositor;
 
+	if (rdp_encoder_init(b) < 0)
+		goto err_compositor;
+
 	compositor->capabilities |= WESTON_CAP_ARBITRARY_MODES;
 
 	if (!config->env_socket) {
@@ -1377,7 +2175,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 		}
 
 		if (rdp_implant_listener(b, b->listener) < 0)
-			goto err_compositor;
+			goto err_encoder;
 	} else {
 		/* get the socket from RDP_FD var */
 		fd_str = getenv("RDP_FD");
@@ -1406,6 +2204,8 @@ err_listener:
 	freerdp_listener_free(b->listener);
 err_output:
 	weston_output_release(&b->output->base);
+err_encoder:
+	rdp_encoder_fini(&b->encoder);
 err_compositor:
 	weston_compositor_shutdown(compositor);
 err_free_strings:
@@ -1426,6 +2226,7 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->max_fps = 0;
 }
 
 WL_EXPORT int
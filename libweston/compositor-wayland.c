@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -56,12 +57,15 @@
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-unstable-v6-client-protocol.h"
-#include "presentation-time-server-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "linux-dmabuf.h"
 #include "windowed-output-api.h"
 
 #define WINDOW_TITLE "Weston Compositor"
 
+/* Number of buffers carved out of one parent wl_shm_pool */
+#define WAYLAND_SHM_POOL_SLOTS 3
+
 struct wayland_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -74,6 +78,9 @@ struct wayland_backend {
 		struct zxdg_shell_v6 *xdg_shell;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct wp_presentation *presentation;
+		clockid_t presentation_clock;
+		bool presentation_clock_valid;
 
 		struct wl_list output_list;
 
@@ -128,11 +135,20 @@ struct wayland_output {
 	struct {
 		struct wl_list buffers;
 		struct wl_list free_buffers;
+		struct wayland_shm_pool *pool;
+		bool full_damage;
 	} shm;
 
 	struct weston_mode mode;
 
 	struct wl_callback *frame_cb;
+	struct wp_presentation_feedback *feedback;
+
+	struct {
+		bool valid;
+		struct timespec ts;
+		uint32_t flags;
+	} presented;
 };
 
 struct wayland_parent_output {
@@ -166,11 +182,31 @@ struct wayland_head {
 	struct wayland_parent_output *parent_output;
 };
 
+/** A parent wl_shm_pool split into equally sized buffer slots
+ *
+ * The pool outlives resizes as long as the new buffer size still fits in
+ * a slot, so steady-state rendering and most resizes never create, map or
+ * unmap shared memory. Once an output stops using a pool (output is NULL),
+ * it is destroyed together with its last buffer.
+ */
+struct wayland_shm_pool {
+	struct wayland_output *output;
+	struct wl_shm_pool *pool;
+	void *data;
+	size_t size;
+	size_t slot_size;
+	int nslots;
+	uint32_t used_slots;			/**< bitmask */
+};
+
 struct wayland_shm_buffer {
 	struct wayland_output *output;
 	struct wl_list link;
 	struct wl_list free_link;
 
+	struct wayland_shm_pool *pool;
+	int slot;
+
 	struct wl_buffer *buffer;
 	void *data;
 	size_t size;
@@ -233,6 +269,84 @@ to_wayland_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct wayland_backend, base);
 }
 
+static struct wayland_shm_pool *
+wayland_shm_pool_create(struct wayland_output *output, size_t slot_size,
+			int nslots)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct wayland_shm_pool *pool;
+	int fd;
+
+	pool = zalloc(sizeof *pool);
+	if (pool == NULL) {
+		weston_log("could not zalloc %zu memory for pool: %m\n",
+			   sizeof *pool);
+		return NULL;
+	}
+
+	pool->output = output;
+	pool->slot_size = slot_size;
+	pool->nslots = nslots;
+	pool->size = slot_size * nslots;
+
+	fd = os_create_anonymous_file(pool->size);
+	if (fd < 0) {
+		weston_log("could not create an anonymous file buffer: %m\n");
+		free(pool);
+		return NULL;
+	}
+
+	pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (pool->data == MAP_FAILED) {
+		weston_log("could not mmap %zu memory for data: %m\n",
+			   pool->size);
+		close(fd);
+		free(pool);
+		return NULL;
+	}
+
+	pool->pool = wl_shm_create_pool(b->parent.shm, fd, pool->size);
+	close(fd);
+
+	return pool;
+}
+
+static void
+wayland_shm_pool_destroy(struct wayland_shm_pool *pool)
+{
+	wl_shm_pool_destroy(pool->pool);
+	munmap(pool->data, pool->size);
+	free(pool);
+}
+
+static void
+wayland_shm_pool_release_slot(struct wayland_shm_pool *pool, int slot)
+{
+	pool->used_slots &= ~(1u << slot);
+
+	if (!pool->output && pool->used_slots == 0)
+		wayland_shm_pool_destroy(pool);
+}
+
+/* Stop allocating new buffers from the output's current pool. Buffers
+ * still using it keep it alive until they are destroyed. */
+static void
+wayland_output_retire_shm_pool(struct wayland_output *output)
+{
+	struct wayland_shm_pool *pool = output->shm.pool;
+
+	if (!pool)
+		return;
+
+	output->shm.pool = NULL;
+	pool->output = NULL;
+
+	if (pool->used_slots == 0)
+		wayland_shm_pool_destroy(pool);
+}
+
 static void
 wayland_shm_buffer_destroy(struct wayland_shm_buffer *buffer)
 {
@@ -240,7 +354,7 @@ wayland_shm_buffer_destroy(struct wayland_shm_buffer *buffer)
 	pixman_image_unref(buffer->pm_image);
 
 	wl_buffer_destroy(buffer->buffer);
-	munmap(buffer->data, buffer->size);
+	wayland_shm_pool_release_slot(buffer->pool, buffer->slot);
 
 	pixman_region32_fini(&buffer->damage);
 
@@ -270,13 +384,12 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 {
 	struct wayland_backend *b =
 		to_wayland_backend(output->base.compositor);
-	struct wl_shm *shm = b->parent.shm;
 	struct wayland_shm_buffer *sb;
-
-	struct wl_shm_pool *pool;
+	struct wayland_shm_pool *pool;
 	int width, height, stride;
 	int32_t fx, fy;
-	int fd;
+	size_t size;
+	int slot;
 	unsigned char *data;
 
 	if (!wl_list_empty(&output->shm.free_buffers)) {
@@ -297,28 +410,39 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	}
 
 	stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+	size = (size_t) height * stride;
 
-	fd = os_create_anonymous_file(height * stride);
-	if (fd < 0) {
-		weston_log("could not create an anonymous file buffer: %m\n");
-		return NULL;
+	/* Reuse the current pool unless the new size does not fit in a slot
+	 * or the parent still holds on to every slot. */
+	pool = output->shm.pool;
+	if (pool && (pool->slot_size < size ||
+		     pool->used_slots == (1u << pool->nslots) - 1)) {
+		wayland_output_retire_shm_pool(output);
+		pool = NULL;
 	}
 
-	data = mmap(NULL, height * stride, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		weston_log("could not mmap %d memory for data: %m\n", height * stride);
-		close(fd);
-		return NULL;
+	if (!pool) {
+		/* The GL renderer only needs the initial frame */
+		pool = wayland_shm_pool_create(output, size,
+					       b->use_pixman ?
+					       WAYLAND_SHM_POOL_SLOTS : 1);
+		if (!pool)
+			return NULL;
+		output->shm.pool = pool;
 	}
 
 	sb = zalloc(sizeof *sb);
 	if (sb == NULL) {
 		weston_log("could not zalloc %zu memory for sb: %m\n", sizeof *sb);
-		close(fd);
-		munmap(data, height * stride);
 		return NULL;
 	}
 
+	slot = ffs(~pool->used_slots) - 1;
+	pool->used_slots |= 1u << slot;
+	data = (unsigned char *) pool->data + slot * pool->slot_size;
+
+	sb->pool = pool;
+	sb->slot = slot;
 	sb->output = output;
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&output->shm.buffers, &sb->link);
@@ -328,17 +452,14 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	sb->frame_damaged = 1;
 
 	sb->data = data;
-	sb->size = height * stride;
-
-	pool = wl_shm_create_pool(shm, fd, sb->size);
+	sb->size = size;
 
-	sb->buffer = wl_shm_pool_create_buffer(pool, 0,
+	sb->buffer = wl_shm_pool_create_buffer(pool->pool,
+					       slot * pool->slot_size,
 					       width, height,
 					       stride,
 					       WL_SHM_FORMAT_ARGB8888);
 	wl_buffer_add_listener(sb->buffer, &buffer_listener, sb);
-	wl_shm_pool_destroy(pool);
-	close(fd);
 
 	memset(data, 0, sb->size);
 
@@ -358,33 +479,123 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	return sb;
 }
 
+/* The frame callback paces the repaint loop, the presentation feedback (if
+ * any) provides the timestamp: finish the frame once both have arrived. */
+static void
+wayland_output_maybe_finish_frame(struct wayland_output *output)
+{
+	struct timespec ts;
+	uint32_t flags = 0;
+
+	if (output->frame_cb || output->feedback)
+		return;
+
+	if (output->presented.valid) {
+		ts = output->presented.ts;
+		flags = output->presented.flags;
+		output->presented.valid = false;
+	} else {
+		/*
+		 * This is the fallback case, where Presentation extension is
+		 * not available from the parent compositor or the frame was
+		 * not presented. We do not know the base for the frame
+		 * callback 'time', so we cannot feed it to finish_frame(). Do
+		 * the only thing we can, and pretend finish_frame time is
+		 * when we process this event.
+		 */
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &ts);
+	}
+
+	weston_output_finish_frame(&output->base, &ts, flags);
+}
+
 static void
 frame_done(void *data, struct wl_callback *callback, uint32_t time)
 {
 	struct wayland_output *output = data;
-	struct timespec ts;
 
 	assert(callback == output->frame_cb);
 	wl_callback_destroy(callback);
 	output->frame_cb = NULL;
 
-	/* XXX: use the presentation extension for proper timings */
-
-	/*
-	 * This is the fallback case, where Presentation extension is not
-	 * available from the parent compositor. We do not know the base for
-	 * 'time', so we cannot feed it to finish_frame(). Do the only thing
-	 * we can, and pretend finish_frame time is when we process this
-	 * event.
-	 */
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	wayland_output_maybe_finish_frame(output);
 }
 
 static const struct wl_callback_listener frame_listener = {
 	frame_done
 };
 
+static void
+feedback_sync_output(void *data,
+		     struct wp_presentation_feedback *feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+feedback_presented(void *data,
+		   struct wp_presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct wayland_output *output = data;
+
+	assert(feedback == output->feedback);
+	wp_presentation_feedback_destroy(feedback);
+	output->feedback = NULL;
+
+	/* The parent composites our buffer, so it is never zero-copy from
+	 * the point of view of our own clients. */
+	timespec_from_proto(&output->presented.ts, tv_sec_hi, tv_sec_lo,
+			    tv_nsec);
+	output->presented.flags = flags & ~WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+	output->presented.valid = true;
+
+	wayland_output_maybe_finish_frame(output);
+}
+
+static void
+feedback_discarded(void *data,
+		   struct wp_presentation_feedback *feedback)
+{
+	struct wayland_output *output = data;
+
+	assert(feedback == output->feedback);
+	wp_presentation_feedback_destroy(feedback);
+	output->feedback = NULL;
+
+	wayland_output_maybe_finish_frame(output);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+/* Ask for a frame callback and, if the parent's presentation clock is ours,
+ * presentation feedback for the next commit of the parent surface. */
+static void
+wayland_output_schedule_frame(struct wayland_output *output)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+
+	output->frame_cb = wl_surface_frame(output->parent.surface);
+	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+
+	if (b->parent.presentation_clock_valid) {
+		output->feedback =
+			wp_presentation_feedback(b->parent.presentation,
+						 output->parent.surface);
+		wp_presentation_feedback_add_listener(output->feedback,
+						      &feedback_listener,
+						      output);
+	}
+}
+
 static void
 draw_initial_frame(struct wayland_output *output)
 {
@@ -393,9 +604,11 @@ draw_initial_frame(struct wayland_output *output)
 	sb = wayland_output_get_shm_buffer(output);
 
 	/* If we are rendering with GL, then orphan it so that it gets
-	 * destroyed immediately */
-	if (output->gl.egl_window)
+	 * destroyed immediately, together with its pool */
+	if (output->gl.egl_window) {
 		sb->output = NULL;
+		wayland_output_retire_shm_pool(output);
+	}
 
 	wl_surface_attach(output->parent.surface, sb->buffer, 0, 0);
 	wl_surface_damage(output->parent.surface, 0, 0,
@@ -508,8 +721,7 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	struct wayland_output *output = to_wayland_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+	wayland_output_schedule_frame(output);
 
 	wayland_output_update_gl_border(output);
 
@@ -561,29 +773,54 @@ wayland_output_update_shm_border(struct wayland_shm_buffer *buffer)
 	cairo_destroy(cr);
 }
 
+/* Attach the buffer and damage what changed since the previously attached
+ * one: the output damage of this frame plus the decorations if they were
+ * redrawn. The buffer itself may have been brought up to date over a larger
+ * region, but the parent already has the rest from the last buffer. */
 static void
-wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
+wayland_shm_buffer_attach(struct wayland_shm_buffer *sb,
+			  pixman_region32_t *output_damage)
 {
+	struct wayland_output *output = sb->output;
+	struct wl_surface *surface = output->parent.surface;
 	pixman_region32_t damage;
 	pixman_box32_t *rects;
 	int32_t ix, iy, iwidth, iheight, fwidth, fheight;
+	bool damage_buffer;
 	int i, n;
 
 	pixman_region32_init(&damage);
-	pixman_region32_copy(&damage, &sb->damage);
-	pixman_region32_translate(&damage, -sb->output->base.x,
-				  -sb->output->base.y);
-
-	weston_transformed_region(sb->output->base.width,
-				  sb->output->base.height,
-				  sb->output->base.transform,
-				  sb->output->base.current_scale,
+
+	if (output->shm.full_damage) {
+		/* The surface was resized, the old contents are gone */
+		output->shm.full_damage = false;
+
+		if (output->frame) {
+			fwidth = frame_width(output->frame);
+			fheight = frame_height(output->frame);
+		} else {
+			fwidth = output->base.current_mode->width;
+			fheight = output->base.current_mode->height;
+		}
+		pixman_region32_union_rect(&damage, &damage,
+					   0, 0, fwidth, fheight);
+		goto attach;
+	}
+
+	pixman_region32_copy(&damage, output_damage);
+	pixman_region32_translate(&damage, -output->base.x,
+				  -output->base.y);
+
+	weston_transformed_region(output->base.width,
+				  output->base.height,
+				  output->base.transform,
+				  output->base.current_scale,
 				  &damage, &damage);
 
-	if (sb->output->frame) {
-		frame_interior(sb->output->frame, &ix, &iy, &iwidth, &iheight);
-		fwidth = frame_width(sb->output->frame);
-		fheight = frame_height(sb->output->frame);
+	if (output->frame) {
+		frame_interior(output->frame, &ix, &iy, &iwidth, &iheight);
+		fwidth = frame_width(output->frame);
+		fheight = frame_height(output->frame);
 
 		pixman_region32_translate(&damage, ix, iy);
 
@@ -601,15 +838,28 @@ wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
 		}
 	}
 
+attach:
+	/* Our damage is in buffer coordinates; older parents only take
+	 * surface coordinates, which over-damages with a buffer scale. */
+	damage_buffer = wl_surface_get_version(surface) >=
+			WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION;
+
 	rects = pixman_region32_rectangles(&damage, &n);
-	wl_surface_attach(sb->output->parent.surface, sb->buffer, 0, 0);
-	for (i = 0; i < n; ++i)
-		wl_surface_damage(sb->output->parent.surface, rects[i].x1,
-				  rects[i].y1, rects[i].x2 - rects[i].x1,
-				  rects[i].y2 - rects[i].y1);
+	wl_surface_attach(surface, sb->buffer, 0, 0);
+	for (i = 0; i < n; ++i) {
+		if (damage_buffer)
+			wl_surface_damage_buffer(surface, rects[i].x1,
+						 rects[i].y1,
+						 rects[i].x2 - rects[i].x1,
+						 rects[i].y2 - rects[i].y1);
+		else
+			wl_surface_damage(surface, rects[i].x1,
+					  rects[i].y1,
+					  rects[i].x2 - rects[i].x1,
+					  rects[i].y2 - rects[i].y1);
+	}
 
-	if (sb->output->frame)
-		pixman_region32_fini(&damage);
+	pixman_region32_fini(&damage);
 }
 
 static int
@@ -637,10 +887,9 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 	pixman_renderer_output_set_buffer(output_base, sb->pm_image);
 	b->compositor->renderer->repaint_output(output_base, &sb->damage);
 
-	wayland_shm_buffer_attach(sb);
+	wayland_shm_buffer_attach(sb, damage);
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+	wayland_output_schedule_frame(output);
 	wl_surface_commit(output->parent.surface);
 	wl_display_flush(b->parent.wl_display);
 
@@ -688,6 +937,8 @@ wayland_output_destroy_shm_buffers(struct wayland_output *output)
 	/* These will get thrown away when they get released */
 	wl_list_for_each(buffer, &output->shm.buffers, link)
 		buffer->output = NULL;
+
+	output->shm.full_damage = true;
 }
 
 static int
@@ -709,6 +960,7 @@ wayland_output_disable(struct weston_output *base)
 	}
 
 	wayland_output_destroy_shm_buffers(output);
+	wayland_output_retire_shm_pool(output);
 
 	wayland_backend_destroy_output_surface(output);
 
@@ -734,6 +986,8 @@ wayland_output_destroy(struct weston_output *base)
 
 	if (output->frame_cb)
 		wl_callback_destroy(output->frame_cb);
+	if (output->feedback)
+		wp_presentation_feedback_destroy(output->feedback);
 
 	free(output->title);
 	free(output);
@@ -2516,6 +2770,20 @@ static const struct zxdg_shell_v6_listener xdg_shell_listener = {
 	xdg_shell_ping,
 };
 
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct wayland_backend *b = data;
+
+	b->parent.presentation_clock = clk_id;
+	b->parent.presentation_clock_valid = true;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		       const char *interface, uint32_t version)
@@ -2548,6 +2816,12 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wp_presentation") == 0) {
+		b->parent.presentation =
+			wl_registry_bind(registry, name,
+					 &wp_presentation_interface, 1);
+		wp_presentation_add_listener(b->parent.presentation,
+					     &presentation_listener, b);
 	}
 }
 
@@ -2608,6 +2882,9 @@ wayland_destroy(struct weston_compositor *ec)
 	if (b->parent.shm)
 		wl_shm_destroy(b->parent.shm);
 
+	if (b->parent.presentation)
+		wp_presentation_destroy(b->parent.presentation);
+
 	if (b->parent.xdg_shell)
 		zxdg_shell_v6_destroy(b->parent.xdg_shell);
 
@@ -2721,6 +2998,17 @@ wayland_backend_create(struct weston_compositor *compositor,
 	wl_registry_add_listener(b->parent.registry, &registry_listener, b);
 	wl_display_roundtrip(b->parent.wl_display);
 
+	/* Use the parent's presentation clock, so that its feedback
+	 * timestamps can be passed on to our clients unchanged. */
+	if (b->parent.presentation) {
+		wl_display_roundtrip(b->parent.wl_display);
+
+		if (b->parent.presentation_clock_valid &&
+		    weston_compositor_set_presentation_clock(compositor,
+				b->parent.presentation_clock) < 0)
+			b->parent.presentation_clock_valid = false;
+	}
+
 	create_cursor(b, new_config);
 
 #ifdef ENABLE_EGL
@@ -44,6 +44,9 @@
 #ifdef HAVE_XCB_XKB
 #include <xcb/xkb.h>
 #endif
+#ifdef HAVE_XCB_PRESENT
+#include <xcb/present.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xlib-xcb.h>
@@ -72,6 +75,12 @@
 #define WINDOW_MAX_WIDTH 8192
 #define WINDOW_MAX_HEIGHT 8192
 
+/* SHM images in flight per output, released by ShmCompletion events */
+#define X11_SHM_BUFFERS 3
+
+/* Above this many damage rectangles, upload their bounding box instead */
+#define X11_SHM_MAX_PUT_RECTS 32
+
 struct x11_backend {
 	struct weston_backend	 base;
 	struct weston_compositor *compositor;
@@ -85,6 +94,9 @@ struct x11_backend {
 	struct xkb_keymap	*xkb_keymap;
 	unsigned int		 has_xkb;
 	uint8_t			 xkb_event_base;
+	uint8_t			 shm_event_base;
+	unsigned int		 has_present;
+	uint8_t			 present_opcode;
 	int			 fullscreen;
 	int			 no_input;
 	int			 use_pixman;
@@ -120,6 +132,15 @@ struct x11_head {
 	struct weston_head	base;
 };
 
+struct x11_shm_buffer {
+	xcb_shm_seg_t		segment;
+	pixman_image_t	       *hw_surface;
+	void		       *buf;
+	pixman_region32_t	damage;		/**< not yet in this buffer */
+	bool			busy;
+	uint16_t		put_sequence;	/**< of the last put_image */
+};
+
 struct x11_output {
 	struct weston_output	base;
 
@@ -127,12 +148,12 @@ struct x11_output {
 	struct weston_mode	mode;
 	struct weston_mode	native;
 	struct wl_event_source *finish_frame_timer;
+	uint32_t		present_serial;
+	bool			present_pending;
 
 	xcb_gc_t		gc;
-	xcb_shm_seg_t		segment;
-	pixman_image_t	       *hw_surface;
-	int			shm_id;
-	void		       *buf;
+	struct x11_shm_buffer	shm[X11_SHM_BUFFERS];
+	int			shm_count;
 	uint8_t			depth;
 	int32_t                 scale;
 	bool			resize_pending;
@@ -408,6 +429,28 @@ x11_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
+/* With the Present extension, complete the frame on the next vblank of the
+ * window's CRTC (a fake 60 Hz one for Xvfb); otherwise guess with a timer. */
+static void
+x11_output_schedule_finish_frame(struct x11_output *output)
+{
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
+
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present) {
+		output->present_serial++;
+		output->present_pending = true;
+		xcb_present_notify_msc(b->conn, output->window,
+				       output->present_serial, 0, 1, 0);
+		xcb_flush(b->conn);
+		return;
+	}
+#endif
+
+	xcb_flush(b->conn);
+	wl_event_source_timer_update(output->finish_frame_timer, 10);
+}
+
 static int
 x11_output_repaint_gl(struct weston_output *output_base,
 		      pixman_region32_t *damage,
@@ -421,22 +464,49 @@ x11_output_repaint_gl(struct weston_output *output_base,
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 10);
+	x11_output_schedule_finish_frame(output);
 	return 0;
 }
 
+static struct x11_shm_buffer *
+x11_output_get_shm_buffer(struct x11_output *output)
+{
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
+	xcb_get_input_focus_reply_t *reply;
+	int i;
+
+	for (i = 0; i < output->shm_count; i++)
+		if (!output->shm[i].busy)
+			return &output->shm[i];
+
+	/* The server still reads from every image. It handles requests in
+	 * order, so after a round trip all of them are done. */
+	reply = xcb_get_input_focus_reply(b->conn,
+					  xcb_get_input_focus(b->conn), NULL);
+	free(reply);
+
+	for (i = 0; i < output->shm_count; i++)
+		output->shm[i].busy = false;
+
+	return &output->shm[0];
+}
+
+/* Copy the damaged part of the image to the window. Only the last request
+ * asks for a ShmCompletion event, which releases the image for reuse. */
 static void
-set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region)
+x11_output_put_shm_image(struct x11_output *output, struct x11_shm_buffer *sb,
+			 pixman_region32_t *region)
 {
-	struct x11_output *output = to_x11_output(output_base);
-	struct weston_compositor *ec = output->base.compositor;
-	struct x11_backend *b = to_x11_backend(ec);
+	struct weston_output *output_base = &output->base;
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
 	pixman_region32_t transformed_region;
 	pixman_box32_t *rects;
-	xcb_rectangle_t *output_rects;
 	xcb_void_cookie_t cookie;
+	int width, height;
 	int nrects, i;
-	xcb_generic_error_t *err;
+
+	width = pixman_image_get_width(sb->hw_surface);
+	height = pixman_image_get_height(sb->hw_surface);
 
 	pixman_region32_init(&transformed_region);
 	pixman_region32_copy(&transformed_region, region);
@@ -446,37 +516,35 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 				  output_base->transform,
 				  output_base->current_scale,
 				  &transformed_region, &transformed_region);
+	pixman_region32_intersect_rect(&transformed_region,
+				       &transformed_region,
+				       0, 0, width, height);
 
 	rects = pixman_region32_rectangles(&transformed_region, &nrects);
-	output_rects = calloc(nrects, sizeof(xcb_rectangle_t));
-
-	if (output_rects == NULL) {
-		pixman_region32_fini(&transformed_region);
-		return;
+	if (nrects > X11_SHM_MAX_PUT_RECTS) {
+		rects = pixman_region32_extents(&transformed_region);
+		nrects = 1;
 	}
 
 	for (i = 0; i < nrects; i++) {
-		output_rects[i].x = rects[i].x1;
-		output_rects[i].y = rects[i].y1;
-		output_rects[i].width = rects[i].x2 - rects[i].x1;
-		output_rects[i].height = rects[i].y2 - rects[i].y1;
+		cookie = xcb_shm_put_image(b->conn, output->window, output->gc,
+					   width, height,
+					   rects[i].x1, rects[i].y1,
+					   rects[i].x2 - rects[i].x1,
+					   rects[i].y2 - rects[i].y1,
+					   rects[i].x1, rects[i].y1,
+					   output->depth,
+					   XCB_IMAGE_FORMAT_Z_PIXMAP,
+					   i == nrects - 1, sb->segment, 0);
+		sb->put_sequence = cookie.sequence;
 	}
 
-	pixman_region32_fini(&transformed_region);
+	if (nrects > 0)
+		sb->busy = true;
 
-	cookie = xcb_set_clip_rectangles_checked(b->conn, XCB_CLIP_ORDERING_UNSORTED,
-					output->gc,
-					0, 0, nrects,
-					output_rects);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to set clip rects, err: %d\n", err->error_code);
-		free(err);
-	}
-	free(output_rects);
+	pixman_region32_fini(&transformed_region);
 }
 
-
 static int
 x11_output_repaint_shm(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -484,31 +552,28 @@ x11_output_repaint_shm(struct weston_output *output_base,
 {
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
-	struct x11_backend *b = to_x11_backend(ec);
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
+	struct x11_shm_buffer *sb;
+	int i;
+
+	sb = x11_output_get_shm_buffer(output);
 
-	pixman_renderer_output_set_buffer(output_base, output->hw_surface);
+	/* Bring the image up to date with what changed since it was last
+	 * shown, but only send this frame's damage to the window. */
+	pixman_renderer_output_set_buffer(output_base, sb->hw_surface);
+	pixman_renderer_output_set_hw_extra_damage(output_base, &sb->damage);
 	ec->renderer->repaint_output(output_base, damage);
 
+	pixman_region32_clear(&sb->damage);
+	for (i = 0; i < output->shm_count; i++)
+		if (&output->shm[i] != sb)
+			pixman_region32_union(&output->shm[i].damage,
+					      &output->shm[i].damage, damage);
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
-	set_clip_for_output(output_base, damage);
-	cookie = xcb_shm_put_image_checked(b->conn, output->window, output->gc,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
-					0, output->segment, 0);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
-	}
 
-	wl_event_source_timer_update(output->finish_frame_timer, 10);
+	x11_output_put_shm_image(output, sb, damage);
+	x11_output_schedule_finish_frame(output);
 	return 0;
 }
 
@@ -525,21 +590,33 @@ finish_frame_handler(void *data)
 }
 
 static void
-x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+x11_shm_buffer_fini(struct x11_backend *b, struct x11_shm_buffer *sb)
 {
 	xcb_void_cookie_t cookie;
 	xcb_generic_error_t *err;
-	xcb_free_gc(b->conn, output->gc);
 
-	pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
-	cookie = xcb_shm_detach_checked(b->conn, output->segment);
+	pixman_image_unref(sb->hw_surface);
+	sb->hw_surface = NULL;
+	cookie = xcb_shm_detach_checked(b->conn, sb->segment);
 	err = xcb_request_check(b->conn, cookie);
 	if (err) {
 		weston_log("xcb_shm_detach failed, error %d\n", err->error_code);
 		free(err);
 	}
-	shmdt(output->buf);
+	shmdt(sb->buf);
+	pixman_region32_fini(&sb->damage);
+}
+
+static void
+x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+{
+	int i;
+
+	xcb_free_gc(b->conn, output->gc);
+
+	for (i = 0; i < output->shm_count; i++)
+		x11_shm_buffer_fini(b, &output->shm[i]);
+	output->shm_count = 0;
 }
 
 static void
@@ -692,6 +769,51 @@ get_depth_of_visual(xcb_screen_t *screen,
 	return 0;
 }
 
+static int
+x11_shm_buffer_init(struct x11_backend *b, struct x11_shm_buffer *sb,
+		    pixman_format_code_t pixman_format, int bitsperpixel,
+		    int width, int height)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+	int shm_id;
+
+	/* Create SHM segment and attach it */
+	shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
+	if (shm_id == -1) {
+		weston_log("x11shm: failed to allocate SHM segment\n");
+		return -1;
+	}
+	sb->buf = shmat(shm_id, NULL, 0 /* read/write */);
+	if (-1 == (long)sb->buf) {
+		weston_log("x11shm: failed to attach SHM segment\n");
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+	sb->segment = xcb_generate_id(b->conn);
+	cookie = xcb_shm_attach_checked(b->conn, sb->segment, shm_id, 1);
+	err = xcb_request_check(b->conn, cookie);
+	if (err) {
+		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
+			   err->error_code, err->major_code, err->minor_code);
+		free(err);
+		shmdt(sb->buf);
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+
+	shmctl(shm_id, IPC_RMID, NULL);
+
+	/* Now create pixman image */
+	sb->hw_surface = pixman_image_create_bits(pixman_format, width, height, sb->buf,
+		width * (bitsperpixel / 8));
+
+	pixman_region32_init(&sb->damage);
+	sb->busy = false;
+
+	return 0;
+}
+
 static int
 x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	int width, int height)
@@ -699,11 +821,10 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	xcb_visualtype_t *visual_type;
 	xcb_screen_t *screen;
 	xcb_format_iterator_t fmt;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
 	const xcb_query_extension_reply_t *ext;
 	int bitsperpixel = 0;
 	pixman_format_code_t pixman_format;
+	int i;
 
 	/* Check if SHM is available */
 	ext = xcb_get_extension_data(b->conn, &xcb_shm_id);
@@ -713,6 +834,7 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 		errno = ENOENT;
 		return -1;
 	}
+	b->shm_event_base = ext->first_event;
 
 	screen = x11_compositor_get_default_screen(b);
 	visual_type = find_visual_by_id(screen, screen->root_visual);
@@ -758,38 +880,23 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 		return -1;
 	}
 
-
-	/* Create SHM segment and attach it */
-	output->shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
-	if (output->shm_id == -1) {
-		weston_log("x11shm: failed to allocate SHM segment\n");
-		return -1;
-	}
-	output->buf = shmat(output->shm_id, NULL, 0 /* read/write */);
-	if (-1 == (long)output->buf) {
-		weston_log("x11shm: failed to attach SHM segment\n");
-		return -1;
-	}
-	output->segment = xcb_generate_id(b->conn);
-	cookie = xcb_shm_attach_checked(b->conn, output->segment, output->shm_id, 1);
-	err = xcb_request_check(b->conn, cookie);
-	if (err) {
-		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
-			   err->error_code, err->major_code, err->minor_code);
-		free(err);
-		return -1;
+	for (i = 0; i < X11_SHM_BUFFERS; i++) {
+		if (x11_shm_buffer_init(b, &output->shm[i], pixman_format,
+					bitsperpixel, width, height) < 0)
+			goto err;
+		output->shm_count++;
 	}
 
-	shmctl(output->shm_id, IPC_RMID, NULL);
-
-	/* Now create pixman image */
-	output->hw_surface = pixman_image_create_bits(pixman_format, width, height, output->buf,
-		width * (bitsperpixel / 8));
-
 	output->gc = xcb_generate_id(b->conn);
 	xcb_create_gc(b->conn, output->gc, output->window, 0, NULL);
 
 	return 0;
+
+err:
+	for (i = 0; i < output->shm_count; i++)
+		x11_shm_buffer_fini(b, &output->shm[i]);
+	output->shm_count = 0;
+	return -1;
 }
 
 static int
@@ -1058,6 +1165,14 @@ x11_output_enable(struct weston_output *base)
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
+	output->present_pending = false;
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present)
+		xcb_present_select_input(b->conn, xcb_generate_id(b->conn),
+					 output->window,
+					 XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+#endif
+
 	weston_log("x11 output %dx%d, window id %d\n",
 		   output->base.current_mode->width,
 		   output->base.current_mode->height,
@@ -1442,6 +1557,65 @@ x11_backend_next_event(struct x11_backend *b,
 	return *event != NULL;
 }
 
+static void
+x11_backend_deliver_shm_completion(struct x11_backend *b,
+				   xcb_generic_event_t *event)
+{
+	xcb_shm_completion_event_t *completion =
+		(xcb_shm_completion_event_t *) event;
+	struct x11_output *output;
+	int i;
+
+	output = x11_backend_find_output(b, completion->drawable);
+	if (!output)
+		return;
+
+	/* Completions of images that were reclaimed by a round trip and
+	 * sent again carry an older sequence number. */
+	for (i = 0; i < output->shm_count; i++) {
+		if (output->shm[i].segment == completion->shmseg &&
+		    output->shm[i].put_sequence == completion->sequence)
+			output->shm[i].busy = false;
+	}
+}
+
+static void
+x11_backend_deliver_generic_event(struct x11_backend *b,
+				  xcb_generic_event_t *event)
+{
+#ifdef HAVE_XCB_PRESENT
+	xcb_ge_generic_event_t *generic = (xcb_ge_generic_event_t *) event;
+	xcb_present_complete_notify_event_t *complete;
+	struct x11_output *output;
+	struct timespec ts;
+	uint32_t flags = 0;
+
+	if (!b->has_present ||
+	    generic->extension != b->present_opcode ||
+	    generic->event_type != XCB_PRESENT_EVENT_COMPLETE_NOTIFY)
+		return;
+
+	complete = (xcb_present_complete_notify_event_t *) event;
+	output = x11_backend_find_output(b, complete->window);
+	if (!output || !output->present_pending ||
+	    complete->serial != output->present_serial)
+		return;
+
+	output->present_pending = false;
+
+	/* UST is CLOCK_MONOTONIC in microseconds */
+	if (complete->ust) {
+		ts.tv_sec = complete->ust / 1000000;
+		ts.tv_nsec = (complete->ust % 1000000) * 1000;
+		flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+	} else {
+		weston_compositor_read_presentation_clock(b->compositor, &ts);
+	}
+
+	weston_output_finish_frame(&output->base, &ts, flags);
+#endif
+}
+
 static int
 x11_backend_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -1651,7 +1825,14 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 			notify_keyboard_focus_out(&b->core_seat);
 			break;
 
+		case XCB_GE_GENERIC:
+			x11_backend_deliver_generic_event(b, event);
+			break;
+
 		default:
+			if (b->shm_event_base &&
+			    response_type == b->shm_event_base + XCB_SHM_COMPLETION)
+				x11_backend_deliver_shm_completion(b, event);
 			break;
 		}
 
@@ -1818,6 +1999,45 @@ static const struct weston_windowed_output_api api = {
 	x11_head_create,
 };
 
+static void
+x11_backend_setup_present(struct x11_backend *b)
+{
+#ifndef HAVE_XCB_PRESENT
+	weston_log("XCB-Present not available during build\n");
+	b->has_present = 0;
+#else
+	const xcb_query_extension_reply_t *ext;
+	xcb_present_query_version_reply_t *reply;
+
+	b->has_present = 0;
+
+	ext = xcb_get_extension_data(b->conn, &xcb_present_id);
+	if (!ext || !ext->present) {
+		weston_log("Present extension not available on host X11 server\n");
+		return;
+	}
+
+	reply = xcb_present_query_version_reply(b->conn,
+				xcb_present_query_version(b->conn,
+					XCB_PRESENT_MAJOR_VERSION,
+					XCB_PRESENT_MINOR_VERSION),
+				NULL);
+	if (!reply) {
+		weston_log("failed to query Present extension version\n");
+		return;
+	}
+	free(reply);
+
+	/* Present reports completion in CLOCK_MONOTONIC microseconds */
+	if (weston_compositor_set_presentation_clock(b->compositor,
+						     CLOCK_MONOTONIC) < 0)
+		return;
+
+	b->present_opcode = ext->major_opcode;
+	b->has_present = 1;
+#endif
+}
+
 static struct x11_backend *
 x11_backend_create(struct weston_compositor *compositor,
 		   struct weston_x11_backend_config *config)
@@ -1854,6 +2074,7 @@ x11_backend_create(struct weston_compositor *compositor,
 
 	x11_backend_get_resources(b);
 	x11_backend_get_wm_info(b);
+	x11_backend_setup_present(b);
 
 	if (!b->has_net_wm_state_fullscreen && config->fullscreen) {
 		weston_log("Can not fullscreen without window manager support"
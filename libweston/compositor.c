@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <assert.h>
@@ -294,6 +295,7 @@ weston_view_create(struct weston_surface *surface)
 
 	view->surface = surface;
 	view->plane = &surface->compositor->primary_plane;
+	view->id = ++surface->compositor->view_id_counter;
 
 	/* Assign to surface */
 	wl_list_insert(&surface->views, &view->surface_link);
@@ -522,6 +524,8 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	wl_list_init(&surface->pointer_constraints);
 
+	wl_list_init(&surface->suspended_link);
+
 	return surface;
 }
 
@@ -1477,6 +1481,168 @@ weston_view_from_global(struct weston_view *view,
 	*vy = floorf(vyf);
 }
 
+/* Frame callbacks of suspended surfaces are answered at this interval */
+#define SUSPENDED_FRAME_INTERVAL_MS 1000
+
+static void
+surface_flush_damage(struct weston_surface *surface);
+
+/** Check whether a surface, or the surface it is a sub-surface of, is
+ * suspended
+ *
+ * \param surface The surface to check.
+ * \return True if repaints of the surface are suspended.
+ *
+ * \sa weston_surface_set_suspended
+ * \memberof weston_surface
+ */
+WL_EXPORT bool
+weston_surface_is_suspended(struct weston_surface *surface)
+{
+	struct weston_surface *main_surface =
+		weston_surface_get_main_surface(surface);
+
+	return main_surface && main_surface->suspended;
+}
+
+static void
+surface_send_suspended_frames(struct weston_surface *surface, uint32_t msecs)
+{
+	struct weston_frame_callback *cb, *cnext;
+	struct weston_subsurface *sub;
+
+	wl_list_for_each_safe(cb, cnext, &surface->frame_callback_list, link) {
+		wl_callback_send_done(cb->resource, msecs);
+		wl_resource_destroy(cb->resource);
+	}
+
+	/* Nothing of it was presented */
+	weston_presentation_feedback_discard_list(&surface->feedback_list);
+
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		if (sub->surface != surface)
+			surface_send_suspended_frames(sub->surface, msecs);
+	}
+}
+
+static int
+suspended_frame_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_surface *surface;
+	struct timespec now;
+
+	compositor->suspended_frame_pending = false;
+
+	weston_compositor_read_presentation_clock(compositor, &now);
+	wl_list_for_each(surface, &compositor->suspended_surface_list,
+			 suspended_link)
+		surface_send_suspended_frames(surface, timespec_to_msec(&now));
+
+	return 0;
+}
+
+static bool
+surface_tree_has_frame_callbacks(struct weston_surface *surface)
+{
+	struct weston_subsurface *sub;
+
+	if (!wl_list_empty(&surface->frame_callback_list))
+		return true;
+
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		if (sub->surface != surface &&
+		    surface_tree_has_frame_callbacks(sub->surface))
+			return true;
+	}
+
+	return false;
+}
+
+static void
+suspended_frame_schedule(struct weston_compositor *compositor)
+{
+	if (compositor->suspended_frame_pending)
+		return;
+
+	compositor->suspended_frame_pending = true;
+	wl_event_source_timer_update(compositor->suspended_frame_timer,
+				     SUSPENDED_FRAME_INTERVAL_MS);
+}
+
+/* A suspended surface committed: hand the buffer to the renderer right
+ * away and drop the core reference, as compositor_accumulate_damage()
+ * does after a repaint, so it can be released without waiting for one.
+ * The frame callbacks are answered later. */
+static void
+weston_surface_defer_suspended(struct weston_surface *surface)
+{
+	if (surface->buffer_ref.buffer) {
+		surface_flush_damage(surface);
+		if (!surface->keep_buffer)
+			weston_buffer_reference(&surface->buffer_ref, NULL);
+	}
+
+	if (!wl_list_empty(&surface->frame_callback_list))
+		suspended_frame_schedule(surface->compositor);
+}
+
+static void
+surface_damage_tree(struct weston_surface *surface)
+{
+	struct weston_subsurface *sub;
+
+	pixman_region32_union_rect(&surface->damage, &surface->damage,
+				   0, 0, surface->width, surface->height);
+
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		if (sub->surface != surface)
+			surface_damage_tree(sub->surface);
+	}
+}
+
+/** Suspend or resume repainting of a surface
+ *
+ * \param surface The surface, not a sub-surface.
+ * \param suspended True to suspend, false to resume.
+ *
+ * A shell suspends surfaces it has hidden, e.g. on an inactive workspace
+ * or minimized. Commits to them, and their sub-surfaces, no longer cause
+ * repaints. Their buffers are flushed to the renderer at commit, and
+ * their frame callbacks are answered only once a second. On resume, the
+ * whole surface is damaged, since what was committed in between has not
+ * been drawn.
+ *
+ * \memberof weston_surface
+ */
+WL_EXPORT void
+weston_surface_set_suspended(struct weston_surface *surface, bool suspended)
+{
+	struct weston_compositor *compositor = surface->compositor;
+
+	if (surface->suspended == suspended)
+		return;
+
+	surface->suspended = suspended;
+
+	if (suspended) {
+		wl_list_insert(&compositor->suspended_surface_list,
+			       &surface->suspended_link);
+
+		/* A client waiting for a frame callback from before the
+		 * suspension may not commit again until it gets one. */
+		if (surface_tree_has_frame_callbacks(surface))
+			suspended_frame_schedule(compositor);
+		return;
+	}
+
+	wl_list_remove(&surface->suspended_link);
+	wl_list_init(&surface->suspended_link);
+
+	surface_damage_tree(surface);
+	weston_surface_schedule_repaint(surface);
+}
+
 /**
  * \param surface  The surface to be repainted
  *
@@ -1488,6 +1654,11 @@ weston_surface_schedule_repaint(struct weston_surface *surface)
 {
 	struct weston_output *output;
 
+	if (weston_surface_is_suspended(surface)) {
+		weston_surface_defer_suspended(surface);
+		return;
+	}
+
 	wl_list_for_each(output, &surface->compositor->output_list, link)
 		if (surface->output_mask & (1u << output->id))
 			weston_output_schedule_repaint(output);
@@ -1952,6 +2123,8 @@ weston_surface_destroy(struct weston_surface *surface)
 
 	wl_signal_emit(&surface->destroy_signal, surface);
 
+	wl_list_remove(&surface->suspended_link);
+
 	assert(wl_list_empty(&surface->subsurface_list_pending));
 	assert(wl_list_empty(&surface->subsurface_list));
 
@@ -2359,7 +2532,6 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 {
 	struct weston_compositor *ec = output->compositor;
 	struct weston_view *ev;
-	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
@@ -2425,11 +2597,6 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		wl_resource_destroy(cb->resource);
 	}
 
-	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
-		animation->frame_counter++;
-		animation->frame(animation, output, &output->frame_time);
-	}
-
 	TL_POINT("core_repaint_posted", TLP_OUTPUT(output), TLP_END);
 
 	return r;
@@ -2442,6 +2609,92 @@ weston_output_schedule_repaint_reset(struct weston_output *output)
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 }
 
+/* Extrapolate from the last presentation timestamp to the first refresh
+ * cycle that has not started yet, i.e. when the repaint we are about to do
+ * is expected to hit the screen. */
+static void
+weston_output_predict_presentation(struct weston_output *output,
+				   const struct timespec *now,
+				   struct timespec *predicted)
+{
+	int64_t refresh_nsec;
+	int64_t behind_nsec;
+
+	if (timespec_is_zero(&output->frame_time)) {
+		*predicted = *now;
+		return;
+	}
+
+	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	*predicted = output->frame_time;
+	behind_nsec = timespec_sub_to_nsec(now, predicted);
+	if (behind_nsec >= 0)
+		timespec_add_nsec(predicted, predicted,
+				  (behind_nsec / refresh_nsec + 1) *
+				  refresh_nsec);
+}
+
+static bool
+weston_output_repaint_is_due(struct weston_output *output,
+			     const struct timespec *now)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	if (output->repaint_status != REPAINT_SCHEDULED)
+		return false;
+
+	if (compositor->state == WESTON_COMPOSITOR_SLEEPING ||
+	    compositor->state == WESTON_COMPOSITOR_OFFSCREEN)
+		return false;
+
+	return timespec_sub_to_msec(&output->next_repaint, now) <= 1;
+}
+
+/* Advance the animations of every output that is about to be repainted,
+ * sampled at the time the result is going to be presented. This runs once
+ * per repaint cycle before any output is repainted, so that an animation
+ * moving a view across several outputs has updated its transform before
+ * any of them is drawn. */
+static void
+weston_compositor_run_animations(struct weston_compositor *compositor,
+				 const struct timespec *now)
+{
+	struct weston_output *output;
+	struct weston_animation *animation, *next;
+	struct timespec time;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!weston_output_repaint_is_due(output, now))
+			continue;
+
+		weston_output_predict_presentation(output, now, &time);
+
+		wl_list_for_each_safe(animation, next,
+				      &output->animation_list, link) {
+			animation->frame_counter++;
+			animation->frame(animation, output, &time);
+		}
+	}
+}
+
+/* Nothing changed on the output, but it still has animations running.
+ * Stay in the repaint loop without repainting and sample them again on
+ * the next refresh cycle. */
+static bool
+weston_output_skip_repaint_for_animations(struct weston_output *output)
+{
+	int64_t refresh_nsec;
+
+	if (wl_list_empty(&output->animation_list))
+		return false;
+
+	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+			  refresh_nsec);
+
+	return true;
+}
+
 static int
 weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 			    void *repaint_data)
@@ -2466,8 +2719,11 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 
 	/* We don't actually need to repaint this output; drop it from
 	 * repaint until something causes damage. */
-	if (!output->repaint_needed)
+	if (!output->repaint_needed) {
+		if (weston_output_skip_repaint_for_animations(output))
+			return ret;
 		goto err;
+	}
 
 	/* If repaint fails, we aren't going to get weston_output_finish_frame
 	 * to trigger a new repaint, so drop it from repaint and hope
@@ -2536,6 +2792,8 @@ output_repaint_timer_handler(void *data)
 
 	weston_compositor_read_presentation_clock(compositor, &now);
 
+	weston_compositor_run_animations(compositor, &now);
+
 	if (compositor->backend->repaint_begin)
 		repaint_data = compositor->backend->repaint_begin(compositor);
 
@@ -3138,12 +3396,95 @@ apply_damage_buffer(pixman_region32_t *dest,
 	pixman_region32_clear(&state->damage_buffer);
 }
 
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+/* Weight of the newest sample in the surface statistics averages */
+#define SURFACE_STATS_WEIGHT 0.25f
+
+static void
+weston_surface_update_stats(struct weston_surface *surface,
+			    pixman_region32_t *damage)
+{
+	struct weston_surface_stats *stats = &surface->stats;
+	struct timespec now;
+	uint64_t size = (uint64_t) surface->width * surface->height;
+	int64_t interval;
+	float fraction, rate;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+
+	fraction = size ? (float) region_area(damage) / size : 0.0f;
+	if (fraction > 1.0f)
+		fraction = 1.0f;
+
+	if (stats->commits == 0) {
+		stats->damage_fraction = fraction;
+	} else {
+		stats->damage_fraction += SURFACE_STATS_WEIGHT *
+			(fraction - stats->damage_fraction);
+
+		interval = timespec_sub_to_nsec(&now, &stats->last_commit);
+		rate = interval > 0 ? 1e9f / interval : stats->commit_rate;
+		if (stats->commits == 1)
+			stats->commit_rate = rate;
+		else
+			stats->commit_rate += SURFACE_STATS_WEIGHT *
+				(rate - stats->commit_rate);
+	}
+
+	stats->last_commit = now;
+	stats->commits++;
+}
+
+/** Get how often a surface currently commits new buffers
+ *
+ * \param surface The surface to query.
+ * \return Buffer commits per second.
+ *
+ * This is the average rate from the surface statistics, capped by the time
+ * since the last commit so that a surface which stopped updating is seen
+ * as static without having to wait for another commit.
+ */
+WL_EXPORT float
+weston_surface_get_commit_rate(struct weston_surface *surface)
+{
+	struct weston_surface_stats *stats = &surface->stats;
+	struct timespec now;
+	int64_t idle;
+	float rate = stats->commit_rate;
+
+	if (stats->commits < 2)
+		return 0.0f;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+	idle = timespec_sub_to_nsec(&now, &stats->last_commit);
+	if (idle > 0 && 1e9f / idle < rate)
+		rate = 1e9f / idle;
+
+	return rate;
+}
+
 static void
 weston_surface_commit_state(struct weston_surface *surface,
 			    struct weston_surface_state *state)
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t damage;
+	bool new_buffer = state->newly_attached && state->buffer;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -3178,15 +3519,21 @@ weston_surface_commit_state(struct weston_surface *surface,
 	     pixman_region32_not_empty(&state->damage_buffer)))
 		TL_POINT("core_commit_damage", TLP_SURFACE(surface), TLP_END);
 
-	pixman_region32_union(&surface->damage, &surface->damage,
-			      &state->damage_surface);
-
-	apply_damage_buffer(&surface->damage, surface, state);
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &state->damage_surface);
+	apply_damage_buffer(&damage, surface, state);
+	pixman_region32_intersect_rect(&damage, &damage,
+				       0, 0, surface->width, surface->height);
 
+	pixman_region32_union(&surface->damage, &surface->damage, &damage);
 	pixman_region32_intersect_rect(&surface->damage, &surface->damage,
 				       0, 0, surface->width, surface->height);
 	pixman_region32_clear(&state->damage_surface);
 
+	if (new_buffer)
+		weston_surface_update_stats(surface, &damage);
+	pixman_region32_fini(&damage);
+
 	/* wl_surface.set_opaque_region */
 	pixman_region32_init(&opaque);
 	pixman_region32_intersect_rect(&opaque, &state->opaque,
@@ -6288,6 +6635,36 @@ timeline_key_binding_handler(struct weston_keyboard *keyboard,
 		weston_timeline_open(compositor);
 }
 
+static void
+surface_stats_key_binding_handler(struct weston_keyboard *keyboard,
+				  const struct timespec *time, uint32_t key,
+				  void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_view *view;
+	struct weston_surface *surface;
+	char label[64];
+
+	weston_log("surface update statistics:\n");
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		surface = view->surface;
+
+		if (!surface->get_label ||
+		    surface->get_label(surface, label, sizeof label) < 0)
+			snprintf(label, sizeof label, "surface %p", surface);
+
+		weston_log_continue(STAMP_SPACE "%s: %dx%d, %" PRIu64
+				    " commits, %.1f/s, %.0f%% damaged, %s plane\n",
+				    label, surface->width, surface->height,
+				    surface->stats.commits,
+				    weston_surface_get_commit_rate(surface),
+				    surface->stats.damage_fraction * 100.0f,
+				    view->plane == &compositor->primary_plane ?
+				    "primary" : "own");
+	}
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -6381,6 +6758,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	ec->repaint_timer =
 		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
 					ec);
+	wl_list_init(&ec->suspended_surface_list);
+	ec->suspended_frame_timer =
+		wl_event_loop_add_timer(loop, suspended_frame_handler, ec);
 
 	weston_layer_init(&ec->fade_layer, ec);
 	weston_layer_init(&ec->cursor_layer, ec);
@@ -6391,6 +6771,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_U,
+					    surface_stats_key_binding_handler,
+					    ec);
 
 	return ec;
 
@@ -6403,8 +6786,18 @@ WL_EXPORT void
 weston_compositor_shutdown(struct weston_compositor *ec)
 {
 	struct weston_output *output, *next;
+	struct weston_surface *surface, *snext;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->suspended_frame_timer);
+
+	/* Client surfaces may outlive the compositor */
+	wl_list_for_each_safe(surface, snext, &ec->suspended_surface_list,
+			      suspended_link) {
+		wl_list_remove(&surface->suspended_link);
+		wl_list_init(&surface->suspended_link);
+		surface->suspended = false;
+	}
 
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
@@ -100,6 +100,10 @@ struct weston_mode {
 	struct wl_list link;
 };
 
+/* Animations on an output's animation_list are sampled once per repaint
+ * cycle of that output, before it is repainted. The time passed to frame()
+ * is the predicted presentation time of that repaint. Animations keep the
+ * repaint loop running; they only need to damage what actually changed. */
 struct weston_animation {
 	void (*frame)(struct weston_animation *animation,
 		      struct weston_output *output,
@@ -969,6 +973,7 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	uint32_t view_id_counter;	/* last struct weston_view::id */
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -983,6 +988,11 @@ struct weston_compositor {
 	int idle_time;			/* timeout, s */
 	struct wl_event_source *repaint_timer;
 
+	/* Surfaces the shell has hidden, see weston_surface_set_suspended() */
+	struct wl_list suspended_surface_list;
+	struct wl_event_source *suspended_frame_timer;
+	bool suspended_frame_pending;
+
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
 	/* Repaint state. */
@@ -1121,6 +1131,10 @@ struct weston_view {
 	struct weston_layer_entry layer_link; /* part of geometry */
 	struct weston_plane *plane;
 
+	/* Unlike its address, not reused by a later view (until the
+	 * counter wraps) */
+	uint32_t id;
+
 	/* For weston_layer inheritance from another view */
 	struct weston_view *parent_view;
 
@@ -1260,6 +1274,19 @@ struct weston_pointer_constraint {
 	struct wl_listener surface_activate_listener;
 };
 
+/** Update statistics of a surface
+ *
+ * Maintained by weston_surface_commit_state() for commits that attach a
+ * buffer, so that backends can tell frequently updating surfaces (video,
+ * games) from static ones. Averages are exponential moving averages.
+ */
+struct weston_surface_stats {
+	uint64_t commits;		/**< buffer commits so far */
+	struct timespec last_commit;	/**< presentation clock */
+	float commit_rate;		/**< buffer commits per second */
+	float damage_fraction;		/**< damaged part per commit, 0 to 1 */
+};
+
 struct weston_surface {
 	struct wl_resource *resource;
 	struct wl_signal destroy_signal; /* callback argument: this surface */
@@ -1306,6 +1333,12 @@ struct weston_surface {
 	int32_t height_from_buffer;
 	bool keep_buffer; /* for backends to prevent early release */
 
+	struct weston_surface_stats stats;
+
+	/* Hidden by the shell: no repaints, throttled frame callbacks */
+	bool suspended;
+	struct wl_list suspended_link; /* weston_compositor::suspended_surface_list */
+
 	/* wp_viewport resource for this surface */
 	struct wl_resource *viewport_resource;
 
@@ -1741,6 +1774,15 @@ void
 weston_surface_get_content_size(struct weston_surface *surface,
 				int *width, int *height);
 
+float
+weston_surface_get_commit_rate(struct weston_surface *surface);
+
+void
+weston_surface_set_suspended(struct weston_surface *surface, bool suspended);
+
+bool
+weston_surface_is_suspended(struct weston_surface *surface);
+
 struct weston_geometry
 weston_surface_get_bounding_box(struct weston_surface *surface);
 
@@ -1887,6 +1929,41 @@ tty_reset(struct tty *tty);
 int
 tty_activate_vt(struct tty *tty, int vt);
 
+/** A frame read back by the output capture service
+ *
+ * The image is the size of the output framebuffer, in PIXMAN_a8r8g8b8
+ * with the top row first, but only the pixels in \c valid were read
+ * back for this frame.  damage is the damage of the frame; both are in
+ * framebuffer coordinates.
+ */
+struct weston_capture_frame {
+	struct weston_output *output;
+	pixman_image_t *image;
+	pixman_region32_t damage;
+	pixman_region32_t valid;
+	uint32_t msecs;
+};
+
+struct weston_capture_subscriber;
+
+typedef void (*weston_capture_prepare_func_t)(void *data,
+				struct weston_output *output,
+				const pixman_region32_t *damage,
+				pixman_region32_t *region);
+typedef void (*weston_capture_func_t)(void *data,
+				struct weston_capture_frame *frame);
+
+struct weston_capture_subscriber *
+weston_capture_subscribe(struct weston_output *output,
+			 weston_capture_prepare_func_t prepare,
+			 weston_capture_func_t captured, void *data);
+void
+weston_capture_unsubscribe(struct weston_capture_subscriber *sub);
+struct weston_capture_frame *
+weston_capture_frame_ref(struct weston_capture_frame *frame);
+void
+weston_capture_frame_unref(struct weston_capture_frame *frame);
+
 enum weston_screenshooter_outcome {
 	WESTON_SCREENSHOOTER_SUCCESS,
 	WESTON_SCREENSHOOTER_NO_MEMORY,
@@ -1898,8 +1975,55 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
+
+struct weston_screenshooter_stream;
+
+struct weston_screenshooter_stream *
+weston_screenshooter_stream_create(struct weston_output *output);
+int
+weston_screenshooter_stream_shoot(struct weston_screenshooter_stream *stream,
+				  struct weston_buffer *buffer,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
+void
+weston_screenshooter_stream_destroy(struct weston_screenshooter_stream *stream);
+
+struct weston_recorder_rect {
+	pixman_box32_t box;
+	/* The top row of the rectangle.  Rows are stride pixels apart;
+	 * stride is negative for rows stored bottom-up. */
+	const uint32_t *data;
+	int stride;
+};
+
+struct weston_recorder_frame {
+	uint32_t msecs;
+	int nrects;
+	const struct weston_recorder_rect *rects;
+};
+
+struct weston_recorder_backend {
+	const char *name;
+	void *(*create)(struct weston_output *output, const char *filename,
+			pixman_format_code_t format);
+	int (*write_frame)(void *encoder,
+			   const struct weston_recorder_frame *frame);
+	void (*destroy)(void *encoder);
+};
+
 struct weston_recorder *
 weston_recorder_start(struct weston_output *output, const char *filename);
+struct weston_recorder *
+weston_recorder_start_with_backend(struct weston_output *output,
+				   const char *filename,
+				   const struct weston_recorder_backend *backend);
 void
 weston_recorder_stop(struct weston_recorder *recorder);
 
@@ -44,12 +44,20 @@ struct pixman_output_state {
 	pixman_region32_t *hw_extra_damage;
 };
 
+/* Views drawn at half their buffer size or less sample a copy of the buffer
+ * downscaled by a power of two, at most by 1 << PIXMAN_SCALED_MAX_LEVEL. */
+#define PIXMAN_SCALED_MAX_LEVEL 4
+
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
 	struct weston_buffer_reference buffer_ref;
 
+	/* image downscaled by 1 << scaled_level, until the next damage */
+	pixman_image_t *scaled_image;
+	int scaled_level;
+
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
@@ -317,6 +325,132 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+static void
+surface_state_drop_scaled(struct pixman_surface_state *ps)
+{
+	if (ps->scaled_image) {
+		pixman_image_unref(ps->scaled_image);
+		ps->scaled_image = NULL;
+	}
+	ps->scaled_level = 0;
+}
+
+/* Sampling bilinearly at exactly half size averages each 2x2 block. */
+static pixman_image_t *
+downscale_image_by_two(pixman_image_t *src)
+{
+	pixman_format_code_t format = pixman_image_get_format(src);
+	int width = (pixman_image_get_width(src) + 1) / 2;
+	int height = (pixman_image_get_height(src) + 1) / 2;
+	pixman_transform_t transform;
+	pixman_image_t *dst;
+
+	dst = pixman_image_create_bits(format, width, height, NULL, 0);
+	if (!dst)
+		return NULL;
+
+	pixman_transform_init_scale(&transform, pixman_int_to_fixed(2),
+				    pixman_int_to_fixed(2));
+	pixman_image_set_transform(src, &transform);
+	pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+	/* Odd sizes must not blend in the transparent outside */
+	pixman_image_set_repeat(src, PIXMAN_REPEAT_PAD);
+
+	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+				 0, 0, 0, 0, 0, 0, width, height);
+
+	pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
+	pixman_image_set_transform(src, NULL);
+
+	return dst;
+}
+
+/** Pick the image to sample a surface from
+ *
+ * \param ps The surface state, with its buffer open for access.
+ * \param transform Output to buffer transform, adjusted to the image
+ *                  returned.
+ * \param level_out Set to how many times the image returned was halved.
+ *
+ * A view shown much smaller than its buffer, like an exposay thumbnail,
+ * would otherwise have all of its full size buffer filtered on every
+ * repaint. The downscaled copy is kept until the surface is damaged.
+ */
+static pixman_image_t *
+surface_state_get_image(struct pixman_surface_state *ps,
+			pixman_transform_t *transform, int *level_out)
+{
+	pixman_fixed_t sx = transform->matrix[0][0];
+	pixman_fixed_t sy = transform->matrix[1][1];
+	pixman_image_t *image, *next;
+	pixman_fixed_t factor;
+	int level = 0;
+	int i;
+
+	*level_out = 0;
+
+	/* Solid colour surfaces are cheap to sample at any size */
+	if (!ps->buffer_ref.buffer)
+		return ps->image;
+
+	/* Only plain downscaling, no rotation or projection */
+	if (transform->matrix[0][1] != 0 || transform->matrix[1][0] != 0 ||
+	    transform->matrix[2][0] != 0 || transform->matrix[2][1] != 0 ||
+	    transform->matrix[2][2] != pixman_fixed_1)
+		return ps->image;
+
+	while (level < PIXMAN_SCALED_MAX_LEVEL &&
+	       sx >= pixman_int_to_fixed(2 << level) &&
+	       sy >= pixman_int_to_fixed(2 << level))
+		level++;
+
+	if (level == 0)
+		return ps->image;
+
+	if (!ps->scaled_image || ps->scaled_level != level) {
+		image = ps->image;
+		for (i = 0; i < level; i++) {
+			next = downscale_image_by_two(image);
+			if (image != ps->image)
+				pixman_image_unref(image);
+			if (!next)
+				return ps->image;
+			image = next;
+		}
+
+		surface_state_drop_scaled(ps);
+		ps->scaled_image = image;
+		ps->scaled_level = level;
+	}
+
+	factor = pixman_fixed_1 >> level;
+	pixman_transform_scale(transform, NULL, factor, factor);
+	*level_out = level;
+
+	return ps->scaled_image;
+}
+
+/* Scale a region down by 1 << level, rounding outwards */
+static void
+region_scale_down(pixman_region32_t *dest, pixman_region32_t *src, int level)
+{
+	pixman_box32_t *boxes;
+	int round = (1 << level) - 1;
+	int n_box, i;
+
+	pixman_region32_clear(dest);
+	boxes = pixman_region32_rectangles(src, &n_box);
+	for (i = 0; i < n_box; i++) {
+		int x1 = boxes[i].x1 >> level;
+		int y1 = boxes[i].y1 >> level;
+		int x2 = (boxes[i].x2 + round) >> level;
+		int y2 = (boxes[i].y2 + round) >> level;
+
+		pixman_region32_union_rect(dest, dest, x1, y1,
+					   x2 - x1, y2 - y1);
+	}
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
@@ -338,10 +472,13 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_image_t *target_image;
+	pixman_image_t *source_image;
+	pixman_region32_t scaled_clip;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
+	int level;
 
 	if (po->shadow_image)
 		target_image = po->shadow_image;
@@ -361,6 +498,14 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
 
+	source_image = surface_state_get_image(ps, &transform, &level);
+
+	pixman_region32_init(&scaled_clip);
+	if (source_clip && level > 0) {
+		region_scale_down(&scaled_clip, source_clip, level);
+		source_clip = &scaled_clip;
+	}
+
 	if (ev->alpha < 1.0) {
 		mask.alpha = 0xffff * ev->alpha;
 		mask_image = pixman_image_create_solid_fill(&mask);
@@ -369,15 +514,17 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, target_image,
+		composite_clipped(source_image, mask_image, target_image,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
+		composite_whole(pixman_op, source_image, mask_image,
 				target_image, &transform, filter);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
 
+	pixman_region32_fini(&scaled_clip);
+
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
@@ -598,7 +745,12 @@ pixman_renderer_repaint_output(struct weston_output *output,
 static void
 pixman_renderer_flush_damage(struct weston_surface *surface)
 {
-	/* No-op for pixman renderer */
+	struct pixman_surface_state *ps = get_surface_state(surface);
+
+	/* Pixels are read straight from the buffer; only the downscaled
+	 * copy needs refreshing. */
+	if (pixman_region32_not_empty(&surface->damage))
+		surface_state_drop_scaled(ps);
 }
 
 static void
@@ -613,6 +765,7 @@ buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled(ps);
 
 	ps->buffer_destroy_listener.notify = NULL;
 }
@@ -635,6 +788,7 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled(ps);
 
 	if (!buffer)
 		return;
@@ -695,6 +849,7 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled(ps);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	free(ps);
 }
@@ -764,6 +919,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled(ps);
 
 	ps->image = pixman_image_create_solid_fill(&color);
 }
@@ -25,6 +25,8 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -40,154 +42,749 @@
 
 #include "wcap/wcap-decode.h"
 
-struct screenshooter_frame_listener {
-	struct wl_listener listener;
+struct screenshooter_shot {
+	struct weston_output *output;
+	struct weston_capture_subscriber *sub;
+	struct weston_buffer *buffer;
+	pixman_box32_t box;
+	weston_screenshooter_done_func_t done;
+	void *data;
+};
+
+struct weston_screenshooter_stream {
+	struct weston_output *output;
+	struct wl_listener output_destroy_listener;
+	/* Not yet captured, in framebuffer coordinates */
+	pixman_region32_t damage;
+	struct weston_capture_subscriber *sub;
 	struct weston_buffer *buffer;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
+/* Four pixels at a time; GCC lowers this to SSE2 or NEON where
+ * available and to plain integer code elsewhere. */
+typedef uint32_t pixel_vec_t __attribute__ ((vector_size (16)));
+
+/* Swaps the R and B channels of 32 bit pixels.  dst and src may be
+ * the same row. */
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_row_swap_RB(void *vdst, const void *vsrc, int bytes)
 {
-	uint8_t *end;
+	uint8_t *dst = vdst;
+	const uint8_t *src = vsrc;
+	const uint8_t *end = src + bytes;
+	pixel_vec_t v;
+	uint32_t p;
+
+	while (src + sizeof v <= end) {
+		memcpy(&v, src, sizeof v);
+		/*                    A R G B */
+		v = (v & 0xff00ff00) |
+		    ((v >> 16) & 0x000000ff) |
+		    ((v << 16) & 0x00ff0000);
+		memcpy(dst, &v, sizeof v);
+		src += sizeof v;
+		dst += sizeof v;
+	}
 
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	while (src < end) {
+		memcpy(&p, src, sizeof p);
+		p = (p & 0xff00ff00) |
+		    ((p >> 16) & 0x000000ff) |
+		    ((p << 16) & 0x00ff0000);
+		memcpy(dst, &p, sizeof p);
+		src += sizeof p;
+		dst += sizeof p;
 	}
 }
 
 static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_row(void *dst, const void *src, int bytes, bool swap_rb)
 {
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
+	if (swap_rb)
+		copy_row_swap_RB(dst, src, bytes);
+	else
+		memmove(dst, src, bytes);
 }
 
+/* Copies a packed block as returned by read_pixels() into dst,
+ * undoing the y-flip and converting to ARGB8888 on the way. */
 static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
+copy_block(uint8_t *dst, int dst_stride, const uint8_t *src,
+	   int width, int height, bool yflip, bool swap_rb)
 {
-	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
-	uint32_t *end = dst + bytes / 4;
+	int src_stride = width * 4;
+	int j;
 
-	while (dst < end) {
-		uint32_t v = *src++;
-		/*                    A R G B */
-		uint32_t tmp = v & 0xff00ff00;
-		tmp |= (v >> 16) & 0x000000ff;
-		tmp |= (v << 16) & 0x00ff0000;
-		*dst++ = tmp;
+	if (yflip) {
+		src += (height - 1) * src_stride;
+		src_stride = -src_stride;
+	}
+
+	for (j = 0; j < height; j++) {
+		copy_row(dst, src, width * 4, swap_rb);
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+
+/* Turns a block that read_pixels() wrote straight into its final
+ * place right side up and into ARGB8888, using one row of scratch. */
+static void
+fixup_block_in_place(uint8_t *data, int stride, int height,
+		     bool yflip, bool swap_rb, uint8_t *tmp)
+{
+	uint8_t *top = data;
+	uint8_t *bottom = data + (height - 1) * stride;
+
+	if (!yflip) {
+		for (; top <= bottom && swap_rb; top += stride)
+			copy_row_swap_RB(top, top, stride);
+		return;
+	}
+
+	while (top < bottom) {
+		memcpy(tmp, top, stride);
+		copy_row(top, bottom, stride, swap_rb);
+		copy_row(bottom, tmp, stride, swap_rb);
+		top += stride;
+		bottom -= stride;
+	}
+
+	if (top == bottom && swap_rb)
+		copy_row_swap_RB(top, top, stride);
+}
+
+static bool
+read_format_needs_swap(pixman_format_code_t format)
+{
+	return format == PIXMAN_x8b8g8r8 || format == PIXMAN_a8b8g8r8;
+}
+
+static bool
+read_format_supported(pixman_format_code_t format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+	case PIXMAN_x8b8g8r8:
+	case PIXMAN_a8b8g8r8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Reads back a framebuffer rectangle to d, the position of its top left
+ * corner in an ARGB8888 image with the given stride.  When the image
+ * rows are exactly the rectangle rows, read_pixels() writes straight
+ * into the image and no staging copy of the pixels is made. */
+static int
+read_box(struct weston_output *output, uint8_t *d, int stride,
+	 const pixman_box32_t *box)
+{
+	struct weston_compositor *compositor = output->compositor;
+	bool yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	bool swap_rb = read_format_needs_swap(compositor->read_format);
+	int width = box->x2 - box->x1;
+	int height = box->y2 - box->y1;
+	uint8_t *tmp;
+	int y_orig;
+
+	if (width <= 0 || height <= 0)
+		return 0;
+
+	if (yflip)
+		y_orig = output->current_mode->height - box->y2;
+	else
+		y_orig = box->y1;
+
+	if (stride == width * 4) {
+		tmp = malloc(stride);
+		if (tmp == NULL)
+			return -1;
+
+		compositor->renderer->read_pixels(output,
+				compositor->read_format, d,
+				box->x1, y_orig, width, height);
+		fixup_block_in_place(d, stride, height, yflip, swap_rb, tmp);
+	} else {
+		tmp = malloc(width * 4 * height);
+		if (tmp == NULL)
+			return -1;
+
+		compositor->renderer->read_pixels(output,
+				compositor->read_format, tmp,
+				box->x1, y_orig, width, height);
+		copy_block(d, stride, tmp, width, height, yflip, swap_rb);
+	}
+
+	free(tmp);
+
+	return 0;
+}
+
+/* The damage of the frame that was just repainted, in the coordinate
+ * space of the framebuffer that read_pixels() reads from. */
+static void
+output_get_framebuffer_damage(struct weston_output *output,
+			      pixman_region32_t *transformed_damage)
+{
+	pixman_region32_t damage;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->region,
+				  &output->previous_damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				 output->transform, output->current_scale,
+				 &damage, transformed_damage);
+	pixman_region32_fini(&damage);
+}
+
+/* Output capture service.
+ *
+ * All consumers of an output's pixels subscribe here instead of
+ * listening to frame_signal themselves.  After each repaint every
+ * subscriber is asked which part of the framebuffer it needs, the
+ * union of those regions is read back once into an image from a small
+ * pool, and the resulting frame is handed to the subscribers that asked
+ * for something.  Frames are refcounted so a subscriber can keep using
+ * one, e.g. on a worker thread, while later frames are read into other
+ * images of the pool.
+ */
+struct output_capture {
+	struct weston_output *output;
+	struct wl_list subscribers;
+	struct wl_list free_frames;
+	struct wl_list busy_frames;
+	struct wl_listener frame_listener;
+	struct wl_listener destroy_listener;
+	int emitting;
+};
+
+struct capture_frame {
+	struct weston_capture_frame base;
+	struct output_capture *capture;
+	struct wl_list link;
+	int refcount;
+};
+
+struct weston_capture_subscriber {
+	struct output_capture *capture;
+	struct wl_list link;
+	/* What the subscriber asked for in the frame being captured */
+	pixman_region32_t region;
+	weston_capture_prepare_func_t prepare;
+	weston_capture_func_t captured;
+	/* Optional: when this is the only subscriber asking for pixels,
+	 * read them straight into its own storage instead of a pool frame,
+	 * and finish the capture without calling captured. */
+	void (*read_direct)(void *data, struct weston_output *output);
+	void *data;
+	int dead;
+};
+
+static void
+capture_frame_destroy(struct capture_frame *frame)
+{
+	wl_list_remove(&frame->link);
+	pixman_image_unref(frame->base.image);
+	pixman_region32_fini(&frame->base.damage);
+	pixman_region32_fini(&frame->base.valid);
+	free(frame);
+}
+
+static struct capture_frame *
+output_capture_get_frame(struct output_capture *capture)
+{
+	struct weston_output *output = capture->output;
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+	struct capture_frame *frame, *tmp;
+
+	wl_list_for_each_safe(frame, tmp, &capture->free_frames, link) {
+		if (pixman_image_get_width(frame->base.image) == width &&
+		    pixman_image_get_height(frame->base.image) == height)
+			goto found;
+
+		capture_frame_destroy(frame);
 	}
+
+	frame = zalloc(sizeof *frame);
+	if (frame == NULL)
+		return NULL;
+
+	frame->base.image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						     width, height, NULL,
+						     width * 4);
+	if (frame->base.image == NULL) {
+		free(frame);
+		return NULL;
+	}
+
+	frame->base.output = output;
+	frame->capture = capture;
+	pixman_region32_init(&frame->base.damage);
+	pixman_region32_init(&frame->base.valid);
+	wl_list_init(&frame->link);
+
+found:
+	wl_list_remove(&frame->link);
+	wl_list_insert(&capture->busy_frames, &frame->link);
+	frame->refcount = 1;
+
+	return frame;
+}
+
+static int
+output_capture_read(struct output_capture *capture,
+		    struct capture_frame *frame, pixman_region32_t *region)
+{
+	uint8_t *data = (uint8_t *) pixman_image_get_data(frame->base.image);
+	int stride = pixman_image_get_stride(frame->base.image);
+	pixman_box32_t *r;
+	int i, n;
+
+	r = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		if (read_box(capture->output,
+			     data + r[i].y1 * stride + r[i].x1 * 4,
+			     stride, &r[i]) < 0)
+			return -1;
+
+	pixman_region32_copy(&frame->base.valid, region);
+
+	return 0;
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+output_capture_destroy(struct output_capture *capture)
 {
-	uint8_t *end;
+	struct weston_capture_subscriber *sub, *next_sub;
+	struct capture_frame *frame, *next;
+
+	/* Subscribers left behind are freed when they unsubscribe */
+	wl_list_for_each_safe(sub, next_sub, &capture->subscribers, link) {
+		sub->capture = NULL;
+		wl_list_remove(&sub->link);
+		wl_list_init(&sub->link);
+	}
+
+	wl_list_for_each_safe(frame, next, &capture->free_frames, link)
+		capture_frame_destroy(frame);
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	/* Frames still in use are freed on their last unref */
+	wl_list_for_each_safe(frame, next, &capture->busy_frames, link) {
+		frame->capture = NULL;
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
 	}
+
+	wl_list_remove(&capture->frame_listener.link);
+	wl_list_remove(&capture->destroy_listener.link);
+	free(capture);
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+output_capture_reap(struct output_capture *capture)
 {
-	uint8_t *end;
+	struct weston_capture_subscriber *sub, *next;
+
+	wl_list_for_each_safe(sub, next, &capture->subscribers, link) {
+		if (!sub->dead)
+			continue;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+		wl_list_remove(&sub->link);
+		pixman_region32_fini(&sub->region);
+		free(sub);
 	}
+
+	if (wl_list_empty(&capture->subscribers))
+		output_capture_destroy(capture);
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+output_capture_frame_notify(struct wl_listener *listener, void *data)
 {
-	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
+	struct output_capture *capture =
+		container_of(listener, struct output_capture, frame_listener);
 	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	struct weston_capture_subscriber *sub, *only = NULL;
+	struct capture_frame *frame = NULL;
+	pixman_region32_t damage, region;
+	int n = 0;
 
-	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	pixman_region32_init(&damage);
+	pixman_region32_init(&region);
+	output_get_framebuffer_damage(output, &damage);
+
+	/* Subscribers may unsubscribe from their callbacks; they are only
+	 * marked dead until the end of the frame. */
+	capture->emitting = 1;
+
+	wl_list_for_each(sub, &capture->subscribers, link) {
+		pixman_region32_clear(&sub->region);
+		if (sub->dead)
+			continue;
+
+		sub->prepare(sub->data, output, &damage, &sub->region);
+		pixman_region32_intersect_rect(&sub->region, &sub->region, 0, 0,
+					       output->current_mode->width,
+					       output->current_mode->height);
+		pixman_region32_union(&region, &region, &sub->region);
+
+		if (pixman_region32_not_empty(&sub->region)) {
+			only = sub;
+			n++;
+		}
+	}
 
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+	if (n == 1 && only->read_direct) {
+		only->read_direct(only->data, output);
+	} else if (pixman_region32_not_empty(&region)) {
+		frame = output_capture_get_frame(capture);
+		if (frame && output_capture_read(capture, frame, &region) < 0) {
+			weston_capture_frame_unref(&frame->base);
+			frame = NULL;
+		}
+
+		if (frame) {
+			pixman_region32_copy(&frame->base.damage, &damage);
+			frame->base.msecs = timespec_to_msec(&output->frame_time);
+		} else {
+			weston_log("failed to capture output %s\n",
+				   output->name);
+		}
+
+		wl_list_for_each(sub, &capture->subscribers, link)
+			if (!sub->dead &&
+			    pixman_region32_not_empty(&sub->region))
+				sub->captured(sub->data,
+					      frame ? &frame->base : NULL);
+
+		if (frame)
+			weston_capture_frame_unref(&frame->base);
+	}
+
+	capture->emitting = 0;
+
+	pixman_region32_fini(&region);
+	pixman_region32_fini(&damage);
+
+	output_capture_reap(capture);
+}
+
+static void
+output_capture_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct output_capture *capture =
+		container_of(listener, struct output_capture,
+			     destroy_listener);
+	struct weston_capture_subscriber *sub, *next;
+
+	/* Let subscribers waiting for a frame know none is coming. */
+	capture->emitting = 1;
+	wl_list_for_each(sub, &capture->subscribers, link)
+		if (!sub->dead)
+			sub->captured(sub->data, NULL);
+	capture->emitting = 0;
+
+	wl_list_for_each_safe(sub, next, &capture->subscribers, link) {
+		if (!sub->dead)
+			continue;
+
+		wl_list_remove(&sub->link);
+		pixman_region32_fini(&sub->region);
+		free(sub);
+	}
+
+	output_capture_destroy(capture);
+}
+
+static struct output_capture *
+output_capture_get(struct weston_output *output, bool create)
+{
+	struct output_capture *capture;
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&output->frame_signal,
+				 output_capture_frame_notify);
+	if (listener)
+		return container_of(listener, struct output_capture,
+				    frame_listener);
+
+	if (!create)
+		return NULL;
+
+	capture = zalloc(sizeof *capture);
+	if (capture == NULL)
+		return NULL;
+
+	capture->output = output;
+	wl_list_init(&capture->subscribers);
+	wl_list_init(&capture->free_frames);
+	wl_list_init(&capture->busy_frames);
+	capture->frame_listener.notify = output_capture_frame_notify;
+	wl_signal_add(&output->frame_signal, &capture->frame_listener);
+	capture->destroy_listener.notify = output_capture_output_destroyed;
+	wl_signal_add(&output->destroy_signal, &capture->destroy_listener);
+
+	return capture;
+}
+
+/** Subscribe to the pixels of an output
+ *
+ * \param output The output to capture.
+ * \param prepare Called after every repaint of the output with the
+ * damage of the frame, in framebuffer coordinates.  It adds the part
+ * of the framebuffer it wants read back for this frame to its region
+ * argument, which starts out empty.
+ * \param captured Called after the read back with the frame, if prepare
+ * asked for something.  The frame is NULL if reading back failed.  It is
+ * also called with NULL when the output is destroyed; the subscriber
+ * gets no more frames after that but must still be unsubscribed.
+ * \param data User data for the callbacks.
+ *
+ * The subscriber may unsubscribe from either callback.
+ *
+ * \return The subscriber, or NULL on failure.
+ */
+WL_EXPORT struct weston_capture_subscriber *
+weston_capture_subscribe(struct weston_output *output,
+			 weston_capture_prepare_func_t prepare,
+			 weston_capture_func_t captured, void *data)
+{
+	struct weston_capture_subscriber *sub;
+	struct output_capture *capture;
+
+	capture = output_capture_get(output, true);
+	if (capture == NULL)
+		return NULL;
+
+	sub = zalloc(sizeof *sub);
+	if (sub == NULL) {
+		if (wl_list_empty(&capture->subscribers))
+			output_capture_destroy(capture);
+		return NULL;
+	}
+
+	sub->capture = capture;
+	pixman_region32_init(&sub->region);
+	sub->prepare = prepare;
+	sub->captured = captured;
+	sub->data = data;
+	wl_list_insert(capture->subscribers.prev, &sub->link);
+
+	return sub;
+}
+
+WL_EXPORT void
+weston_capture_unsubscribe(struct weston_capture_subscriber *sub)
+{
+	struct output_capture *capture = sub->capture;
+
+	if (capture && capture->emitting) {
+		sub->dead = 1;
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
+	wl_list_remove(&sub->link);
+	pixman_region32_fini(&sub->region);
+	free(sub);
 
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	if (capture && wl_list_empty(&capture->subscribers))
+		output_capture_destroy(capture);
+}
 
-	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+static bool
+output_capture_has_subscriber(struct weston_output *output,
+			      weston_capture_prepare_func_t prepare)
+{
+	struct output_capture *capture = output_capture_get(output, false);
+	struct weston_capture_subscriber *sub;
 
-	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+	if (capture == NULL)
+		return false;
 
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
-		break;
-	default:
-		break;
+	wl_list_for_each(sub, &capture->subscribers, link)
+		if (!sub->dead && sub->prepare == prepare)
+			return true;
+
+	return false;
+}
+
+WL_EXPORT struct weston_capture_frame *
+weston_capture_frame_ref(struct weston_capture_frame *base)
+{
+	struct capture_frame *frame =
+		container_of(base, struct capture_frame, base);
+
+	frame->refcount++;
+
+	return base;
+}
+
+/** Release a frame
+ *
+ * The image goes back to the pool of its output, or is freed if the
+ * output stopped being captured in the meantime.  Must be called from
+ * the compositor thread.
+ */
+WL_EXPORT void
+weston_capture_frame_unref(struct weston_capture_frame *base)
+{
+	struct capture_frame *frame =
+		container_of(base, struct capture_frame, base);
+
+	if (--frame->refcount > 0)
+		return;
+
+	if (frame->capture == NULL) {
+		capture_frame_destroy(frame);
+		return;
 	}
 
-	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+	wl_list_remove(&frame->link);
+	wl_list_insert(&frame->capture->free_frames, &frame->link);
+}
+
+/* Copies a rectangle of a captured frame to (dx, dy) in a shm buffer */
+static void
+copy_frame_box_to_shm(struct weston_capture_frame *frame,
+		      struct wl_shm_buffer *shm, const pixman_box32_t *box,
+		      int dx, int dy)
+{
+	pixman_blt(pixman_image_get_data(frame->image),
+		   wl_shm_buffer_get_data(shm),
+		   pixman_image_get_stride(frame->image) / 4,
+		   wl_shm_buffer_get_stride(shm) / 4,
+		   32, 32, box->x1, box->y1, dx, dy,
+		   box->x2 - box->x1, box->y2 - box->y1);
+}
+
+static void
+screenshooter_prepare(void *data, struct weston_output *output,
+		      const pixman_region32_t *damage,
+		      pixman_region32_t *region)
+{
+	struct screenshooter_shot *l = data;
+
+	pixman_region32_union_rect(region, region,
+				   l->box.x1, l->box.y1,
+				   l->box.x2 - l->box.x1,
+				   l->box.y2 - l->box.y1);
+}
 
-	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
+static void
+screenshooter_shot_finish(struct screenshooter_shot *l,
+			  enum weston_screenshooter_outcome outcome)
+{
+	l->output->disable_planes--;
+	weston_capture_unsubscribe(l->sub);
+	l->done(l->data, outcome);
 	free(l);
 }
 
-WL_EXPORT int
-weston_screenshooter_shoot(struct weston_output *output,
-			   struct weston_buffer *buffer,
-			   weston_screenshooter_done_func_t done, void *data)
+/* Only used when another subscriber needs the same frame */
+static void
+screenshooter_captured(void *data, struct weston_capture_frame *frame)
 {
-	struct screenshooter_frame_listener *l;
+	struct screenshooter_shot *l = data;
+	struct wl_shm_buffer *shm = l->buffer->shm_buffer;
 
-	if (!wl_shm_buffer_get(buffer->resource)) {
-		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
-		return -1;
+	if (frame == NULL) {
+		screenshooter_shot_finish(l, WESTON_SCREENSHOOTER_NO_MEMORY);
+		return;
 	}
 
+	wl_shm_buffer_begin_access(shm);
+	copy_frame_box_to_shm(frame, shm, &l->box, 0, 0);
+	wl_shm_buffer_end_access(shm);
+
+	screenshooter_shot_finish(l, WESTON_SCREENSHOOTER_SUCCESS);
+}
+
+/* Read back straight into the client buffer, without a staging copy */
+static void
+screenshooter_read_direct(void *data, struct weston_output *output)
+{
+	struct screenshooter_shot *l = data;
+	struct wl_shm_buffer *shm = l->buffer->shm_buffer;
+	enum weston_screenshooter_outcome outcome =
+		WESTON_SCREENSHOOTER_SUCCESS;
+	uint8_t *d;
+	int stride;
+
+	wl_shm_buffer_begin_access(shm);
+	d = wl_shm_buffer_get_data(shm);
+	stride = wl_shm_buffer_get_stride(shm);
+	if (read_box(output, d, stride, &l->box) < 0)
+		outcome = WESTON_SCREENSHOOTER_NO_MEMORY;
+	wl_shm_buffer_end_access(shm);
+
+	screenshooter_shot_finish(l, outcome);
+}
+
+static bool
+screenshooter_get_shm_buffer(struct weston_output *output,
+			     struct weston_buffer *buffer,
+			     int32_t width, int32_t height)
+{
+	if (!wl_shm_buffer_get(buffer->resource))
+		return false;
+
 	buffer->shm_buffer = wl_shm_buffer_get(buffer->resource);
 	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
 
-	if (buffer->width < output->current_mode->width ||
-	    buffer->height < output->current_mode->height) {
+	if (buffer->width < width || buffer->height < height)
+		return false;
+
+	switch (wl_shm_buffer_get_format(buffer->shm_buffer)) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+		break;
+	default:
+		return false;
+	}
+
+	return read_format_supported(output->compositor->read_format);
+}
+
+/** Capture a rectangle of an output into a shm buffer
+ *
+ * \param output The output to capture.
+ * \param buffer A wl_shm buffer in ARGB8888 or XRGB8888 format, at least
+ * \c width by \c height pixels big.
+ * \param x The left edge of the rectangle, in output framebuffer pixels.
+ * \param y The top edge of the rectangle, in output framebuffer pixels.
+ * \param width The width of the rectangle.
+ * \param height The height of the rectangle.
+ * \param done Called once the capture has completed or failed.
+ * \param data User data for \c done.
+ *
+ * The rectangle is written to the top left corner of the buffer on the
+ * next repaint of the output.  Only the rectangle is read back.
+ *
+ * \return 0 if the capture has been scheduled, -1 otherwise, in which
+ * case \c done has already been called.
+ */
+WL_EXPORT int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
+{
+	struct screenshooter_shot *l;
+
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    x > output->current_mode->width - width ||
+	    y > output->current_mode->height - height ||
+	    !screenshooter_get_shm_buffer(output, buffer, width, height)) {
 		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
 		return -1;
 	}
@@ -198,27 +795,246 @@ weston_screenshooter_shoot(struct weston_output *output,
 		return -1;
 	}
 
+	l->output = output;
 	l->buffer = buffer;
+	l->box.x1 = x;
+	l->box.y1 = y;
+	l->box.x2 = x + width;
+	l->box.y2 = y + height;
 	l->done = done;
 	l->data = data;
-	l->listener.notify = screenshooter_frame_notify;
-	wl_signal_add(&output->frame_signal, &l->listener);
+	l->sub = weston_capture_subscribe(output, screenshooter_prepare,
+					  screenshooter_captured, l);
+	if (l->sub == NULL) {
+		free(l);
+		done(data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		return -1;
+	}
+	l->sub->read_direct = screenshooter_read_direct;
+
+	output->disable_planes++;
+	weston_output_schedule_repaint(output);
+
+	return 0;
+}
+
+WL_EXPORT int
+weston_screenshooter_shoot(struct weston_output *output,
+			   struct weston_buffer *buffer,
+			   weston_screenshooter_done_func_t done, void *data)
+{
+	return weston_screenshooter_shoot_region(output, buffer, 0, 0,
+						 output->current_mode->width,
+						 output->current_mode->height,
+						 done, data);
+}
+
+static void
+screenshooter_stream_finish(struct weston_screenshooter_stream *stream,
+			    enum weston_screenshooter_outcome outcome)
+{
+	stream->output->disable_planes--;
+	stream->buffer = NULL;
+	stream->done(stream->data, outcome);
+}
+
+static void
+screenshooter_stream_prepare(void *data, struct weston_output *output,
+			     const pixman_region32_t *damage,
+			     pixman_region32_t *region)
+{
+	struct weston_screenshooter_stream *stream = data;
+
+	pixman_region32_union(&stream->damage, &stream->damage,
+			      (pixman_region32_t *) damage);
+
+	if (!stream->buffer)
+		return;
+
+	/* Nothing changed, so the buffer is already up to date */
+	if (!pixman_region32_not_empty(&stream->damage)) {
+		screenshooter_stream_finish(stream,
+					    WESTON_SCREENSHOOTER_SUCCESS);
+		return;
+	}
+
+	pixman_region32_copy(region, &stream->damage);
+}
+
+static void
+screenshooter_stream_captured(void *data, struct weston_capture_frame *frame)
+{
+	struct weston_screenshooter_stream *stream = data;
+	struct wl_shm_buffer *shm;
+	pixman_box32_t *r;
+	int i, n;
+
+	if (!stream->buffer)
+		return;
+
+	if (!frame) {
+		screenshooter_stream_finish(stream,
+					    WESTON_SCREENSHOOTER_NO_MEMORY);
+		return;
+	}
+
+	shm = stream->buffer->shm_buffer;
+	wl_shm_buffer_begin_access(shm);
+	r = pixman_region32_rectangles(&stream->damage, &n);
+	for (i = 0; i < n; i++)
+		copy_frame_box_to_shm(frame, shm, &r[i], r[i].x1, r[i].y1);
+	wl_shm_buffer_end_access(shm);
+
+	pixman_region32_clear(&stream->damage);
+	screenshooter_stream_finish(stream, WESTON_SCREENSHOOTER_SUCCESS);
+}
+
+static void
+screenshooter_stream_output_destroyed(struct wl_listener *listener,
+				      void *data)
+{
+	struct weston_screenshooter_stream *stream =
+		container_of(listener, struct weston_screenshooter_stream,
+			     output_destroy_listener);
+
+	/* A pending capture has been failed by the capture service */
+	wl_list_remove(&stream->output_destroy_listener.link);
+	wl_list_init(&stream->output_destroy_listener.link);
+	stream->output = NULL;
+}
+
+/** Create a continuous capture stream for an output
+ *
+ * \param output The output to capture.
+ *
+ * A stream keeps track of the output damage between captures, so that
+ * each weston_screenshooter_stream_shoot() only reads back the pixels
+ * that changed since the previous one.
+ *
+ * \return The stream, or NULL on failure.
+ */
+WL_EXPORT struct weston_screenshooter_stream *
+weston_screenshooter_stream_create(struct weston_output *output)
+{
+	struct weston_screenshooter_stream *stream;
+
+	stream = zalloc(sizeof *stream);
+	if (stream == NULL)
+		return NULL;
+
+	stream->output = output;
+	pixman_region32_init_rect(&stream->damage, 0, 0,
+				  output->current_mode->width,
+				  output->current_mode->height);
+	stream->sub = weston_capture_subscribe(output,
+					       screenshooter_stream_prepare,
+					       screenshooter_stream_captured,
+					       stream);
+	if (stream->sub == NULL) {
+		pixman_region32_fini(&stream->damage);
+		free(stream);
+		return NULL;
+	}
+
+	stream->output_destroy_listener.notify =
+		screenshooter_stream_output_destroyed;
+	wl_signal_add(&output->destroy_signal,
+		      &stream->output_destroy_listener);
+
+	return stream;
+}
+
+/** Update a buffer with what changed since the previous capture
+ *
+ * \param stream The capture stream.
+ * \param buffer A wl_shm buffer in ARGB8888 or XRGB8888 format, at least
+ * as big as the output's current mode.
+ * \param done Called once the capture has completed or failed.
+ * \param data User data for \c done.
+ *
+ * The first capture of a stream reads the whole output.  Later ones
+ * only read back the damaged regions, so the buffer must still hold
+ * the result of the previous capture.
+ *
+ * \return 0 if the capture has been scheduled, -1 otherwise, in which
+ * case \c done has already been called.
+ */
+WL_EXPORT int
+weston_screenshooter_stream_shoot(struct weston_screenshooter_stream *stream,
+				  struct weston_buffer *buffer,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
+{
+	struct weston_output *output = stream->output;
+
+	if (!output || stream->buffer ||
+	    !screenshooter_get_shm_buffer(output, buffer,
+					  output->current_mode->width,
+					  output->current_mode->height)) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	stream->buffer = buffer;
+	stream->done = done;
+	stream->data = data;
 	output->disable_planes++;
 	weston_output_schedule_repaint(output);
 
 	return 0;
 }
 
+WL_EXPORT void
+weston_screenshooter_stream_destroy(struct weston_screenshooter_stream *stream)
+{
+	if (stream->buffer) {
+		stream->output->disable_planes--;
+		stream->done(stream->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+	}
+
+	wl_list_remove(&stream->output_destroy_listener.link);
+	weston_capture_unsubscribe(stream->sub);
+	pixman_region32_fini(&stream->damage);
+	free(stream);
+}
+
+/* The recorder captures the damaged part of every frame and hands it to
+ * a recorder backend for encoding. */
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
-	int fd;
-	struct wl_listener frame_listener;
+	const struct weston_recorder_backend *backend;
+	void *encoder;
+	struct weston_capture_subscriber *sub;
+	struct weston_recorder_rect *rects;
+	int rects_size;
 	int count, destroying;
 };
 
+/* wcap writer, the default recorder backend.
+ *
+ * Every frame is written as run-length encoded deltas of the damaged
+ * rectangles against the previous frame.  Once the deltas written since
+ * the last keyframe add up to more than WCAP_KEYFRAME_RATIO times its
+ * size, the next frame is written as a keyframe instead: a single
+ * rectangle covering the whole output, encoded against a black frame.
+ * That bounds the amount of data to decode to get to any frame, while
+ * keeping the keyframe overhead at a fraction of the file.  An index of
+ * all frames is appended when the recording stops.
+ */
+#define WCAP_KEYFRAME_RATIO 4
+
+struct wcap_writer {
+	int fd;
+	int width, height;
+	uint32_t *frame;
+	uint32_t *outbuf;
+	struct wcap_rectangle *boxes;
+	int boxes_size;
+	uint64_t offset;
+	uint64_t keyframe_size, since_keyframe;
+	struct wl_array index;
+};
+
 static uint32_t *
 output_run(uint32_t *p, uint32_t delta, int run)
 {
@@ -250,171 +1066,195 @@ component_delta(uint32_t next, uint32_t prev)
 	return (dr << 16) | (dg << 8) | (db << 0);
 }
 
-static void
-weston_recorder_destroy(struct weston_recorder *recorder);
-
-static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+/* Encode a rectangle of src as deltas against ref, or against black if
+ * ref is NULL, and update ref.  wcap stores the rows bottom-up. */
+static uint32_t *
+wcap_encode(uint32_t *p, const uint32_t *src, int src_stride,
+	    uint32_t *ref, int ref_stride, int width, int height)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
-	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
-
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region,
-				  &output->previous_damage);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
+	const uint32_t *s;
+	uint32_t *d = NULL;
+	uint32_t delta, prev, next;
+	int j, k, run;
+
+	run = prev = 0; /* quiet gcc */
+	for (j = height - 1; j >= 0; j--) {
+		s = src + j * src_stride;
+		if (ref)
+			d = ref + j * ref_stride;
+
+		for (k = 0; k < width; k++) {
+			next = *s++;
+			if (d) {
+				delta = component_delta(next, *d);
+				*d++ = next;
+			} else {
+				delta = next & 0xffffff;
+			}
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+			if (run == 0 || delta == prev) {
+				run++;
+			} else {
+				p = output_run(p, prev, run);
+				run = 1;
+			}
+			prev = delta;
+		}
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	return output_run(p, prev, run);
+}
 
-	for (i = 0; i < n; i++) {
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
+static int
+wcap_writer_write_frame(void *data, const struct weston_recorder_frame *frame)
+{
+	struct wcap_writer *writer = data;
+	struct wcap_frame_header_v2 header;
+	struct wcap_index_entry *entry;
+	struct wcap_rectangle *boxes;
+	struct iovec v[3];
+	const pixman_box32_t *box;
+	uint32_t *p;
+	size_t size;
+	ssize_t written;
+	int i;
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
+	if (frame->nrects > writer->boxes_size) {
+		boxes = realloc(writer->boxes, frame->nrects * sizeof *boxes);
+		if (!boxes)
+			return -1;
+		writer->boxes = boxes;
+		writer->boxes_size = frame->nrects;
+	}
 
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
+	p = writer->outbuf;
+	for (i = 0; i < frame->nrects; i++) {
+		box = &frame->rects[i].box;
+		writer->boxes[i].x1 = box->x1;
+		writer->boxes[i].y1 = box->y1;
+		writer->boxes[i].x2 = box->x2;
+		writer->boxes[i].y2 = box->y2;
+
+		p = wcap_encode(p, frame->rects[i].data, frame->rects[i].stride,
+				writer->frame + box->y1 * writer->width + box->x1,
+				writer->width,
+				box->x2 - box->x1, box->y2 - box->y1);
+	}
 
-		p = output_run(p, prev, run);
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	header.flags = 0;
+	size = (p - writer->outbuf) * 4;
+
+	/* writer->frame now holds the new frame, encode it from scratch
+	 * if it is time for a keyframe. */
+	if (writer->index.size == 0 ||
+	    writer->since_keyframe + size >
+	    writer->keyframe_size * WCAP_KEYFRAME_RATIO) {
+		writer->boxes[0].x1 = 0;
+		writer->boxes[0].y1 = 0;
+		writer->boxes[0].x2 = writer->width;
+		writer->boxes[0].y2 = writer->height;
+
+		p = wcap_encode(writer->outbuf, writer->frame, writer->width,
+				NULL, 0, writer->width, writer->height);
+
+		header.nrects = 1;
+		header.flags = WCAP_FRAME_KEYFRAME;
+		size = (p - writer->outbuf) * 4;
+		writer->keyframe_size = size;
+		writer->since_keyframe = 0;
+	} else {
+		writer->since_keyframe += size;
+	}
 
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	header.size = header.nrects * sizeof *writer->boxes + size;
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
-	}
+	entry = wl_array_add(&writer->index, sizeof *entry);
+	if (!entry)
+		return -1;
+	entry->offset = writer->offset;
+	entry->msecs = header.msecs;
+	entry->flags = header.flags;
 
-	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = writer->boxes;
+	v[1].iov_len = header.nrects * sizeof *writer->boxes;
+	v[2].iov_base = writer->outbuf;
+	v[2].iov_len = size;
+	written = writev(writer->fd, v, 3);
+	if (written != (ssize_t) (sizeof header + header.size))
+		return -1;
 
-	if (recorder->destroying)
-		weston_recorder_destroy(recorder);
+	writer->offset += written;
+
+	return 0;
 }
 
 static void
-weston_recorder_free(struct weston_recorder *recorder)
+wcap_writer_destroy(void *data)
 {
-	if (recorder == NULL)
-		return;
+	struct wcap_writer *writer = data;
+	struct wcap_index_trailer trailer;
+	struct iovec v[2];
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
-	free(recorder->frame);
-	free(recorder);
+	trailer.magic = WCAP_INDEX_MAGIC;
+	trailer.nframes = writer->index.size / sizeof(struct wcap_index_entry);
+	trailer.offset = writer->offset;
+
+	v[0].iov_base = writer->index.data;
+	v[0].iov_len = writer->index.size;
+	v[1].iov_base = &trailer;
+	v[1].iov_len = sizeof trailer;
+	if (writev(writer->fd, v, 2) < 0)
+		weston_log("failed to write wcap index: %m\n");
+	else
+		weston_log("wcap file size %" PRIu64 "M, %u frames\n",
+			   (writer->offset + v[0].iov_len) / (1024 * 1024),
+			   trailer.nframes);
+
+	close(writer->fd);
+	wl_array_release(&writer->index);
+	free(writer->boxes);
+	free(writer->outbuf);
+	free(writer->frame);
+	free(writer);
 }
 
-static struct weston_recorder *
-weston_recorder_create(struct weston_output *output, const char *filename)
+static void *
+wcap_writer_create(struct weston_output *output, const char *filename,
+		   pixman_format_code_t format)
 {
-	struct weston_compositor *compositor = output->compositor;
-	struct weston_recorder *recorder;
-	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	struct wcap_writer *writer;
+	struct wcap_header header;
+	size_t size;
 
-	recorder = zalloc(sizeof *recorder);
-	if (recorder == NULL) {
+	writer = zalloc(sizeof *writer);
+	if (writer == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		return NULL;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
-	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
-	recorder->output = output;
-
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	wl_array_init(&writer->index);
+	writer->fd = -1;
+	writer->width = output->current_mode->width;
+	writer->height = output->current_mode->height;
+
+	/* The run-length encoding never takes more than a word per pixel */
+	size = writer->width * writer->height * 4;
+	writer->frame = zalloc(size);
+	writer->outbuf = malloc(size);
+	writer->boxes = malloc(sizeof *writer->boxes);
+	writer->boxes_size = 1;
+	if (!writer->frame || !writer->outbuf || !writer->boxes) {
 		weston_log("%s: out of memory\n", __func__);
-		goto err_recorder;
-	}
-
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
+		goto err_writer;
 	}
 
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
-	switch (compositor->read_format) {
+	switch (format) {
 	case PIXMAN_x8r8g8b8:
 	case PIXMAN_a8r8g8b8:
 		header.format = WCAP_FORMAT_XRGB8888;
@@ -424,65 +1264,198 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		break;
 	default:
 		weston_log("unknown recorder format\n");
-		goto err_recorder;
+		goto err_writer;
 	}
 
-	recorder->fd = open(filename,
-			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	writer->fd = open(filename,
+			  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 
-	if (recorder->fd < 0) {
+	if (writer->fd < 0) {
 		weston_log("problem opening output file %s: %m\n", filename);
-		goto err_recorder;
+		goto err_writer;
 	}
 
-	header.width = output->current_mode->width;
-	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	header.width = writer->width;
+	header.height = writer->height;
+	if (write(writer->fd, &header, sizeof header) != sizeof header) {
+		weston_log("problem writing output file %s: %m\n", filename);
+		goto err_writer;
+	}
+	writer->offset = sizeof header;
+
+	return writer;
+
+err_writer:
+	if (writer->fd >= 0)
+		close(writer->fd);
+	free(writer->boxes);
+	free(writer->outbuf);
+	free(writer->frame);
+	free(writer);
+	return NULL;
+}
+
+static const struct weston_recorder_backend wcap_recorder_backend = {
+	"wcap",
+	wcap_writer_create,
+	wcap_writer_write_frame,
+	wcap_writer_destroy,
+};
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static void
+weston_recorder_prepare(void *data, struct weston_output *output,
+			const pixman_region32_t *damage,
+			pixman_region32_t *region)
+{
+	struct weston_recorder *recorder = data;
+
+	if (recorder->destroying) {
+		weston_recorder_destroy(recorder);
+		return;
+	}
+
+	pixman_region32_copy(region, (pixman_region32_t *) damage);
+}
+
+/* The damaged rectangles are passed to the backend straight from the
+ * captured frame. */
+static void
+weston_recorder_captured(void *data, struct weston_capture_frame *capture)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame frame;
+	struct weston_recorder_rect *rects;
+	pixman_box32_t *r;
+	uint32_t *pixels;
+	int i, n, stride;
+
+	if (capture == NULL)
+		return;
+
+	r = pixman_region32_rectangles(&capture->damage, &n);
+	if (n > recorder->rects_size) {
+		rects = realloc(recorder->rects, n * sizeof *rects);
+		if (!rects) {
+			weston_log("%s: out of memory\n", __func__);
+			return;
+		}
+		recorder->rects = rects;
+		recorder->rects_size = n;
+	}
+
+	pixels = pixman_image_get_data(capture->image);
+	stride = pixman_image_get_stride(capture->image) / 4;
+	for (i = 0; i < n; i++) {
+		recorder->rects[i].box = r[i];
+		recorder->rects[i].data = pixels + r[i].y1 * stride + r[i].x1;
+		recorder->rects[i].stride = stride;
+	}
+
+	frame.msecs = capture->msecs;
+	frame.nrects = n;
+	frame.rects = recorder->rects;
+	if (recorder->backend->write_frame(recorder->encoder, &frame) < 0) {
+		weston_log("%s recorder failed to write frame, stopping\n",
+			   recorder->backend->name);
+		weston_recorder_destroy(recorder);
+		return;
+	}
+
+	recorder->count++;
+}
+
+static struct weston_recorder *
+weston_recorder_create(struct weston_output *output, const char *filename,
+		       const struct weston_recorder_backend *backend)
+{
+	struct weston_recorder *recorder;
+
+	recorder = zalloc(sizeof *recorder);
+	if (recorder == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		return NULL;
+	}
+
+	recorder->output = output;
+	recorder->backend = backend;
+
+	/* Captured frames are always ARGB8888 */
+	recorder->encoder = backend->create(output, filename,
+					    PIXMAN_a8r8g8b8);
+	if (recorder->encoder == NULL)
+		goto err_recorder;
+
+	recorder->sub = weston_capture_subscribe(output,
+						 weston_recorder_prepare,
+						 weston_recorder_captured,
+						 recorder);
+	if (recorder->sub == NULL)
+		goto err_encoder;
 
-	recorder->frame_listener.notify = weston_recorder_frame_notify;
-	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
 	weston_output_damage(output);
 
 	return recorder;
 
+err_encoder:
+	backend->destroy(recorder->encoder);
 err_recorder:
-	weston_recorder_free(recorder);
+	free(recorder);
 	return NULL;
 }
 
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
-	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
+	weston_capture_unsubscribe(recorder->sub);
+	recorder->backend->destroy(recorder->encoder);
 	recorder->output->disable_planes--;
-	weston_recorder_free(recorder);
+	free(recorder->rects);
+	free(recorder);
 }
 
+/** Start recording an output with the given recorder backend
+ *
+ * \param output The output to record.
+ * \param filename Where the backend writes the recording.
+ * \param backend The encoder for the recording, or NULL for the
+ * default wcap format.
+ *
+ * \return The recorder, or NULL on failure or if the output is already
+ * being recorded.
+ */
 WL_EXPORT struct weston_recorder *
-weston_recorder_start(struct weston_output *output, const char *filename)
+weston_recorder_start_with_backend(struct weston_output *output,
+				   const char *filename,
+				   const struct weston_recorder_backend *backend)
 {
-	struct wl_listener *listener;
+	if (backend == NULL)
+		backend = &wcap_recorder_backend;
 
-	listener = wl_signal_get(&output->frame_signal,
-				 weston_recorder_frame_notify);
-	if (listener) {
+	if (output_capture_has_subscriber(output, weston_recorder_prepare)) {
 		weston_log("a recorder on output %s is already running\n",
 			   output->name);
 		return NULL;
 	}
 
-	weston_log("starting recorder for output %s, file %s\n",
-		   output->name, filename);
-	return weston_recorder_create(output, filename);
+	weston_log("starting %s recorder for output %s, file %s\n",
+		   backend->name, output->name, filename);
+	return weston_recorder_create(output, filename, backend);
+}
+
+WL_EXPORT struct weston_recorder *
+weston_recorder_start(struct weston_output *output, const char *filename)
+{
+	return weston_recorder_start_with_backend(output, filename, NULL);
 }
 
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder, %d frames\n", recorder->count);
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
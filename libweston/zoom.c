@@ -39,6 +39,8 @@ weston_zoom_frame_z(struct weston_animation *animation,
 		    struct weston_output *output,
 		    const struct timespec *time)
 {
+	double previous = output->zoom.spring_z.current;
+
 	if (animation->frame_counter <= 1)
 		output->zoom.spring_z.timestamp = *time;
 
@@ -59,6 +61,8 @@ weston_zoom_frame_z(struct weston_animation *animation,
 		output->zoom.spring_z.current = output->zoom.level;
 		wl_list_remove(&animation->link);
 		wl_list_init(&animation->link);
+	} else if (output->zoom.spring_z.current == previous) {
+		return;
 	}
 
 	output->dirty = 1;
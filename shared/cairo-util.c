@@ -188,13 +188,14 @@ render_shadow(cairo_t *cr, cairo_surface_t *surface,
 		if (width < 2 * shadow_width)
 			shadow_width = (width + !fx) / 2;
 
-		cairo_reset_clip(cr);
+		cairo_save(cr);
 		cairo_rectangle(cr,
 				x + fx * (width - shadow_width),
 				y + fy * (height - shadow_height),
 				shadow_width, shadow_height);
 		cairo_clip (cr);
 		cairo_mask(cr, pattern);
+		cairo_restore(cr);
 	}
 
 
@@ -209,24 +210,25 @@ render_shadow(cairo_t *cr, cairo_surface_t *surface,
 		cairo_matrix_scale(&matrix, 8.0 / width, 1);
 		cairo_matrix_translate(&matrix, -x - width / 2, -y);
 		cairo_pattern_set_matrix(pattern, &matrix);
-		cairo_rectangle(cr, x + margin, y, shadow_width, shadow_height);
 
-		cairo_reset_clip(cr);
+		cairo_save(cr);
 		cairo_rectangle(cr,
 				x + margin, y,
 				shadow_width, shadow_height);
 		cairo_clip (cr);
 		cairo_mask(cr, pattern);
+		cairo_restore(cr);
 
 		/* Bottom stretch */
 		cairo_matrix_translate(&matrix, 0, -height + 128);
 		cairo_pattern_set_matrix(pattern, &matrix);
 
-		cairo_reset_clip(cr);
+		cairo_save(cr);
 		cairo_rectangle(cr, x + margin, y + height - margin,
 				shadow_width, margin);
 		cairo_clip (cr);
 		cairo_mask(cr, pattern);
+		cairo_restore(cr);
 	}
 
 	shadow_width = margin;
@@ -243,24 +245,25 @@ render_shadow(cairo_t *cr, cairo_surface_t *surface,
 		cairo_matrix_scale(&matrix, 1, 8.0 / height);
 		cairo_matrix_translate(&matrix, -x, -y - height / 2);
 		cairo_pattern_set_matrix(pattern, &matrix);
-		cairo_reset_clip(cr);
+		cairo_save(cr);
 		cairo_rectangle(cr, x, y + top_margin,
 				shadow_width, shadow_height);
 		cairo_clip (cr);
 		cairo_mask(cr, pattern);
+		cairo_restore(cr);
 
 		/* Right stretch */
 		cairo_matrix_translate(&matrix, -width + 128, 0);
 		cairo_pattern_set_matrix(pattern, &matrix);
+		cairo_save(cr);
 		cairo_rectangle(cr, x + width - shadow_width, y + top_margin,
 				shadow_width, shadow_height);
-		cairo_reset_clip(cr);
 		cairo_clip (cr);
 		cairo_mask(cr, pattern);
+		cairo_restore(cr);
 	}
 
 	cairo_pattern_destroy(pattern);
-	cairo_reset_clip(cr);
 }
 
 void
@@ -477,23 +480,175 @@ create_layout(cairo_t *cr, const char *title)
 }
 #endif
 
+/* A title wider than the room in the title bar is ellipsized to that room
+ * rounded down to a multiple of this, so that a resize renders it again
+ * only every so many pixels rather than on every step. */
+#define TITLE_WIDTH_STEP 32
+
+/* Room around the text in its cached rendering for glyphs reaching out of
+ * their logical extents and for the drop shadow. */
+#define TITLE_PAD 2
+
+void
+theme_title_cache_release(struct theme_title_cache *cache)
+{
+	if (cache->surface)
+		cairo_surface_destroy(cache->surface);
+	free(cache->title);
+	memset(cache, 0, sizeof *cache);
+}
+
+static int
+title_clip_width(struct theme_title_cache *cache, int max_width)
+{
+#ifdef HAVE_PANGO
+	if (cache->natural_width > max_width)
+		return max_width >= TITLE_WIDTH_STEP ?
+			max_width - max_width % TITLE_WIDTH_STEP : max_width;
+#endif
+	return 0;
+}
+
+#ifdef HAVE_PANGO
+static void
+title_show(cairo_t *cr, PangoLayout *layout, const char *title)
+{
+	pango_cairo_update_layout(cr, layout);
+	pango_cairo_show_layout(cr, layout);
+}
+#else
+static void
+title_show(cairo_t *cr, void *layout, const char *title)
+{
+	cairo_select_font_face(cr, "sans",
+			       CAIRO_FONT_SLANT_NORMAL,
+			       CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(cr, 14);
+	cairo_show_text(cr, title);
+}
+#endif
+
+/**
+ * Render a title into its cache unless it is there already
+ *
+ * The text is drawn once into an image surface, with its drop shadow if the
+ * frame is active, and only drawn again when the title, the focus state or
+ * the ellipsized width changes.
+ *
+ * \return 0 if the cache holds the title, -1 otherwise.
+ */
+static int
+title_cache_update(struct theme_title_cache *cache, const char *title,
+		   int max_width, uint32_t flags)
+{
+	cairo_surface_t *scratch;
+	cairo_t *cr;
+	int surface_width, surface_height;
+#ifdef HAVE_PANGO
+	PangoLayout *layout;
+	PangoRectangle logical;
+#else
+	void *layout = NULL;
+	cairo_text_extents_t extents;
+	cairo_font_extents_t font_extents;
+#endif
+
+	flags &= THEME_FRAME_ACTIVE;
+
+	if (cache->surface && cache->flags == flags &&
+	    strcmp(cache->title, title) == 0 &&
+	    cache->clip_width == title_clip_width(cache, max_width))
+		return 0;
+
+	theme_title_cache_release(cache);
+	cache->title = strdup(title);
+	if (!cache->title)
+		return -1;
+	cache->flags = flags;
+
+	/* Measure the text on a throwaway context */
+	scratch = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+	cr = cairo_create(scratch);
 #ifdef HAVE_PANGO
-#define SHOW_TEXT(cr) \
-	pango_cairo_show_layout(cr, title_layout)
+	layout = create_layout(cr, title);
+	pango_layout_get_pixel_extents(layout, NULL, &logical);
+	cache->natural_width = logical.width;
+	cache->clip_width = title_clip_width(cache, max_width);
+	if (cache->clip_width)
+		pango_layout_set_width(layout,
+				       cache->clip_width * PANGO_SCALE);
+	cache->text_width = cache->clip_width ?
+		cache->clip_width : logical.width;
+	cache->text_height = logical.height;
+	cache->origin_x = TITLE_PAD;
+	cache->origin_y = TITLE_PAD;
+	surface_width = cache->text_width;
+	surface_height = logical.height;
 #else
-#define SHOW_TEXT(cr) \
-	cairo_show_text(cr, title)
+	cairo_select_font_face(cr, "sans",
+			       CAIRO_FONT_SLANT_NORMAL,
+			       CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(cr, 14);
+	cairo_text_extents(cr, title, &extents);
+	cairo_font_extents(cr, &font_extents);
+	cache->natural_width = extents.width;
+	cache->clip_width = 0;
+	cache->text_width = extents.width;
+	cache->text_height = font_extents.descent - font_extents.ascent;
+	cache->origin_x = TITLE_PAD;
+	cache->origin_y = TITLE_PAD + ceil(font_extents.ascent);
+	surface_width = ceil(MAX(extents.width,
+				 extents.x_bearing + extents.x_advance));
+	surface_height = ceil(font_extents.ascent + font_extents.descent);
+#endif
+	cairo_destroy(cr);
+	cairo_surface_destroy(scratch);
+
+	cache->surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					   surface_width + 2 * TITLE_PAD + 1,
+					   surface_height + 2 * TITLE_PAD + 1);
+	if (cairo_surface_status(cache->surface) != CAIRO_STATUS_SUCCESS)
+		goto err;
+
+	cr = cairo_create(cache->surface);
+	if (flags & THEME_FRAME_ACTIVE) {
+		cairo_move_to(cr, cache->origin_x + 1, cache->origin_y + 1);
+		cairo_set_source_rgb(cr, 1, 1, 1);
+		title_show(cr, layout, title);
+		cairo_move_to(cr, cache->origin_x, cache->origin_y);
+		cairo_set_source_rgb(cr, 0, 0, 0);
+		title_show(cr, layout, title);
+	} else {
+		cairo_move_to(cr, cache->origin_x, cache->origin_y);
+		cairo_set_source_rgb(cr, 0.4, 0.4, 0.4);
+		title_show(cr, layout, title);
+	}
+	cairo_destroy(cr);
+#ifdef HAVE_PANGO
+	g_object_unref(layout);
 #endif
 
+	return 0;
+
+err:
+#ifdef HAVE_PANGO
+	g_object_unref(layout);
+#endif
+	theme_title_cache_release(cache);
+	return -1;
+}
+
 void
 theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, cairo_rectangle_int_t *title_rect,
-		   struct wl_list *buttons, uint32_t flags)
+		   struct wl_list *buttons, uint32_t flags,
+		   struct theme_title_cache *title_cache)
 {
+	struct theme_title_cache uncached = { 0 };
 	cairo_surface_t *source;
 	int x, y, margin, top_margin;
-	int text_width, text_height;
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cr, 0, 0, 0, 0);
@@ -523,59 +678,34 @@ theme_render_frame(struct theme *t,
 		    width - margin * 2, height - margin * 2,
 		    t->width, top_margin);
 
-	if (title || !wl_list_empty(buttons)) {
-
-		cairo_rectangle (cr, title_rect->x, title_rect->y,
-				 title_rect->width, title_rect->height);
-		cairo_clip(cr);
-		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-
-#ifdef HAVE_PANGO
-		PangoLayout *title_layout;
-		PangoRectangle logical;
-
-		title_layout = create_layout(cr, title);
-
-		pango_layout_get_pixel_extents (title_layout, NULL, &logical);
-		text_width = MIN(title_rect->width, logical.width);
-		text_height = logical.height;
-		if (text_width < logical.width)
-		  pango_layout_set_width (title_layout, text_width * PANGO_SCALE);
-		
-#else
-		cairo_text_extents_t extents;
-		cairo_font_extents_t font_extents;
-
-		cairo_select_font_face(cr, "sans",
-				       CAIRO_FONT_SLANT_NORMAL,
-				       CAIRO_FONT_WEIGHT_BOLD);
-		cairo_set_font_size(cr, 14);
-		cairo_text_extents(cr, title, &extents);
-		cairo_font_extents (cr, &font_extents);
-		text_width = extents.width;
-		text_height = font_extents.descent - font_extents.ascent;
-#endif
+	if (!title || title_rect->width <= 0)
+		return;
+
+	if (!title_cache)
+		title_cache = &uncached;
+	if (title_cache_update(title_cache, title, title_rect->width,
+			       flags) < 0)
+		return;
+
+	x = (width - title_cache->text_width) / 2;
+	y = margin + (t->titlebar_height - title_cache->text_height) / 2;
+	if (x < title_rect->x)
+		x = title_rect->x;
+	else if (x + title_cache->text_width >
+		 (title_rect->x + title_rect->width))
+		x = (title_rect->x + title_rect->width) -
+			title_cache->text_width;
+
+	cairo_rectangle(cr, title_rect->x, title_rect->y,
+			title_rect->width, title_rect->height);
+	cairo_clip(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_surface(cr, title_cache->surface,
+				 x - title_cache->origin_x,
+				 y - title_cache->origin_y);
+	cairo_paint(cr);
 
-		x = (width - text_width) / 2;
-		y = margin + (t->titlebar_height - text_height) / 2;
-		if (x < title_rect->x)
-			x = title_rect->x;
-		else if (x + text_width > (title_rect->x + title_rect->width))
-			x = (title_rect->x + title_rect->width) - text_width;
-
-		if (flags & THEME_FRAME_ACTIVE) {
-			cairo_move_to(cr, x + 1, y  + 1);
-			cairo_set_source_rgb(cr, 1, 1, 1);
-			SHOW_TEXT(cr);
-			cairo_move_to(cr, x, y);
-			cairo_set_source_rgb(cr, 0, 0, 0);
-			SHOW_TEXT(cr);
-		} else {
-			cairo_move_to(cr, x, y);
-			cairo_set_source_rgb(cr, 0.4, 0.4, 0.4);
-			SHOW_TEXT(cr);
-		}
-	}
+	theme_title_cache_release(&uncached);
 }
 
 enum theme_location
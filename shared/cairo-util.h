@@ -70,13 +70,32 @@ enum {
 	THEME_FRAME_NO_TITLE = 4
 };
 
+/**
+ * The title text of a frame as last rendered by theme_render_frame
+ *
+ * Zero-initialize before first use.
+ */
+struct theme_title_cache {
+	cairo_surface_t *surface;
+	char *title;
+	uint32_t flags;
+	int natural_width;
+	int clip_width;
+	int text_width, text_height;
+	int origin_x, origin_y;
+};
+
+void
+theme_title_cache_release(struct theme_title_cache *cache);
+
 void
 theme_set_background_source(struct theme *t, cairo_t *cr, uint32_t flags);
 void
 theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, cairo_rectangle_int_t *title_rect,
-		   struct wl_list *buttons, uint32_t flags);
+		   struct wl_list *buttons, uint32_t flags,
+		   struct theme_title_cache *title_cache);
 
 enum theme_location {
 	THEME_LOCATION_INTERIOR = 0,
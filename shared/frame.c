@@ -35,6 +35,7 @@
 
 #include "cairo-util.h"
 #include "shared/file-util.h"
+#include "shared/helpers.h"
 
 enum frame_button_flags {
 	FRAME_BUTTON_ALIGN_RIGHT = 0x1,
@@ -42,11 +43,20 @@ enum frame_button_flags {
 	FRAME_BUTTON_CLICK_DOWN = 0x4,
 };
 
+enum frame_button_state {
+	FRAME_BUTTON_STATE_NORMAL,
+	FRAME_BUTTON_STATE_HOVER,
+	FRAME_BUTTON_STATE_PRESSED,
+	FRAME_BUTTON_STATE_COUNT
+};
+
 struct frame_button {
 	struct frame *frame;
 	struct wl_list link;	/* buttons_list */
 
 	cairo_surface_t *icon;
+	/* Decorated buttons with their icon, rendered on first use */
+	cairo_surface_t *sprites[FRAME_BUTTON_STATE_COUNT];
 	enum frame_button_flags flags;
 	int hover_count;
 	int press_count;
@@ -100,6 +110,7 @@ struct frame {
 	int geometry_dirty;
 
 	cairo_rectangle_int_t title_rect;
+	struct theme_title_cache title_cache;
 
 	uint32_t status;
 
@@ -153,9 +164,22 @@ error:
 	return NULL;
 }
 
+static void
+frame_button_drop_sprites(struct frame_button *button)
+{
+	int i;
+
+	for (i = 0; i < FRAME_BUTTON_STATE_COUNT; i++) {
+		if (button->sprites[i])
+			cairo_surface_destroy(button->sprites[i]);
+		button->sprites[i] = NULL;
+	}
+}
+
 static void
 frame_button_destroy(struct frame_button *button)
 {
+	frame_button_drop_sprites(button);
 	cairo_surface_destroy(button->icon);
 	free(button);
 }
@@ -208,9 +232,74 @@ frame_button_cancel(struct frame_button *button)
 		button->frame->status |= FRAME_STATUS_REPAINT;
 }
 
+/* The border of a decorated button, stroked around 25x16 pixels, reaches
+ * one pixel out of it; sprites start there. */
+#define FRAME_BUTTON_SPRITE_BORDER 1
+
+static cairo_surface_t *
+frame_button_get_sprite(struct frame_button *button,
+			enum frame_button_state state)
+{
+	cairo_surface_t *sprite;
+	cairo_t *cr;
+	int width, height;
+
+	if (button->sprites[state])
+		return button->sprites[state];
+
+	width = MAX(25 + 2 * FRAME_BUTTON_SPRITE_BORDER,
+		    FRAME_BUTTON_SPRITE_BORDER + 4 +
+		    cairo_image_surface_get_width(button->icon));
+	height = MAX(16 + 2 * FRAME_BUTTON_SPRITE_BORDER,
+		     FRAME_BUTTON_SPRITE_BORDER +
+		     cairo_image_surface_get_height(button->icon));
+
+	sprite = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					    width, height);
+	if (cairo_surface_status(sprite) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(sprite);
+		return NULL;
+	}
+
+	cr = cairo_create(sprite);
+	cairo_translate(cr, FRAME_BUTTON_SPRITE_BORDER,
+			FRAME_BUTTON_SPRITE_BORDER);
+
+	cairo_set_line_width(cr, 1);
+
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+	cairo_rectangle(cr, 0, 0, 25, 16);
+
+	cairo_stroke_preserve(cr);
+
+	switch (state) {
+	case FRAME_BUTTON_STATE_PRESSED:
+		cairo_set_source_rgb(cr, 0.7, 0.7, 0.7);
+		break;
+	case FRAME_BUTTON_STATE_HOVER:
+		cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+		break;
+	default:
+		cairo_set_source_rgb(cr, 0.88, 0.88, 0.88);
+		break;
+	}
+
+	cairo_fill(cr);
+
+	cairo_set_source_surface(cr, button->icon, 4, 0);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	button->sprites[state] = sprite;
+
+	return sprite;
+}
+
 static void
 frame_button_repaint(struct frame_button *button, cairo_t *cr)
 {
+	enum frame_button_state state;
+	cairo_surface_t *sprite;
 	int x, y;
 
 	if (!button->allocation.width)
@@ -221,32 +310,27 @@ frame_button_repaint(struct frame_button *button, cairo_t *cr)
 	x = button->allocation.x;
 	y = button->allocation.y;
 
-	cairo_save(cr);
-
 	if (button->flags & FRAME_BUTTON_DECORATED) {
-		cairo_set_line_width(cr, 1);
-
-		cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-		cairo_rectangle(cr, x, y, 25, 16);
-
-		cairo_stroke_preserve(cr);
-
-		if (button->press_count) {
-			cairo_set_source_rgb(cr, 0.7, 0.7, 0.7);
-		} else if (button->hover_count) {
-			cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
-		} else {
-			cairo_set_source_rgb(cr, 0.88, 0.88, 0.88);
-		}
+		if (button->press_count)
+			state = FRAME_BUTTON_STATE_PRESSED;
+		else if (button->hover_count)
+			state = FRAME_BUTTON_STATE_HOVER;
+		else
+			state = FRAME_BUTTON_STATE_NORMAL;
 
-		cairo_fill (cr);
+		sprite = frame_button_get_sprite(button, state);
+		if (!sprite)
+			return;
 
-		x += 4;
+		x -= FRAME_BUTTON_SPRITE_BORDER;
+		y -= FRAME_BUTTON_SPRITE_BORDER;
+	} else {
+		sprite = button->icon;
 	}
 
-	cairo_set_source_surface(cr, button->icon, x, y);
+	cairo_save(cr);
+	cairo_set_source_surface(cr, sprite, x, y);
 	cairo_paint(cr);
-
 	cairo_restore(cr);
 }
 
@@ -319,6 +403,7 @@ frame_destroy(struct frame *frame)
 	wl_list_for_each_safe(pointer, next_pointer, &frame->pointers, link)
 		frame_pointer_destroy(pointer);
 
+	theme_title_cache_release(&frame->title_cache);
 	free(frame->title);
 	free(frame);
 }
@@ -433,6 +518,10 @@ frame_set_title(struct frame *frame, const char *title)
 {
 	char *dup = NULL;
 
+	if (title == frame->title ||
+	    (title && frame->title && strcmp(title, frame->title) == 0))
+		return 0;
+
 	if (title) {
 		dup = strdup(title);
 		if (!dup)
@@ -458,6 +547,7 @@ frame_set_icon(struct frame *frame, cairo_surface_t *icon)
 		if (button->icon)
 			cairo_surface_destroy(button->icon);
 		button->icon = icon;
+		frame_button_drop_sprites(button);
 		frame->status |= FRAME_STATUS_REPAINT;
 	}
 }
@@ -1011,7 +1101,7 @@ frame_repaint(struct frame *frame, cairo_t *cr)
 	cairo_save(cr);
 	theme_render_frame(frame->theme, cr, frame->width, frame->height,
 			   frame->title, &frame->title_rect,
-			   &frame->buttons, flags);
+			   &frame->buttons, flags, &frame->title_cache);
 	cairo_restore(cr);
 
 	wl_list_for_each(button, &frame->buttons, link)
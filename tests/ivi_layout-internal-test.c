@@ -491,6 +491,116 @@ test_get_layer_after_destory_layer(struct test_context *ctx)
 	iassert(ivilayer == NULL);
 }
 
+static void
+test_get_layer_from_id_many(struct test_context *ctx)
+{
+#define LAYER_NUM (64)
+	const struct ivi_layout_interface *lyt = ctx->layout_interface;
+	struct ivi_layout_layer *ivilayers[LAYER_NUM] = {};
+	uint32_t i;
+
+	for (i = 0; i < LAYER_NUM; i++) {
+		ivilayers[i] = lyt->layer_create_with_dimension(IVI_TEST_LAYER_ID(i), 200, 300);
+		iassert(ivilayers[i] != NULL);
+	}
+
+	for (i = 0; i < LAYER_NUM; i++)
+		iassert(lyt->get_layer_from_id(IVI_TEST_LAYER_ID(i)) == ivilayers[i]);
+
+	for (i = 0; i < LAYER_NUM; i += 2)
+		lyt->layer_destroy(ivilayers[i]);
+
+	for (i = 0; i < LAYER_NUM; i++) {
+		if (i % 2)
+			iassert(lyt->get_layer_from_id(IVI_TEST_LAYER_ID(i)) == ivilayers[i]);
+		else
+			iassert(lyt->get_layer_from_id(IVI_TEST_LAYER_ID(i)) == NULL);
+	}
+
+	for (i = 1; i < LAYER_NUM; i += 2)
+		lyt->layer_destroy(ivilayers[i]);
+
+	iassert(lyt->get_layer_from_id(IVI_TEST_LAYER_ID(1)) == NULL);
+
+#undef LAYER_NUM
+}
+
+struct layer_iterator_data {
+	struct ivi_layout_layer *layers[3];
+	int32_t count;
+};
+
+static void
+collect_layer(struct ivi_layout_layer *ivilayer, void *data)
+{
+	struct layer_iterator_data *iter = data;
+
+	if (iter->count < (int32_t)ARRAY_LENGTH(iter->layers))
+		iter->layers[iter->count] = ivilayer;
+	iter->count++;
+}
+
+static void
+count_surface(struct ivi_layout_surface *ivisurf, void *data)
+{
+	int32_t *count = data;
+
+	(*count)++;
+}
+
+static void
+test_screen_for_each_layer(struct test_context *ctx)
+{
+#define LAYER_NUM (3)
+	const struct ivi_layout_interface *lyt = ctx->layout_interface;
+	struct weston_output *output;
+	struct ivi_layout_layer *ivilayers[LAYER_NUM] = {};
+	struct layer_iterator_data iter = {};
+	int32_t surface_count = 0;
+	uint32_t i;
+
+	if (!iassert(!wl_list_empty(&ctx->compositor->output_list)))
+		return;
+
+	output = wl_container_of(ctx->compositor->output_list.next, output, link);
+
+	for (i = 0; i < LAYER_NUM; i++)
+		ivilayers[i] = lyt->layer_create_with_dimension(IVI_TEST_LAYER_ID(i), 200, 300);
+
+	iassert(lyt->screen_set_render_order(output, ivilayers, LAYER_NUM) == IVI_SUCCEEDED);
+
+	lyt->commit_changes();
+
+	iassert(lyt->for_each_layer_on_screen(output, collect_layer, &iter) == IVI_SUCCEEDED);
+	iassert(iter.count == LAYER_NUM);
+	for (i = 0; i < LAYER_NUM; i++)
+		iassert(iter.layers[i] == ivilayers[i]);
+
+	iassert(lyt->screen_set_render_order(output, NULL, 0) == IVI_SUCCEEDED);
+
+	lyt->commit_changes();
+
+	iter.count = 0;
+	iassert(lyt->for_each_layer_on_screen(output, collect_layer, &iter) == IVI_SUCCEEDED);
+	iassert(iter.count == 0);
+
+	iassert(lyt->for_each_layer_on_screen(NULL, collect_layer, &iter) == IVI_FAILED);
+	iassert(lyt->for_each_layer_on_screen(output, NULL, &iter) == IVI_FAILED);
+	iassert(lyt->for_each_surface_on_layer(NULL, NULL, NULL) == IVI_FAILED);
+	iassert(lyt->for_each_surface_on_layer(ivilayers[0], NULL, NULL) == IVI_FAILED);
+
+	/* Surfaces need clients, see ivi_layout-test-plugin.c; without
+	 * any the layer is walked without calling back. */
+	iassert(lyt->for_each_surface_on_layer(ivilayers[0], count_surface,
+					       &surface_count) == IVI_SUCCEEDED);
+	iassert(surface_count == 0);
+
+	for (i = 0; i < LAYER_NUM; i++)
+		lyt->layer_destroy(ivilayers[i]);
+
+#undef LAYER_NUM
+}
+
 static void
 test_screen_render_order(struct test_context *ctx)
 {
@@ -970,10 +1080,12 @@ run_internal_tests(void *data)
 	test_commit_changes_after_destination_rectangle_set_layer_destroy(ctx);
 	test_layer_create_duplicate(ctx);
 	test_get_layer_after_destory_layer(ctx);
+	test_get_layer_from_id_many(ctx);
 
 	test_screen_render_order(ctx);
 	test_screen_bad_render_order(ctx);
 	test_screen_add_layers(ctx);
+	test_screen_for_each_layer(ctx);
 	test_screen_remove_layer(ctx);
 	test_screen_bad_remove_layer(ctx);
 	test_commit_changes_after_render_order_set_layer_destroy(ctx);
@@ -844,6 +844,91 @@ RUNNER_TEST(layer_add_surfaces)
 	lyt->layer_destroy(ivilayer);
 }
 
+struct surface_iterator_data {
+	struct ivi_layout_surface *surfaces[IVI_TEST_SURFACE_COUNT];
+	int32_t count;
+};
+
+static void
+collect_surface(struct ivi_layout_surface *ivisurf, void *data)
+{
+	struct surface_iterator_data *iter = data;
+
+	if (iter->count < IVI_TEST_SURFACE_COUNT)
+		iter->surfaces[iter->count] = ivisurf;
+	iter->count++;
+}
+
+RUNNER_TEST(layer_for_each_surface)
+{
+	const struct ivi_layout_interface *lyt = ctx->layout_interface;
+	struct ivi_layout_layer *ivilayer;
+	struct ivi_layout_surface *ivisurfs[IVI_TEST_SURFACE_COUNT] = {};
+	struct surface_iterator_data iter = {};
+	uint32_t i;
+
+	ivilayer = lyt->layer_create_with_dimension(IVI_TEST_LAYER_ID(0), 200, 300);
+
+	for (i = 0; i < IVI_TEST_SURFACE_COUNT; i++) {
+		ivisurfs[i] = lyt->get_surface_from_id(IVI_TEST_SURFACE_ID(i));
+		runner_assert(ivisurfs[i] != NULL);
+		runner_assert(lyt->layer_add_surface(
+				      ivilayer, ivisurfs[i]) == IVI_SUCCEEDED);
+	}
+
+	/* Nothing shows before the changes are committed */
+	runner_assert(lyt->for_each_surface_on_layer(
+		      ivilayer, collect_surface, &iter) == IVI_SUCCEEDED);
+	runner_assert(iter.count == 0);
+
+	lyt->commit_changes();
+
+	runner_assert(lyt->for_each_surface_on_layer(
+		      ivilayer, collect_surface, &iter) == IVI_SUCCEEDED);
+	runner_assert(iter.count == IVI_TEST_SURFACE_COUNT);
+	for (i = 0; i < IVI_TEST_SURFACE_COUNT; i++)
+		runner_assert(iter.surfaces[i] == ivisurfs[i]);
+
+	lyt->layer_remove_surface(ivilayer, ivisurfs[1]);
+	lyt->commit_changes();
+
+	iter.count = 0;
+	runner_assert(lyt->for_each_surface_on_layer(
+		      ivilayer, collect_surface, &iter) == IVI_SUCCEEDED);
+	runner_assert(iter.count == IVI_TEST_SURFACE_COUNT - 1);
+	runner_assert(iter.surfaces[0] == ivisurfs[0]);
+	runner_assert(iter.surfaces[1] == ivisurfs[2]);
+
+	/* Off the layer, but still known by its id */
+	runner_assert(lyt->get_surface_from_id(
+		      IVI_TEST_SURFACE_ID(1)) == ivisurfs[1]);
+	runner_assert(lyt->get_layer_from_id(IVI_TEST_LAYER_ID(0)) == ivilayer);
+
+	lyt->layer_destroy(ivilayer);
+	runner_assert(lyt->get_layer_from_id(IVI_TEST_LAYER_ID(0)) == NULL);
+}
+
+RUNNER_TEST(layer_for_each_surface_destroy_one_surface)
+{
+	const struct ivi_layout_interface *lyt = ctx->layout_interface;
+	struct ivi_layout_layer *ivilayer;
+	struct surface_iterator_data iter = {};
+
+	ivilayer = lyt->get_layer_from_id(IVI_TEST_LAYER_ID(0));
+	runner_assert(ivilayer != NULL);
+
+	/* The destroyed surface is gone from the id lookup and the layer */
+	runner_assert(lyt->get_surface_from_id(IVI_TEST_SURFACE_ID(1)) == NULL);
+
+	runner_assert(lyt->for_each_surface_on_layer(
+		      ivilayer, collect_surface, &iter) == IVI_SUCCEEDED);
+	runner_assert(iter.count == 2);
+	runner_assert(iter.surfaces[0] ==
+		      lyt->get_surface_from_id(IVI_TEST_SURFACE_ID(0)));
+	runner_assert(iter.surfaces[1] ==
+		      lyt->get_surface_from_id(IVI_TEST_SURFACE_ID(2)));
+}
+
 RUNNER_TEST(commit_changes_after_render_order_set_surface_destroy)
 {
 	const struct ivi_layout_interface *lyt = ctx->layout_interface;
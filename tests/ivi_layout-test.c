@@ -213,6 +213,7 @@ const char * const render_order_test_names[] = {
 	"layer_render_order",
 	"layer_bad_render_order",
 	"layer_add_surfaces",
+	"layer_for_each_surface",
 };
 
 TEST_P(ivi_layout_runner, basic_test_names)
@@ -358,6 +359,7 @@ TEST(destroy_surface_after_layer_render_order)
 
 	ivi_window_destroy(winds[1]);
 
+	runner_run(runner, "layer_for_each_surface_destroy_one_surface");
 	runner_run(runner, "test_layer_render_order_destroy_one_surface_p2");
 
 	ivi_window_destroy(winds[0]);
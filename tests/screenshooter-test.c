@@ -0,0 +1,243 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+
+/* A region of the output, and the whole output through a stream, are
+ * captured from the same repaint and compared; then the stream is shot
+ * again on its own, which only reads back what was damaged since. */
+
+#define REGION_X 10
+#define REGION_Y 20
+#define REGION_WIDTH 64
+#define REGION_HEIGHT 32
+
+struct screenshooter_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	struct wl_client *client;
+	int client_fd;
+	struct weston_buffer *region_buffer;
+	struct weston_buffer *full_buffer;
+	struct weston_screenshooter_stream *stream;
+	int pending;
+	int stream_shots;
+};
+
+static struct weston_buffer *
+create_buffer(struct screenshooter_test *test, uint32_t id,
+	      int32_t width, int32_t height)
+{
+	struct wl_shm_buffer *shm;
+	struct wl_resource *resource;
+	struct weston_buffer *buffer;
+
+	shm = wl_shm_buffer_create(test->client, id, width, height,
+				   width * 4, WL_SHM_FORMAT_XRGB8888);
+	assert(shm);
+	resource = wl_client_get_object(test->client, id);
+	assert(resource);
+	buffer = weston_buffer_from_resource(resource);
+	assert(buffer);
+
+	return buffer;
+}
+
+static void
+expect_bad_buffer(void *data, enum weston_screenshooter_outcome outcome)
+{
+	int *called = data;
+
+	assert(outcome == WESTON_SCREENSHOOTER_BAD_BUFFER);
+	(*called)++;
+}
+
+static void
+check_region(struct screenshooter_test *test)
+{
+	struct wl_shm_buffer *region = test->region_buffer->shm_buffer;
+	struct wl_shm_buffer *full = test->full_buffer->shm_buffer;
+	uint8_t *r = wl_shm_buffer_get_data(region);
+	uint8_t *f = wl_shm_buffer_get_data(full);
+	int r_stride = wl_shm_buffer_get_stride(region);
+	int f_stride = wl_shm_buffer_get_stride(full);
+	int y;
+
+	for (y = 0; y < REGION_HEIGHT; y++)
+		assert(memcmp(r + y * r_stride,
+			      f + (REGION_Y + y) * f_stride + REGION_X * 4,
+			      REGION_WIDTH * 4) == 0);
+}
+
+static void
+finish(struct screenshooter_test *test)
+{
+	weston_screenshooter_stream_destroy(test->stream);
+	wl_client_destroy(test->client);
+	close(test->client_fd);
+
+	fprintf(stderr, "screenshooter test done\n");
+	wl_display_terminate(test->compositor->wl_display);
+	free(test);
+}
+
+static void
+region_done(void *data, enum weston_screenshooter_outcome outcome)
+{
+	struct screenshooter_test *test = data;
+
+	assert(outcome == WESTON_SCREENSHOOTER_SUCCESS);
+	test->pending--;
+}
+
+static void
+stream_done(void *data, enum weston_screenshooter_outcome outcome)
+{
+	struct screenshooter_test *test = data;
+	int called = 0;
+
+	assert(outcome == WESTON_SCREENSHOOTER_SUCCESS);
+	test->pending--;
+	test->stream_shots++;
+
+	if (test->stream_shots == 1) {
+		/* Both were read back from the same repaint */
+		assert(test->pending == 0);
+		check_region(test);
+
+		assert(weston_screenshooter_stream_shoot(test->stream,
+							 test->full_buffer,
+							 stream_done,
+							 test) == 0);
+		test->pending++;
+
+		/* Only one shot at a time per stream */
+		assert(weston_screenshooter_stream_shoot(test->stream,
+							 test->full_buffer,
+							 expect_bad_buffer,
+							 &called) < 0);
+		assert(called == 1);
+		return;
+	}
+
+	finish(test);
+}
+
+static void
+screenshooter_test_run(void *data)
+{
+	struct screenshooter_test *test = data;
+	struct weston_output *output;
+	int width, height;
+	int called = 0;
+
+	assert(!wl_list_empty(&test->compositor->output_list));
+	output = container_of(test->compositor->output_list.next,
+			      struct weston_output, link);
+	test->output = output;
+	width = output->current_mode->width;
+	height = output->current_mode->height;
+	assert(width >= REGION_X + REGION_WIDTH &&
+	       height >= REGION_Y + REGION_HEIGHT);
+
+	test->region_buffer = create_buffer(test, 1000,
+					    REGION_WIDTH, REGION_HEIGHT);
+	test->full_buffer = create_buffer(test, 1001, width, height);
+
+	/* Rectangles reaching outside the output or the buffer */
+	assert(weston_screenshooter_shoot_region(output, test->region_buffer,
+						 width - REGION_WIDTH + 1, 0,
+						 REGION_WIDTH, REGION_HEIGHT,
+						 expect_bad_buffer,
+						 &called) < 0);
+	assert(weston_screenshooter_shoot_region(output, test->region_buffer,
+						 -1, 0,
+						 REGION_WIDTH, REGION_HEIGHT,
+						 expect_bad_buffer,
+						 &called) < 0);
+	assert(weston_screenshooter_shoot_region(output, test->region_buffer,
+						 0, 0,
+						 REGION_WIDTH + 1, REGION_HEIGHT,
+						 expect_bad_buffer,
+						 &called) < 0);
+	assert(called == 3);
+
+	/* Subscribed after the region shot, so finished after it too */
+	assert(weston_screenshooter_shoot_region(output, test->region_buffer,
+						 REGION_X, REGION_Y,
+						 REGION_WIDTH, REGION_HEIGHT,
+						 region_done, test) == 0);
+	test->pending++;
+
+	test->stream = weston_screenshooter_stream_create(output);
+	assert(test->stream);
+	assert(weston_screenshooter_stream_shoot(test->stream,
+						 test->full_buffer,
+						 stream_done, test) == 0);
+	test->pending++;
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	struct screenshooter_test *test;
+	struct wl_event_loop *loop;
+	int fds[2];
+
+	test = zalloc(sizeof *test);
+	if (test == NULL)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		free(test);
+		return -1;
+	}
+
+	test->compositor = compositor;
+	test->client_fd = fds[1];
+	test->client = wl_client_create(compositor->wl_display, fds[0]);
+	if (test->client == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		free(test);
+		return -1;
+	}
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, screenshooter_test_run, test);
+
+	return 0;
+}
@@ -36,6 +36,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
@@ -98,114 +99,437 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+/* The conversion kernels work on four pixels at a time using the
+ * compiler's generic vector extension, which maps to SSE2 or NEON
+ * depending on the target.  They give the same results as
+ * rgb_to_yuv(), which is used for the pixels left over at the end of
+ * a row. */
+typedef int32_t v4si __attribute__ ((vector_size (16)));
+
+static inline v4si
+rgb_to_yuv_v4(v4si p, int rshift, int bshift, v4si *r, v4si *b)
+{
+	v4si g;
+
+	*r = (p >> rshift) & 0xff;
+	g = (p >> 8) & 0xff;
+	*b = (p >> bshift) & 0xff;
+
+	/* The coefficients add up to 65536, so y never exceeds 255 */
+	return (19595 * *r + 38469 * g + 7472 * *b) >> 16;
+}
+
+static inline v4si
+clamp_uv_v4(v4si u)
+{
+	v4si zero = { 0, 0, 0, 0 };
+	v4si c, m;
+
+	c = (u >> 18) + 128;
+	c &= ~(c < zero);
+	m = c > 255;
+
+	return (c & ~m) | (m & 255);
+}
+
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+get_channel_shifts(uint32_t format, int *rshift, int *bshift)
+{
+	switch (format) {
+	case WCAP_FORMAT_XRGB8888:
+		*rshift = 16;
+		*bshift = 0;
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		*rshift = 0;
+		*bshift = 16;
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static void
+convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out,
+		int first, int last)
 {
 	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
+	uint32_t *p1, *p2;
+	int i, x, k, u_accum, v_accum, stride0, stride1, rshift, bshift;
 	uint32_t format = decoder->format;
+	v4si a, b, c, d, ya, yb, yc, yd, r, bl, cu, cv;
+
+	get_channel_shifts(format, &rshift, &bshift);
 
 	stride0 = decoder->width;
 	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
+	for (i = first; i < last; i += 2) {
 		y1 = out + stride0 * i;
 		y2 = y1 + stride0;
 		v = out + stride0 * decoder->height + stride1 * i / 2;
 		u = v + stride1 * decoder->height / 2;
 		p1 = decoder->frame + decoder->width * i;
 		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
 
-		while (p1 < end) {
+		/* Four 2x2 blocks per iteration */
+		for (x = 0; x + 8 <= decoder->width; x += 8) {
+			a = (v4si) { p1[x], p1[x + 2], p1[x + 4], p1[x + 6] };
+			b = (v4si) { p1[x + 1], p1[x + 3], p1[x + 5], p1[x + 7] };
+			c = (v4si) { p2[x], p2[x + 2], p2[x + 4], p2[x + 6] };
+			d = (v4si) { p2[x + 1], p2[x + 3], p2[x + 5], p2[x + 7] };
+
+			ya = rgb_to_yuv_v4(a, rshift, bshift, &r, &bl);
+			cu = 46727 * (r - ya);
+			cv = 36962 * (bl - ya);
+			yb = rgb_to_yuv_v4(b, rshift, bshift, &r, &bl);
+			cu += 46727 * (r - yb);
+			cv += 36962 * (bl - yb);
+			yc = rgb_to_yuv_v4(c, rshift, bshift, &r, &bl);
+			cu += 46727 * (r - yc);
+			cv += 36962 * (bl - yc);
+			yd = rgb_to_yuv_v4(d, rshift, bshift, &r, &bl);
+			cu += 46727 * (r - yd);
+			cv += 36962 * (bl - yd);
+
+			cu = clamp_uv_v4(cu);
+			cv = clamp_uv_v4(cv);
+
+			for (k = 0; k < 4; k++) {
+				y1[x + 2 * k] = ya[k];
+				y1[x + 2 * k + 1] = yb[k];
+				y2[x + 2 * k] = yc[k];
+				y2[x + 2 * k + 1] = yd[k];
+				u[x / 2 + k] = cu[k];
+				v[x / 2 + k] = cv[k];
+			}
+		}
+
+		for (; x < decoder->width; x += 2) {
 			u_accum = 0;
 			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
+			y1[x] = rgb_to_yuv(format, p1[x], &u_accum, &v_accum);
+			y1[x + 1] = rgb_to_yuv(format, p1[x + 1],
+					       &u_accum, &v_accum);
+			y2[x] = rgb_to_yuv(format, p2[x], &u_accum, &v_accum);
+			y2[x + 1] = rgb_to_yuv(format, p2[x + 1],
+					       &u_accum, &v_accum);
+			u[x / 2] = clamp_uv(u_accum);
+			v[x / 2] = clamp_uv(v_accum);
 		}
 	}
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out,
+		  int first, int last)
 {
-
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
+	uint32_t *rp;
 	int u, v;
-	int i, stride, psize;
+	int i, x, k, stride, psize, rshift, bshift;
 	uint32_t format = decoder->format;
+	v4si p, y, r, b, cu, cv;
+
+	get_channel_shifts(format, &rshift, &bshift);
 
 	stride = decoder->width;
 	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
+	for (i = first; i < last; i++) {
 		yp = out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
 		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
-		while (rp < end) {
+
+		for (x = 0; x + 4 <= decoder->width; x += 4) {
+			p = (v4si) { rp[x], rp[x + 1], rp[x + 2], rp[x + 3] };
+			y = rgb_to_yuv_v4(p, rshift, bshift, &r, &b);
+			cu = 46727 * (r - y);
+			cv = 36962 * (b - y);
+			for (k = 0; k < 4; k++) {
+				yp[x + k] = y[k];
+				up[x + k] = clamp_uv(cu[k]/.3);
+				vp[x + k] = clamp_uv(cv[k]/.3);
+			}
+		}
+
+		for (; x < decoder->width; x++) {
 			u = 0;
 			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
+			yp[x] = rgb_to_yuv(format, rp[x], &u, &v);
+			up[x] = clamp_uv(u/.3);
+			vp[x] = clamp_uv(v/.3);
 		}
 	}
 }
 
+/* Converting a frame is split into bands of rows, one per thread.  The
+ * main thread decodes the next frame only after all bands are done, as
+ * decoding updates the frame in place. */
+#define MAX_CONVERTER_THREADS 16
+
+struct yuv_converter;
+
+struct yuv_band {
+	struct yuv_converter *converter;
+	pthread_t thread;
+	int first, last;
+};
+
+struct yuv_converter {
+	struct wcap_decoder *decoder;
+	unsigned char *out;
+	int depth;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	uint32_t generation;
+	int pending;
+	int quit;
+
+	int nbands, nthreads;
+	struct yuv_band bands[MAX_CONVERTER_THREADS];
+};
+
 static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+convert_band(struct yuv_converter *converter, struct yuv_band *band)
 {
-	static unsigned char *out;
-	int size;
+	if (converter->depth == 444)
+		convert_to_yuv444(converter->decoder, converter->out,
+				  band->first, band->last);
+	else
+		convert_to_yv12(converter->decoder, converter->out,
+				band->first, band->last);
+}
+
+static void *
+yuv_converter_thread(void *data)
+{
+	struct yuv_band *band = data;
+	struct yuv_converter *converter = band->converter;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&converter->mutex);
+	for (;;) {
+		while (converter->generation == generation &&
+		       !converter->quit)
+			pthread_cond_wait(&converter->start_cond,
+					  &converter->mutex);
+		if (converter->quit)
+			break;
 
-	if (depth == 444) {
+		generation = converter->generation;
+		pthread_mutex_unlock(&converter->mutex);
+
+		convert_band(converter, band);
+
+		pthread_mutex_lock(&converter->mutex);
+		if (--converter->pending == 0)
+			pthread_cond_signal(&converter->done_cond);
+	}
+	pthread_mutex_unlock(&converter->mutex);
+
+	return NULL;
+}
+
+static void
+yuv_converter_destroy(struct yuv_converter *converter);
+
+static struct yuv_converter *
+yuv_converter_create(struct wcap_decoder *decoder, int depth, int nthreads)
+{
+	struct yuv_converter *converter;
+	int i, rows, size;
+
+	converter = calloc(1, sizeof *converter);
+	if (converter == NULL)
+		return NULL;
+
+	if (depth == 444)
 		size = decoder->width * decoder->height * 3;
-	} else {
+	else
 		size = decoder->width * decoder->height * 3 / 2;
+
+	converter->out = malloc(size);
+	if (converter->out == NULL) {
+		free(converter);
+		return NULL;
 	}
-	if (out == NULL)
-		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
+	converter->decoder = decoder;
+	converter->depth = depth;
+	pthread_mutex_init(&converter->mutex, NULL);
+	pthread_cond_init(&converter->start_cond, NULL);
+	pthread_cond_init(&converter->done_cond, NULL);
+
+	if (nthreads > MAX_CONVERTER_THREADS)
+		nthreads = MAX_CONVERTER_THREADS;
+	if (nthreads > decoder->height / 2)
+		nthreads = decoder->height / 2;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	/* Bands start on even rows, so 4:2:0 blocks never straddle two */
+	rows = ((decoder->height + nthreads - 1) / nthreads + 1) & ~1;
+	for (i = 0; i < nthreads && i * rows < decoder->height; i++) {
+		converter->bands[i].converter = converter;
+		converter->bands[i].first = i * rows;
+		converter->bands[i].last = (i + 1) * rows;
+		if (converter->bands[i].last > decoder->height)
+			converter->bands[i].last = decoder->height;
+	}
+	converter->nbands = i;
+
+	if (converter->nbands == 1)
+		return converter;
+
+	for (i = 0; i < converter->nbands; i++) {
+		if (pthread_create(&converter->bands[i].thread, NULL,
+				   yuv_converter_thread,
+				   &converter->bands[i]) != 0) {
+			yuv_converter_destroy(converter);
+			return NULL;
+		}
+		converter->nthreads++;
+	}
+
+	return converter;
+}
+
+static void
+yuv_converter_destroy(struct yuv_converter *converter)
+{
+	int i;
+
+	pthread_mutex_lock(&converter->mutex);
+	converter->quit = 1;
+	pthread_cond_broadcast(&converter->start_cond);
+	pthread_mutex_unlock(&converter->mutex);
+
+	for (i = 0; i < converter->nthreads; i++)
+		pthread_join(converter->bands[i].thread, NULL);
+
+	pthread_cond_destroy(&converter->done_cond);
+	pthread_cond_destroy(&converter->start_cond);
+	pthread_mutex_destroy(&converter->mutex);
+	free(converter->out);
+	free(converter);
+}
+
+static void
+output_yuv_frame(struct yuv_converter *converter)
+{
+	struct wcap_decoder *decoder = converter->decoder;
+	int size;
+
+	if (converter->depth == 444)
+		size = decoder->width * decoder->height * 3;
+	else
+		size = decoder->width * decoder->height * 3 / 2;
+
+	if (converter->nbands == 1) {
+		convert_band(converter, &converter->bands[0]);
 	} else {
-		convert_to_yv12(decoder, out);
+		pthread_mutex_lock(&converter->mutex);
+		converter->generation++;
+		converter->pending = converter->nbands;
+		pthread_cond_broadcast(&converter->start_cond);
+		while (converter->pending > 0)
+			pthread_cond_wait(&converter->done_cond,
+					  &converter->mutex);
+		pthread_mutex_unlock(&converter->mutex);
 	}
 
 	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	fwrite(converter->out, 1, size, stdout);
+}
+
+/* Write the rectangles that changed in the frame, each followed by its
+ * pixels, top row first. */
+static void
+output_stream_frame(struct wcap_decoder *decoder,
+		    const struct wcap_frame *frame)
+{
+	const struct wcap_rectangle *r;
+	uint32_t i;
+	int y;
+
+	fwrite(&frame->msecs, sizeof frame->msecs, 1, stdout);
+	fwrite(&frame->nrects, sizeof frame->nrects, 1, stdout);
+	for (i = 0; i < frame->nrects; i++) {
+		r = &frame->rects[i];
+		fwrite(r, sizeof *r, 1, stdout);
+		for (y = r->y1; y < r->y2; y++)
+			fwrite(decoder->frame + y * decoder->width + r->x1,
+			       4, r->x2 - r->x1, stdout);
+	}
+}
+
+static int
+output_stream(struct wcap_decoder *decoder)
+{
+	struct wcap_header header;
+	struct wcap_frame frame;
+	int count = 0;
+
+	header.magic = WCAP_STREAM_MAGIC;
+	header.format = decoder->format;
+	header.width = decoder->width;
+	header.height = decoder->height;
+	fwrite(&header, sizeof header, 1, stdout);
+
+	while (wcap_decoder_next_frame(decoder, &frame)) {
+		wcap_decoder_apply_frame(decoder, &frame);
+		output_stream_frame(decoder, &frame);
+		count++;
+	}
+
+	return count;
+}
+
+/* Frames are numbered at the replay rate, find the recorded frame shown
+ * as the given one: the first one at or after its time. */
+static int
+find_frame(struct wcap_decoder *decoder, int output_frame, uint32_t frame_time)
+{
+	uint32_t msecs, first, last, mid;
+
+	if (decoder->nframes == 0)
+		return -1;
+	if (output_frame == 0)
+		return 0;
+
+	msecs = decoder->index[0].msecs + output_frame * frame_time;
+	first = 1;
+	last = decoder->nframes;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if (decoder->index[mid].msecs < msecs)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	return first < decoder->nframes ? (int) first : -1;
 }
 
 static void
 usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
-		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] [--stream]\n"
+		"\t[--rate=<num:denom>] [--threads=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
+		"\t--stream\t\twrite the changed regions of every frame\n"
+		"\t\t\t\tto stdout\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tnumber of threads converting to yuv,\n"
+		"\t\t\t\tdefaults to the number of CPUs\n\n");
 
 	exit(exit_code);
 }
@@ -213,8 +537,10 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct yuv_converter *converter = NULL;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	int stream = 0;
+	int num = 30, denom = 1, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 	char filename[200];
 	char *mode;
 	uint32_t msecs, frame_time;
@@ -228,12 +554,16 @@ int main(int argc, char *argv[])
 			usage(EXIT_SUCCESS);
 		} else if (strcmp(argv[i], "--all") == 0) {
 			all = 1;
+		} else if (strcmp(argv[i], "--stream") == 0) {
+			stream = 1;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -268,7 +598,49 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (stream) {
+		if (isatty(1)) {
+			fprintf(stderr, "Not writing stream to terminal.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		i = output_stream(decoder);
+		fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
+			decoder->width, decoder->height, i);
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
+	}
+
+	frame_time = 1000 * denom / num;
+
+	/* With an index, a single frame can be decoded starting from the
+	 * nearest keyframe */
+	if (output_frame >= 0 && !all && !yuv4mpeg2 && decoder->index) {
+		i = find_frame(decoder, output_frame, frame_time);
+		if (i < 0 || !wcap_decoder_seek(decoder, i)) {
+			fprintf(stderr, "no frame %d in wcap file\n",
+				output_frame);
+			wcap_decoder_destroy(decoder);
+			exit(EXIT_FAILURE);
+		}
+
+		snprintf(filename, sizeof filename,
+			 "wcap-frame-%d.png", output_frame);
+		write_png(decoder, filename);
+		fprintf(stderr, "wrote %s\n", filename);
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
+	}
+
 	if (yuv4mpeg2) {
+		converter = yuv_converter_create(decoder, yuv4mpeg2, nthreads);
+		if (converter == NULL) {
+			fprintf(stderr, "Creating yuv converter failed\n");
+			exit(EXIT_FAILURE);
+		}
+
 		if (yuv4mpeg2 == 444) {
 			mode = "C444";
 		} else {
@@ -282,7 +654,6 @@ int main(int argc, char *argv[])
 	i = 0;
 	has_frame = wcap_decoder_get_frame(decoder);
 	msecs = decoder->msecs;
-	frame_time = 1000 * denom / num;
 	while (has_frame) {
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
@@ -291,7 +662,7 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "wrote %s\n", filename);
 		}
 		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
+			output_yuv_frame(converter);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
@@ -301,6 +672,8 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
 
+	if (converter)
+		yuv_converter_destroy(converter);
 	wcap_decoder_destroy(decoder);
 
 	return EXIT_SUCCESS;
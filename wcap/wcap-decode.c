@@ -29,7 +29,6 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/mman.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -38,75 +37,390 @@
 
 #include <cairo.h>
 
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
 #include "wcap-decode.h"
 
+static inline int
+wcap_run_length(uint32_t v)
+{
+	int l = v >> 24;
+
+	if (l < 0xe0)
+		return l + 1;
+	else
+		return 1 << (l - 0xe0 + 7);
+}
+
+/* Add a delta to each of the color components of n pixels, without
+ * carrying from one component to the next.  Runs are applied four
+ * pixels at a time as 16 byte vectors, which the compiler maps to
+ * SSE2 or NEON; long runs are common as most of a damaged rectangle
+ * is usually unchanged or filled with one color. */
+typedef uint8_t v16qu __attribute__ ((vector_size (16)));
+
+static inline uint32_t
+wcap_add_delta(uint32_t p, uint32_t delta)
+{
+	uint32_t sum;
+
+	sum = (p & 0x7f7f7f) + (delta & 0x7f7f7f);
+	sum ^= (p ^ delta) & 0x808080;
+
+	return 0xff000000 | sum;
+}
+
 static void
+wcap_apply_run(uint32_t *d, int n, uint32_t delta)
+{
+	uint32_t words[4];
+	v16qu v, vdelta, valpha;
+	int i;
+
+	delta &= 0xffffff;
+	if (n >= 4) {
+		words[0] = words[1] = words[2] = words[3] = delta;
+		memcpy(&vdelta, words, sizeof vdelta);
+		words[0] = words[1] = words[2] = words[3] = 0xff000000;
+		memcpy(&valpha, words, sizeof valpha);
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		memcpy(&v, d + i, sizeof v);
+		v = (v + vdelta) | valpha;
+		memcpy(d + i, &v, sizeof v);
+	}
+
+	for (; i < n; i++)
+		d[i] = wcap_add_delta(d[i], delta);
+}
+
+static const uint32_t *
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
-			      struct wcap_rectangle *rect)
+			      const struct wcap_rectangle *rect,
+			      const uint32_t *p, const uint32_t *end)
 {
-	uint32_t v, *p = decoder->p, *d;
+	uint32_t v, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
 	i = 0;
-	while (i < count) {
+	while (i < count && p < end) {
 		v = *p++;
-		l = v >> 24;
-		if (l < 0xe0) {
-			j = l + 1;
-		} else {
-			j = 1 << (l - 0xe0 + 7);
-		}
+		j = wcap_run_length(v);
+		i += j;
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		/* Runs continue on the row above at the end of a row */
+		while (j > 0 && d >= decoder->frame) {
+			n = MIN(j, rect->x2 - x);
+			wcap_apply_run(d + x, n, v);
+			j -= n;
+			x += n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
 			}
 		}
-		i += j;
 	}
 
 	if (i != count)
-		printf("rle encoding longer than expected (%d expected %d)\n",
-		       i, count);
+		fprintf(stderr,
+			"rle encoding %s than expected (%d expected %d)\n",
+			i < count ? "shorter" : "longer", i, count);
+
+	return p;
+}
+
+/* Find the end of the run-length encoded data of a rectangle */
+static const uint32_t *
+wcap_skip_rectangle(const struct wcap_rectangle *rect, const uint32_t *p,
+		    const uint32_t *end)
+{
+	int64_t i = 0, count;
+
+	count = (int64_t) (rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+	while (i < count && p < end)
+		i += wcap_run_length(*p++);
+
+	return p;
+}
+
+/* Rectangles have to lie within the frame, they are decoded into it */
+static int
+wcap_decoder_check_rectangles(struct wcap_decoder *decoder,
+			      const struct wcap_rectangle *rects,
+			      uint32_t nrects)
+{
+	uint32_t i;
+
+	for (i = 0; i < nrects; i++) {
+		if (rects[i].x1 < 0 || rects[i].y1 < 0 ||
+		    rects[i].x1 > rects[i].x2 || rects[i].y1 > rects[i].y2 ||
+		    rects[i].x2 > decoder->width ||
+		    rects[i].y2 > decoder->height) {
+			fprintf(stderr, "frame %u: rectangle %d,%d-%d,%d "
+				"outside of %dx%d\n", decoder->count,
+				rects[i].x1, rects[i].y1,
+				rects[i].x2, rects[i].y2,
+				decoder->width, decoder->height);
+			return -1;
+		}
+	}
 
-	decoder->p = p;
+	return 0;
 }
 
+/** Read the next frame without decoding it
+ *
+ * The rectangles and their run-length encoded data in \p frame point
+ * into the mapping of the file and stay valid until the decoder is
+ * destroyed.  Pass the frame to wcap_decoder_apply_frame() to update
+ * decoder->frame, after which the pixels of each rectangle are
+ * available there.
+ *
+ * \return 1 on success, 0 at the end of the file or at a frame with
+ * rectangles outside of the recorded area.
+ */
 int
-wcap_decoder_get_frame(struct wcap_decoder *decoder)
+wcap_decoder_next_frame(struct wcap_decoder *decoder,
+			struct wcap_frame *frame)
 {
-	struct wcap_rectangle *rects;
-	struct wcap_frame_header *header;
+	const struct wcap_frame_header *header;
+	struct wcap_frame_header_v2 *header_v2;
+	const struct wcap_rectangle *rects;
+	const uint32_t *next;
+	size_t avail;
 	uint32_t i;
 
-	if (decoder->p == decoder->end)
+	/* Skipping a v1 frame still means walking its data */
+	if (decoder->unapplied) {
+		header = decoder->unapplied;
+		rects = (const void *) (header + 1);
+		next = (const void *) (rects + header->nrects);
+		for (i = 0; i < header->nrects; i++)
+			next = wcap_skip_rectangle(&rects[i], next,
+						   decoder->end);
+		decoder->p = (void *) next;
+		decoder->unapplied = NULL;
+	}
+
+	avail = (char *) decoder->end - (char *) decoder->p;
+
+	if (decoder->magic == WCAP_HEADER_MAGIC_V2) {
+		if (avail < sizeof *header_v2)
+			return 0;
+
+		header_v2 = decoder->p;
+		if (header_v2->size > avail - sizeof *header_v2 ||
+		    header_v2->nrects >
+		    header_v2->size / sizeof(struct wcap_rectangle))
+			return 0;
+
+		next = (void *) ((char *) (header_v2 + 1) + header_v2->size);
+
+		frame->msecs = header_v2->msecs;
+		frame->flags = header_v2->flags;
+		frame->nrects = header_v2->nrects;
+		frame->rects = (void *) (header_v2 + 1);
+		frame->data = (void *) (frame->rects + frame->nrects);
+		frame->end = next;
+	} else {
+		if (avail < sizeof *header)
+			return 0;
+
+		header = decoder->p;
+		if (header->nrects > (avail - sizeof *header) /
+				     sizeof(struct wcap_rectangle))
+			return 0;
+
+		frame->msecs = header->msecs;
+		frame->flags = 0;
+		frame->nrects = header->nrects;
+		frame->rects = (void *) (header + 1);
+		frame->data = (void *) (frame->rects + frame->nrects);
+		frame->end = decoder->end;
+
+		/* Decoding finds the end of the frame on the way, see
+		 * wcap_decoder_apply_frame(). */
+		next = NULL;
+		decoder->unapplied = header;
+	}
+
+	if (wcap_decoder_check_rectangles(decoder, frame->rects,
+					  frame->nrects) < 0) {
+		decoder->unapplied = NULL;
 		return 0;
+	}
 
-	header = decoder->p;
-	decoder->msecs = header->msecs;
+	decoder->msecs = frame->msecs;
 	decoder->count++;
+	if (next)
+		decoder->p = (void *) next;
+
+	return 1;
+}
+
+/** Update decoder->frame with a frame from wcap_decoder_next_frame() */
+void
+wcap_decoder_apply_frame(struct wcap_decoder *decoder,
+			 const struct wcap_frame *frame)
+{
+	const uint32_t *p = frame->data;
+	uint32_t i;
+
+	/* Keyframes are encoded against a black frame */
+	if (frame->flags & WCAP_FRAME_KEYFRAME)
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+
+	for (i = 0; i < frame->nrects; i++)
+		p = wcap_decoder_decode_rectangle(decoder,
+						  &frame->rects[i], p,
+						  frame->end);
 
-	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
-		wcap_decoder_decode_rectangle(decoder, &rects[i]);
+	/* The next v1 frame starts where this one's data ended */
+	if (decoder->unapplied &&
+	    frame->rects == (const void *) (decoder->unapplied + 1)) {
+		decoder->p = (void *) p;
+		decoder->unapplied = NULL;
+	}
+}
+
+int
+wcap_decoder_get_frame(struct wcap_decoder *decoder)
+{
+	struct wcap_frame frame;
+
+	if (!wcap_decoder_next_frame(decoder, &frame))
+		return 0;
+
+	wcap_decoder_apply_frame(decoder, &frame);
+
+	return 1;
+}
+
+/** Decode the given frame, counting from 0
+ *
+ * For v2 files this starts from the closest keyframe before the frame,
+ * unless the decoder is already between that keyframe and the frame.
+ * v1 files have no keyframes and are replayed from the start when
+ * seeking backwards.
+ *
+ * \return 1 on success, 0 if the file has fewer frames.
+ */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame)
+{
+	struct wcap_header *header = decoder->map;
+	uint32_t key = 0;
+	void *p = header + 1;
+
+	if (decoder->index) {
+		if (frame >= decoder->nframes)
+			return 0;
+
+		key = frame;
+		while (key > 0 &&
+		       !(decoder->index[key].flags & WCAP_FRAME_KEYFRAME))
+			key--;
+
+		p = (char *) decoder->map + decoder->index[key].offset;
+	}
+
+	if (decoder->count == 0 || decoder->count - 1 > frame ||
+	    decoder->count < key + 1) {
+		decoder->p = p;
+		decoder->unapplied = NULL;
+		decoder->count = key;
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+	}
+
+	while (decoder->count <= frame)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
 
 	return 1;
 }
 
+/* Recordings that were interrupted have no index, rebuild it from the
+ * frame sizes. */
+static int
+wcap_decoder_scan_index(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_header_v2 *header;
+	struct wcap_index_entry *index = NULL, *entry;
+	char *p = decoder->p, *end = decoder->end;
+	uint32_t size = 0;
+
+	decoder->nframes = 0;
+	while (p + sizeof *header <= end) {
+		header = (void *) p;
+		if (p + sizeof *header + header->size > end)
+			break;
+
+		if (decoder->nframes == size) {
+			size = size ? size * 2 : 256;
+			entry = realloc(index, size * sizeof *index);
+			if (entry == NULL) {
+				free(index);
+				return -1;
+			}
+			index = entry;
+		}
+
+		entry = &index[decoder->nframes++];
+		entry->offset = p - (char *) decoder->map;
+		entry->msecs = header->msecs;
+		entry->flags = header->flags;
+
+		p += sizeof *header + header->size;
+	}
+
+	decoder->index_data = index;
+	decoder->index = index;
+	decoder->end = p;
+
+	return 0;
+}
+
+/* The index and its trailer hold 64 bit words, but frames and thus the
+ * index are only 4 byte aligned in the file; copy them out rather than
+ * reading them in place. */
+static int
+wcap_decoder_load_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer trailer;
+	size_t size;
+
+	if (decoder->size < sizeof(struct wcap_header) + sizeof trailer)
+		return wcap_decoder_scan_index(decoder);
+
+	memcpy(&trailer, (char *) decoder->map +
+	       decoder->size - sizeof trailer, sizeof trailer);
+	if (trailer.magic != WCAP_INDEX_MAGIC ||
+	    trailer.offset < sizeof(struct wcap_header) ||
+	    trailer.offset + (uint64_t) trailer.nframes *
+	    sizeof(struct wcap_index_entry) + sizeof trailer !=
+	    decoder->size)
+		return wcap_decoder_scan_index(decoder);
+
+	size = trailer.nframes * sizeof(struct wcap_index_entry);
+	decoder->index_data = malloc(size ? size : 1);
+	if (decoder->index_data == NULL)
+		return -1;
+
+	memcpy(decoder->index_data,
+	       (char *) decoder->map + trailer.offset, size);
+	decoder->index = decoder->index_data;
+	decoder->nframes = trailer.nframes;
+	decoder->end = (char *) decoder->map + trailer.offset;
+
+	return 0;
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
@@ -115,7 +429,7 @@ wcap_decoder_create(const char *filename)
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = zalloc(sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -127,16 +441,29 @@ wcap_decoder_create(const char *filename)
 
 	fstat(decoder->fd, &buf);
 	decoder->size = buf.st_size;
+	if (decoder->size < sizeof *header) {
+		fprintf(stderr, "file too short\n");
+		goto err_fd;
+	}
+
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
-		close(decoder->fd);
-		free(decoder);
-		return NULL;
+		goto err_fd;
 	}
 
+	/* Frames are mostly decoded front to back, straight from the map */
+	madvise(decoder->map, decoder->size, MADV_SEQUENTIAL);
+
 	header = decoder->map;
+	if (header->magic != WCAP_HEADER_MAGIC &&
+	    header->magic != WCAP_HEADER_MAGIC_V2) {
+		fprintf(stderr, "not a wcap file\n");
+		goto err_map;
+	}
+
+	decoder->magic = header->magic;
 	decoder->format = header->format;
 	decoder->count = 0;
 	decoder->width = header->width;
@@ -144,16 +471,25 @@ wcap_decoder_create(const char *filename)
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
 
+	if (decoder->magic == WCAP_HEADER_MAGIC_V2 &&
+	    wcap_decoder_load_index(decoder) < 0)
+		goto err_map;
+
 	frame_size = header->width * header->height * 4;
-	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		close(decoder->fd);
-		free(decoder);
-		return NULL;
-	}
-	memset(decoder->frame, 0, frame_size);
+	decoder->frame = zalloc(frame_size);
+	if (decoder->frame == NULL)
+		goto err_index;
 
 	return decoder;
+
+err_index:
+	free(decoder->index_data);
+err_map:
+	munmap(decoder->map, decoder->size);
+err_fd:
+	close(decoder->fd);
+	free(decoder);
+	return NULL;
 }
 
 void
@@ -161,6 +497,7 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->index_data);
 	free(decoder->frame);
 	free(decoder);
 }
@@ -29,6 +29,9 @@
 #include <stdint.h>
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+#define WCAP_INDEX_MAGIC	0x57434958
+#define WCAP_STREAM_MAGIC	0x57435253
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -46,6 +49,27 @@ struct wcap_frame_header {
 	uint32_t nrects;
 };
 
+#define WCAP_FRAME_KEYFRAME	(1 << 0)
+
+struct wcap_frame_header_v2 {
+	uint32_t msecs;
+	uint32_t nrects;
+	uint32_t flags;
+	uint32_t size;	/* bytes following this header */
+};
+
+struct wcap_index_entry {
+	uint64_t offset;
+	uint32_t msecs;
+	uint32_t flags;
+};
+
+struct wcap_index_trailer {
+	uint32_t magic;
+	uint32_t nframes;
+	uint64_t offset;	/* of the first wcap_index_entry */
+};
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
@@ -55,13 +79,39 @@ struct wcap_decoder {
 	size_t size;
 	void *map, *p, *end;
 	uint32_t *frame;
+	uint32_t magic;
 	uint32_t format;
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
+
+	/* v1 files only: a frame returned by wcap_decoder_next_frame()
+	 * that was not applied yet.  Where the next frame starts is only
+	 * known once its data has been walked. */
+	const struct wcap_frame_header *unapplied;
+
+	/* v2 files only: one entry per frame, NULL for v1 files */
+	const struct wcap_index_entry *index;
+	struct wcap_index_entry *index_data;
+	uint32_t nframes;
+};
+
+/* A frame as stored in the file, pointing into the decoder's mapping */
+struct wcap_frame {
+	uint32_t msecs;
+	uint32_t flags;
+	uint32_t nrects;
+	const struct wcap_rectangle *rects;
+	const uint32_t *data;	/* run-length encoded deltas of all rects */
+	const void *end;	/* how far data may reach */
 };
 
+int wcap_decoder_next_frame(struct wcap_decoder *decoder,
+			    struct wcap_frame *frame);
+void wcap_decoder_apply_frame(struct wcap_decoder *decoder,
+			      const struct wcap_frame *frame);
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
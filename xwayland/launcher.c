@@ -43,9 +43,8 @@
 #include "compositor/weston.h"
 
 static int
-weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+weston_xserver_spawn(struct weston_xserver *wxs)
 {
-	struct weston_xserver *wxs = data;
 	char display[8];
 
 	snprintf(display, sizeof display, ":%d", wxs->display);
@@ -53,16 +52,69 @@ weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
 	wxs->pid = wxs->spawn_func(wxs->user_data, display, wxs->abstract_fd, wxs->unix_fd);
 	if (wxs->pid == -1) {
 		weston_log("Failed to spawn the Xwayland server\n");
-		return 1;
+		wxs->pid = 0;
+		return -1;
 	}
 
 	weston_log("Spawned Xwayland server, pid %d\n", wxs->pid);
 	wl_event_source_remove(wxs->abstract_source);
 	wl_event_source_remove(wxs->unix_source);
 
+	return 0;
+}
+
+static int
+weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+{
+	struct weston_xserver *wxs = data;
+
+	weston_xserver_spawn(wxs);
+
 	return 1;
 }
 
+static int
+weston_xserver_idle_handler(void *data)
+{
+	struct weston_xserver *wxs = data;
+	int clients;
+
+	if (wxs->pid <= 0 || !wxs->wm || wxs->wm->client_window_count > 0)
+		return 0;
+
+	/* Clients may stay connected without any window, e.g. while
+	 * setting up or between dialogs; check on them again later. */
+	clients = weston_wm_count_clients(wxs->wm);
+	if (clients > 0) {
+		wl_event_source_timer_update(wxs->idle_timer,
+					     wxs->idle_timeout * 1000);
+		return 0;
+	}
+
+	weston_log("Xwayland server idle for %d s, terminating it\n",
+		   wxs->idle_timeout);
+	kill(wxs->pid, SIGTERM);
+
+	return 0;
+}
+
+/* Arm the idle timer when the window manager is up and no X client
+ * has any windows, disarm it otherwise.  The server is only terminated
+ * once no X client is connected at all when the timer fires; without the
+ * X-Resource extension, the windows are all there is to go by. */
+void
+weston_xserver_update_idle(struct weston_xserver *wxs)
+{
+	int idle;
+
+	if (!wxs->idle_timer)
+		return;
+
+	idle = wxs->wm && wxs->wm->client_window_count == 0;
+	wl_event_source_timer_update(wxs->idle_timer,
+				     idle ? wxs->idle_timeout * 1000 : 0);
+}
+
 static void
 weston_xserver_shutdown(struct weston_xserver *wxs)
 {
@@ -82,6 +134,10 @@ weston_xserver_shutdown(struct weston_xserver *wxs)
 		weston_wm_destroy(wxs->wm);
 		wxs->wm = NULL;
 	}
+	if (wxs->idle_timer) {
+		wl_event_source_remove(wxs->idle_timer);
+		wxs->idle_timer = NULL;
+	}
 	wxs->loop = NULL;
 }
 
@@ -309,6 +365,7 @@ weston_xwayland_xserver_loaded(struct weston_xwayland *xwayland,
 	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
 	wxs->wm = weston_wm_create(wxs, wm_fd);
 	wxs->client = client;
+	weston_xserver_update_idle(wxs);
 }
 
 static void
@@ -333,6 +390,7 @@ weston_xwayland_xserver_exited(struct weston_xwayland *xwayland,
 		weston_log("xserver exited, code %d\n", exit_status);
 		weston_wm_destroy(wxs->wm);
 		wxs->wm = NULL;
+		weston_xserver_update_idle(wxs);
 	} else {
 		/* If the X server crashes before it binds to the
 		 * xserver interface, shut down and don't try
@@ -342,11 +400,54 @@ weston_xwayland_xserver_exited(struct weston_xwayland *xwayland,
 	}
 }
 
+static int
+weston_xwayland_spawn(struct weston_xwayland *xwayland)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+
+	if (!wxs->loop)
+		return -1;
+
+	if (wxs->pid != 0)
+		return 0;
+
+	return weston_xserver_spawn(wxs);
+}
+
+static void
+weston_xwayland_set_idle_timeout(struct weston_xwayland *xwayland,
+				 int seconds)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+	struct wl_event_loop *loop;
+
+	wxs->idle_timeout = seconds;
+
+	if (seconds <= 0) {
+		if (wxs->idle_timer)
+			wl_event_source_remove(wxs->idle_timer);
+		wxs->idle_timer = NULL;
+		return;
+	}
+
+	if (!wxs->idle_timer) {
+		loop = wl_display_get_event_loop(wxs->wl_display);
+		wxs->idle_timer =
+			wl_event_loop_add_timer(loop,
+						weston_xserver_idle_handler,
+						wxs);
+	}
+
+	weston_xserver_update_idle(wxs);
+}
+
 const struct weston_xwayland_api api = {
 	weston_xwayland_get,
 	weston_xwayland_listen,
 	weston_xwayland_xserver_loaded,
 	weston_xwayland_xserver_exited,
+	weston_xwayland_spawn,
+	weston_xwayland_set_idle_timeout,
 };
 extern const struct weston_xwayland_surface_api surface_api;
 
@@ -25,6 +25,8 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +36,97 @@
 #include "xwayland.h"
 #include "shared/helpers.h"
 
+static const uint32_t selection_min_chunk_size = 64 * 1024;
+static const uint32_t selection_max_chunk_size = 4 * 1024 * 1024;
+
+static void
+weston_wm_request_property_chunk(struct weston_wm *wm)
+{
+	wm->property_cookie = xcb_get_property(wm->conn,
+					       0, /* delete */
+					       wm->selection_window,
+					       wm->atom.wl_selection,
+					       XCB_GET_PROPERTY_TYPE_ANY,
+					       wm->property_offset,
+					       wm->selection_chunk_size / 4);
+	wm->property_cookie_pending = 1;
+	xcb_flush(wm->conn);
+}
+
+static void
+weston_wm_discard_property_chunk(struct weston_wm *wm)
+{
+	if (wm->property_cookie_pending)
+		xcb_discard_reply(wm->conn, wm->property_cookie.sequence);
+	wm->property_cookie_pending = 0;
+}
+
+static void
+weston_wm_set_property_chunk(struct weston_wm *wm,
+			     xcb_get_property_reply_t *reply)
+{
+	wm->property_start = 0;
+	wm->property_reply = reply;
+
+	/* The property offset is counted in 32 bit units, and every
+	 * chunk but the last one is a multiple of 4 bytes long. */
+	wm->property_offset += xcb_get_property_value_length(reply) / 4;
+
+	/* Ask for the next chunk right away, so that its reply is
+	 * already on the way while this one drains into the pipe.
+	 * That bounds us to one buffered and one in-flight chunk. */
+	if (reply->bytes_after > 0)
+		weston_wm_request_property_chunk(wm);
+}
+
+static void
+weston_wm_end_property_transfer(struct weston_wm *wm)
+{
+	if (wm->property_source)
+		wl_event_source_remove(wm->property_source);
+	wm->property_source = NULL;
+
+	/* For INCR transfers the delete asks the owner for the next
+	 * chunk, otherwise it just cleans up after us. */
+	xcb_delete_property(wm->conn,
+			    wm->selection_window,
+			    wm->atom.wl_selection);
+	xcb_flush(wm->conn);
+
+	if (!wm->incr) {
+		weston_log("transfer complete\n");
+		close(wm->data_source_fd);
+		wm->data_source_fd = -1;
+	}
+}
+
+/* Pick up the prefetched chunk if the X server has answered already.
+ * Returns true if there is a new chunk to write, false if the reply is
+ * still on its way or the transfer ended. */
+static bool
+weston_wm_poll_property_chunk(struct weston_wm *wm)
+{
+	xcb_get_property_reply_t *reply = NULL;
+	xcb_generic_error_t *error = NULL;
+
+	if (!xcb_poll_for_reply(wm->conn, wm->property_cookie.sequence,
+				(void **) &reply, &error))
+		return false;
+
+	free(error);
+	wm->property_cookie_pending = 0;
+
+	if (reply == NULL || xcb_get_property_value_length(reply) == 0) {
+		free(reply);
+		weston_wm_end_property_transfer(wm);
+		return false;
+	}
+
+	weston_wm_set_property_chunk(wm, reply);
+
+	return true;
+}
+
 static int
 writable_callback(int fd, uint32_t mask, void *data)
 {
@@ -41,77 +134,92 @@ writable_callback(int fd, uint32_t mask, void *data)
 	unsigned char *property;
 	int len, remainder;
 
-	property = xcb_get_property_value(wm->property_reply);
-	remainder = xcb_get_property_value_length(wm->property_reply) -
-		wm->property_start;
-
-	len = write(fd, property + wm->property_start, remainder);
-	if (len == -1) {
-		free(wm->property_reply);
-		wm->property_reply = NULL;
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
-		wm->property_source = NULL;
-		close(fd);
-		weston_log("write error to target fd: %m\n");
-		return 1;
-	}
+	while (wm->property_reply) {
+		property = xcb_get_property_value(wm->property_reply);
+		remainder = xcb_get_property_value_length(wm->property_reply) -
+			wm->property_start;
+
+		len = write(fd, property + wm->property_start, remainder);
+		if (len == -1 && errno == EAGAIN) {
+			/* The pipe is full, wait for the reader to catch
+			 * up before pulling more data from the X server. */
+			break;
+		} else if (len == -1) {
+			free(wm->property_reply);
+			wm->property_reply = NULL;
+			weston_wm_discard_property_chunk(wm);
+			if (wm->property_source)
+				wl_event_source_remove(wm->property_source);
+			wm->property_source = NULL;
+			close(fd);
+			wm->data_source_fd = -1;
+			weston_log("write error to target fd: %m\n");
+			return 1;
+		}
 
-	weston_log("wrote %d (chunk size %d) of %d bytes\n",
-		wm->property_start + len,
-		len, xcb_get_property_value_length(wm->property_reply));
+		wm->property_start += len;
+		if (len < remainder)
+			continue;
 
-	wm->property_start += len;
-	if (len == remainder) {
 		free(wm->property_reply);
 		wm->property_reply = NULL;
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
-		wm->property_source = NULL;
 
-		if (wm->incr) {
-			xcb_delete_property(wm->conn,
-					    wm->selection_window,
-					    wm->atom.wl_selection);
-		} else {
-			weston_log("transfer complete\n");
-			close(fd);
+		if (!wm->property_cookie_pending) {
+			weston_wm_end_property_transfer(wm);
+			return 1;
 		}
+
+		if (!weston_wm_poll_property_chunk(wm))
+			break;
+	}
+
+	if (wm->property_reply && !wm->property_source) {
+		wm->property_source =
+			wl_event_loop_add_fd(wm->server->loop,
+					     wm->data_source_fd,
+					     WL_EVENT_WRITABLE,
+					     writable_callback, wm);
+	} else if (!wm->property_reply && wm->property_source) {
+		/* Nothing to write until the next chunk arrives; the
+		 * XWM event path resumes us from
+		 * weston_wm_selection_collect_reply(). */
+		wl_event_source_remove(wm->property_source);
+		wm->property_source = NULL;
 	}
 
 	return 1;
 }
 
+/* Called from the XWM event path, after the X connection has been read,
+ * to resume a transfer that was waiting for its next chunk. */
+void
+weston_wm_selection_collect_reply(struct weston_wm *wm)
+{
+	if (wm->property_reply || !wm->property_cookie_pending ||
+	    wm->data_source_fd < 0)
+		return;
+
+	if (weston_wm_poll_property_chunk(wm))
+		writable_callback(wm->data_source_fd, WL_EVENT_WRITABLE, wm);
+}
+
 static void
 weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 {
-	wm->property_start = 0;
-	wm->property_reply = reply;
+	weston_wm_set_property_chunk(wm, reply);
 	writable_callback(wm->data_source_fd, WL_EVENT_WRITABLE, wm);
-
-	if (wm->property_reply)
-		wm->property_source =
-			wl_event_loop_add_fd(wm->server->loop,
-					     wm->data_source_fd,
-					     WL_EVENT_WRITABLE,
-					     writable_callback, wm);
 }
 
 static void
 weston_wm_get_incr_chunk(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	wm->property_offset = 0;
+	weston_wm_request_property_chunk(wm);
+	wm->property_cookie_pending = 0;
+	reply = xcb_get_property_reply(wm->conn, wm->property_cookie, NULL);
+	weston_wm_check_queued(wm);
 	if (reply == NULL)
 		return;
 
@@ -124,6 +232,7 @@ weston_wm_get_incr_chunk(struct weston_wm *wm)
 	} else {
 		weston_log("transfer complete\n");
 		close(wm->data_source_fd);
+		wm->data_source_fd = -1;
 		free(reply);
 	}
 }
@@ -188,6 +297,7 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 				  4096 /* length */);
 
 	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	weston_wm_check_queued(wm);
 	if (reply == NULL)
 		return;
 
@@ -230,26 +340,25 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 static void
 weston_wm_get_selection_data(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	wm->property_offset = 0;
+	weston_wm_request_property_chunk(wm);
+	wm->property_cookie_pending = 0;
+	reply = xcb_get_property_reply(wm->conn, wm->property_cookie, NULL);
+	weston_wm_check_queued(wm);
 
 	dump_property(wm, wm->atom.wl_selection, reply);
 
 	if (reply == NULL) {
 		return;
 	} else if (reply->type == wm->atom.incr) {
+		/* Deleting the INCR property starts the transfer. */
 		wm->incr = 1;
 		free(reply);
+		xcb_delete_property(wm->conn,
+				    wm->selection_window,
+				    wm->atom.wl_selection);
 	} else {
 		wm->incr = 0;
 		/* reply's ownership is transferred to wm, which is responsible
@@ -274,8 +383,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
@@ -360,27 +467,31 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 	void *p;
 
 	current = wm->source_data.size;
-	if (wm->source_data.size < incr_chunk_size)
-		p = wl_array_add(&wm->source_data, incr_chunk_size);
+	if (wm->source_data.size < wm->selection_chunk_size)
+		p = wl_array_add(&wm->source_data, wm->selection_chunk_size);
 	else
 		p = (char *) wm->source_data.data + wm->source_data.size;
 	available = wm->source_data.alloc - current;
 
 	len = read(fd, p, available);
-	if (len == -1) {
+	if (len == -1 && errno == EAGAIN) {
+		wm->source_data.size = current;
+		return 1;
+	} else if (len == -1) {
 		weston_log("read error from data source: %m\n");
 		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
 		wl_event_source_remove(wm->property_source);
 		wm->property_source = NULL;
 		close(fd);
 		wl_array_release(&wm->source_data);
+		return 1;
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
+	weston_log("read %d (available %d, mask 0x%x) bytes\n",
+		len, available, mask);
 
 	wm->source_data.size = current + len;
-	if (wm->source_data.size >= incr_chunk_size) {
+	if (wm->source_data.size >= wm->selection_chunk_size) {
 		if (!wm->incr) {
 			weston_log("got %zu bytes, starting incr\n",
 				wm->source_data.size);
@@ -391,7 +502,7 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 					    wm->selection_request.property,
 					    wm->atom.incr,
 					    32, /* format */
-					    1, &incr_chunk_size);
+					    1, &wm->selection_chunk_size);
 			wm->selection_property_set = 1;
 			wm->flush_property_on_delete = 1;
 			wl_event_source_remove(wm->property_source);
@@ -680,10 +791,22 @@ weston_wm_selection_init(struct weston_wm *wm)
 {
 	struct weston_seat *seat;
 	uint32_t values[1], mask;
+	uint32_t max_request;
 
 	wl_list_init(&wm->selection_listener.link);
 
 	wm->selection_request.requestor = XCB_NONE;
+	wm->data_source_fd = -1;
+
+	/* Size our chunks to what fits in a single ChangeProperty
+	 * request, leaving room for the request header.  The maximum
+	 * request length is in 4 byte units. */
+	max_request = xcb_get_maximum_request_length(wm->conn);
+	if (max_request > selection_max_chunk_size / 4)
+		max_request = selection_max_chunk_size / 4;
+	wm->selection_chunk_size = (max_request - 8) * 4;
+	if (wm->selection_chunk_size < selection_min_chunk_size)
+		wm->selection_chunk_size = selection_min_chunk_size;
 
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE;
 	wm->selection_window = xcb_generate_id(wm->conn);
@@ -38,7 +38,12 @@
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
+#include <time.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <xcb/xcbext.h>
+#ifdef HAVE_XCB_RES
+#include <xcb/res.h>
+#endif
 #include <linux/input.h>
 
 #include "compositor.h"
@@ -46,8 +51,10 @@
 #include "xwayland-internal-interface.h"
 
 #include "cairo-util.h"
-#include "hash.h"
+#include "shared/hash.h"
+#include "timeline.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 
 struct wm_size_hints {
 	uint32_t flags;
@@ -133,12 +140,33 @@ struct weston_output_weak_ref {
 	struct wl_listener destroy_listener;
 };
 
+/* Number of entries in the table built by weston_wm_window_get_props() */
+#define WM_WINDOW_PROPERTY_COUNT 11
+
+struct wm_window_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	void *ptr;
+};
+
+enum wm_decor_mode {
+	WM_DECOR_INVALID = 0,	/* frame contents are undefined */
+	WM_DECOR_FULLSCREEN,
+	WM_DECOR_FRAME,
+	WM_DECOR_SHADOW
+};
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
 	xcb_window_t frame_id;
 	struct frame *frame;
 	cairo_surface_t *cairo_surface;
+	/* What the frame window currently shows, so that repaints
+	 * that would not change anything can be skipped. */
+	enum wm_decor_mode decor_mode;
+	int decor_width, decor_height;
+	bool decor_active;
 	uint32_t surface_id;
 	struct weston_surface *surface;
 	struct weston_desktop_xwayland_surface *shsurf;
@@ -146,6 +174,19 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+	/* Property and geometry requests whose replies are collected
+	 * from the event path, see weston_wm_collect_replies(). */
+	bool properties_pending;
+	int properties_received;
+	xcb_get_property_cookie_t property_cookies[WM_WINDOW_PROPERTY_COUNT];
+	bool geometry_pending;
+	xcb_get_geometry_cookie_t geometry_cookie;
+	struct wl_list pending_link;
+	/* MapRequest seen, waiting for the replies above to finish it. */
+	bool map_request_deferred;
+	/* Surface paired, waiting for the replies above to map it in the
+	 * shell. */
+	bool shell_map_deferred;
 	int pid;
 	char *machine;
 	char *class;
@@ -184,6 +225,9 @@ weston_wm_set_net_active_window(struct weston_wm *wm, xcb_window_t window);
 static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window);
 
+static void
+weston_wm_window_finish_deferred(struct weston_wm_window *window);
+
 static int
 legacy_fullscreen(struct weston_wm *wm,
 		  struct weston_wm_window *window,
@@ -193,6 +237,9 @@ static void
 xserver_map_shell_surface(struct weston_wm_window *window,
 			  struct weston_surface *surface);
 
+static void
+xserver_finish_map_shell_surface(struct weston_wm_window *window);
+
 static int __attribute__ ((format (printf, 1, 2)))
 wm_log(const char *fmt, ...)
 {
@@ -501,21 +548,24 @@ static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
 {
+#ifdef WM_DEBUG
 	xcb_get_property_reply_t *reply;
 	xcb_get_property_cookie_t cookie;
 
 	cookie = xcb_get_property(wm->conn, 0, window,
 				  property, XCB_ATOM_ANY, 0, 2048);
 	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	weston_wm_check_queued(wm);
 
 	dump_property(wm, property, reply);
 
 	free(reply);
+#endif
 }
 
 /* We reuse some predefined, but otherwise useles atoms
  * as local type placeholders that never touch the X11 server,
- * to make weston_wm_window_read_properties() less exceptional.
+ * to make weston_wm_window_collect_properties() less exceptional.
  */
 #define TYPE_WM_PROTOCOLS	XCB_ATOM_CUT_BUFFER0
 #define TYPE_MOTIF_WM_HINTS	XCB_ATOM_CUT_BUFFER1
@@ -523,16 +573,13 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_window_get_props(struct weston_wm_window *window,
+			   struct wm_window_property *props)
 {
 	struct weston_wm *wm = window->wm;
 
 #define F(field) (&window->field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		void *ptr;
-	} props[] = {
+	const struct wm_window_property table[] = {
 		{ XCB_ATOM_WM_CLASS,           XCB_ATOM_STRING,            F(class) },
 		{ XCB_ATOM_WM_NAME,            XCB_ATOM_STRING,            F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR,   XCB_ATOM_WINDOW,            F(transient_for) },
@@ -547,128 +594,310 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
-	void *p;
+	assert(ARRAY_LENGTH(table) == WM_WINDOW_PROPERTY_COUNT);
+	memcpy(props, table, sizeof table);
+}
+
+static void
+weston_wm_window_timeline_point(struct weston_wm_window *window,
+				const char *name)
+{
+	if (window->surface)
+		TL_POINT(name, TLP_SURFACE(window->surface), TLP_END);
+	else
+		TL_POINT(name, TLP_END);
+}
+
+static void
+weston_wm_window_update_pending(struct weston_wm_window *window)
+{
+	bool pending = window->properties_pending || window->geometry_pending;
+
+	if (pending && wl_list_empty(&window->pending_link))
+		wl_list_insert(&window->wm->pending_window_list,
+			       &window->pending_link);
+	else if (!pending && !wl_list_empty(&window->pending_link))
+		wl_list_remove(&window->pending_link);
+
+	if (!pending)
+		wl_list_init(&window->pending_link);
+}
+
+static void
+weston_wm_window_request_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	uint32_t i;
+
+	/* If requests are already in flight, properties_dirty stays set
+	 * and we send a new batch once those have been collected. */
+	if (window->properties_pending || !window->properties_dirty)
+		return;
+
+	weston_wm_window_get_props(window, props);
+
+	for (i = 0; i < ARRAY_LENGTH(props); i++)
+		window->property_cookies[i] =
+			xcb_get_property(wm->conn,
+					 0, /* delete */
+					 window->id,
+					 props[i].atom,
+					 XCB_ATOM_ANY, 0, 2048);
+
+	window->properties_dirty = 0;
+	window->properties_pending = true;
+	window->properties_received = 0;
+	weston_wm_window_update_pending(window);
+
+	weston_wm_window_timeline_point(window, "xwm_props_req");
+}
+
+static void
+weston_wm_window_apply_property(struct weston_wm_window *window,
+				const struct wm_window_property *prop,
+				xcb_get_property_reply_t *reply)
+{
+	struct weston_wm *wm = window->wm;
+	void *p = prop->ptr;
 	uint32_t *xid;
 	xcb_atom_t *atom;
 	uint32_t i;
-	char name[1024];
 
-	if (!window->properties_dirty)
+	/* Reset what a missing property implies. */
+	switch (prop->type) {
+	case TYPE_WM_PROTOCOLS:
+		window->delete_window = 0;
+		break;
+	case TYPE_WM_NORMAL_HINTS:
+		window->size_hints.flags = 0;
+		break;
+	case TYPE_MOTIF_WM_HINTS:
+		window->decorate = window->override_redirect ?
+			0 : MWM_DECOR_EVERYTHING;
+		window->motif_hints.flags = 0;
+		break;
+	default:
+		break;
+	}
+
+	if (!reply)
+		/* Bad window, typically */
+		return;
+	if (reply->type == XCB_ATOM_NONE)
+		/* No such property */
 		return;
-	window->properties_dirty = 0;
 
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
-
-	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
-	window->size_hints.flags = 0;
-	window->motif_hints.flags = 0;
-	window->delete_window = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
-		if (!reply)
-			/* Bad window, typically */
-			continue;
-		if (reply->type == XCB_ATOM_NONE) {
-			/* No such property */
-			free(reply);
-			continue;
+	switch (prop->type) {
+	case XCB_ATOM_WM_CLIENT_MACHINE:
+	case XCB_ATOM_STRING:
+		/* FIXME: We're using this for both string and
+		   utf8_string */
+		if (*(char **) p)
+			free(*(char **) p);
+
+		*(char **) p =
+			strndup(xcb_get_property_value(reply),
+				xcb_get_property_value_length(reply));
+		break;
+	case XCB_ATOM_WINDOW:
+		xid = xcb_get_property_value(reply);
+		if (!wm_lookup_window(wm, *xid, p))
+			weston_log("XCB_ATOM_WINDOW contains window"
+				   " id not found in hash table.\n");
+		break;
+	case XCB_ATOM_CARDINAL:
+	case XCB_ATOM_ATOM:
+		atom = xcb_get_property_value(reply);
+		*(xcb_atom_t *) p = *atom;
+		break;
+	case TYPE_WM_PROTOCOLS:
+		atom = xcb_get_property_value(reply);
+		for (i = 0; i < reply->value_len; i++)
+			if (atom[i] == wm->atom.wm_delete_window) {
+				window->delete_window = 1;
+				break;
+			}
+		break;
+	case TYPE_WM_NORMAL_HINTS:
+		memcpy(&window->size_hints,
+		       xcb_get_property_value(reply),
+		       sizeof window->size_hints);
+		break;
+	case TYPE_NET_WM_STATE:
+		window->fullscreen = 0;
+		atom = xcb_get_property_value(reply);
+		for (i = 0; i < reply->value_len; i++) {
+			if (atom[i] == wm->atom.net_wm_state_fullscreen)
+				window->fullscreen = 1;
+			if (atom[i] == wm->atom.net_wm_state_maximized_vert)
+				window->maximized_vert = 1;
+			if (atom[i] == wm->atom.net_wm_state_maximized_horz)
+				window->maximized_horz = 1;
 		}
+		break;
+	case TYPE_MOTIF_WM_HINTS:
+		memcpy(&window->motif_hints,
+		       xcb_get_property_value(reply),
+		       sizeof window->motif_hints);
+		if (window->motif_hints.flags & MWM_HINTS_DECORATIONS) {
+			if (window->motif_hints.decorations & MWM_DECOR_ALL)
+				/* MWM_DECOR_ALL means all except the other values listed. */
+				window->decorate =
+					MWM_DECOR_EVERYTHING & (~window->motif_hints.decorations);
+			else
+				window->decorate =
+					window->motif_hints.decorations;
+		}
+		break;
+	default:
+		break;
+	}
+}
 
-		p = props[i].ptr;
+static void
+weston_wm_window_check_pid(struct weston_wm_window *window)
+{
+	char name[1024];
+	uint32_t i;
 
-		switch (props[i].type) {
-		case XCB_ATOM_WM_CLIENT_MACHINE:
-		case XCB_ATOM_STRING:
-			/* FIXME: We're using this for both string and
-			   utf8_string */
-			if (*(char **) p)
-				free(*(char **) p);
+	if (window->pid <= 0)
+		return;
 
-			*(char **) p =
-				strndup(xcb_get_property_value(reply),
-					xcb_get_property_value_length(reply));
-			break;
-		case XCB_ATOM_WINDOW:
-			xid = xcb_get_property_value(reply);
-			if (!wm_lookup_window(wm, *xid, p))
-				weston_log("XCB_ATOM_WINDOW contains window"
-					   " id not found in hash table.\n");
-			break;
-		case XCB_ATOM_CARDINAL:
-		case XCB_ATOM_ATOM:
-			atom = xcb_get_property_value(reply);
-			*(xcb_atom_t *) p = *atom;
-			break;
-		case TYPE_WM_PROTOCOLS:
-			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window) {
-					window->delete_window = 1;
-					break;
-				}
-			break;
-		case TYPE_WM_NORMAL_HINTS:
-			memcpy(&window->size_hints,
-			       xcb_get_property_value(reply),
-			       sizeof window->size_hints);
-			break;
-		case TYPE_NET_WM_STATE:
-			window->fullscreen = 0;
-			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++) {
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
-					window->fullscreen = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_vert)
-					window->maximized_vert = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_horz)
-					window->maximized_horz = 1;
-			}
-			break;
-		case TYPE_MOTIF_WM_HINTS:
-			memcpy(&window->motif_hints,
-			       xcb_get_property_value(reply),
-			       sizeof window->motif_hints);
-			if (window->motif_hints.flags & MWM_HINTS_DECORATIONS) {
-				if (window->motif_hints.decorations & MWM_DECOR_ALL)
-					/* MWM_DECOR_ALL means all except the other values listed. */
-					window->decorate =
-						MWM_DECOR_EVERYTHING & (~window->motif_hints.decorations);
-				else
-					window->decorate =
-						window->motif_hints.decorations;
-			}
+	gethostname(name, sizeof(name));
+	for (i = 0; i < sizeof(name); i++) {
+		if (name[i] == '\0')
 			break;
-		default:
-			break;
-		}
+	}
+	if (i == sizeof(name))
+		name[0] = '\0'; /* ignore stupid hostnames */
+
+	/* this is only one heuristic to guess the PID of a client is
+	* valid, assuming it's compliant with icccm and ewmh.
+	* Non-compliants and remote applications of course fail. */
+	if (!window->machine || strcmp(window->machine, name))
+		window->pid = 0;
+}
+
+/* Apply the property replies that have arrived so far.  Replies come
+ * back in request order, so we stop at the first one that is missing.
+ * Returns true once the whole batch has been applied. */
+static bool
+weston_wm_window_collect_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_cookie_t cookie;
+	xcb_get_property_reply_t *reply;
+	xcb_generic_error_t *error;
+
+	if (!window->properties_pending)
+		return true;
+
+	weston_wm_window_get_props(window, props);
+
+	while (window->properties_received < WM_WINDOW_PROPERTY_COUNT) {
+		cookie = window->property_cookies[window->properties_received];
+		reply = NULL;
+		error = NULL;
+		if (!xcb_poll_for_reply(wm->conn, cookie.sequence,
+					(void **) &reply, &error))
+			return false;
+		free(error);
+
+		weston_wm_window_apply_property(window,
+			&props[window->properties_received], reply);
 		free(reply);
+		window->properties_received++;
 	}
 
-	if (window->pid > 0) {
-		gethostname(name, sizeof(name));
-		for (i = 0; i < sizeof(name); i++) {
-			if (name[i] == '\0')
-				break;
-		}
-		if (i == sizeof(name))
-			name[0] = '\0'; /* ignore stupid hostnames */
+	weston_wm_window_check_pid(window);
+
+	window->properties_pending = false;
+	weston_wm_window_update_pending(window);
+	weston_wm_window_timeline_point(window, "xwm_props_done");
+
+	weston_wm_window_finish_deferred(window);
+	if (window->frame_id != XCB_WINDOW_NONE)
+		weston_wm_window_schedule_repaint(window);
+
+	/* Something changed while the batch was in flight. */
+	weston_wm_window_request_properties(window);
+
+	return true;
+}
+
+static void
+weston_wm_window_collect_geometry(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	xcb_get_geometry_reply_t *reply = NULL;
+	xcb_generic_error_t *error = NULL;
+
+	if (!window->geometry_pending)
+		return;
+
+	if (!xcb_poll_for_reply(wm->conn, window->geometry_cookie.sequence,
+				(void **) &reply, &error))
+		return;
+	free(error);
+
+	/* technically we should use XRender and check the visual format's
+	alpha_mask, but checking depth is simpler and works in all known cases */
+	if (reply != NULL)
+		window->has_alpha = reply->depth == 32;
+	free(reply);
+
+	window->geometry_pending = false;
+	weston_wm_window_update_pending(window);
+
+	weston_wm_window_finish_deferred(window);
+}
+
+static void
+weston_wm_window_discard_replies(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	int i;
+
+	if (window->geometry_pending)
+		xcb_discard_reply(wm->conn, window->geometry_cookie.sequence);
+	window->geometry_pending = false;
+
+	if (window->properties_pending)
+		for (i = window->properties_received;
+		     i < WM_WINDOW_PROPERTY_COUNT; i++)
+			xcb_discard_reply(wm->conn,
+					  window->property_cookies[i].sequence);
+	window->properties_pending = false;
 
-		/* this is only one heuristic to guess the PID of a client is
-		* valid, assuming it's compliant with icccm and ewmh.
-		* Non-compliants and remote applications of course fail. */
-		if (!window->machine || strcmp(window->machine, name))
-			window->pid = 0;
+	weston_wm_window_update_pending(window);
+}
+
+/* Called from the event path: apply whatever replies have come in
+ * without ever blocking on the X server. */
+static void
+weston_wm_collect_replies(struct weston_wm *wm)
+{
+	struct weston_wm_window *window, *next;
+
+	wl_list_for_each_safe(window, next,
+			      &wm->pending_window_list, pending_link) {
+		weston_wm_window_collect_geometry(window);
+		weston_wm_window_collect_properties(window);
 	}
 }
 
+/* Apply whatever replies have arrived and ask for a new batch if the
+ * properties changed, without blocking. */
+static void
+weston_wm_window_poll_properties(struct weston_wm_window *window)
+{
+	weston_wm_window_collect_geometry(window);
+	weston_wm_window_collect_properties(window);
+	weston_wm_window_request_properties(window);
+}
+
 #undef TYPE_WM_PROTOCOLS
 #undef TYPE_MOTIF_WM_HINTS
 #undef TYPE_NET_WM_STATE
@@ -1043,6 +1272,7 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	window->frame = frame_create(window->wm->theme,
 				     window->width, window->height,
 				     buttons, window->name, NULL);
+	window->decor_mode = WM_DECOR_INVALID;
 	frame_resize_inside(window->frame, window->width, window->height);
 
 	weston_wm_window_get_frame_size(window, &width, &height);
@@ -1115,24 +1345,11 @@ weston_wm_window_set_virtual_desktop(struct weston_wm_window *window,
 }
 
 static void
-weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
+weston_wm_window_map_request(struct weston_wm_window *window)
 {
-	xcb_map_request_event_t *map_request =
-		(xcb_map_request_event_t *) event;
-	struct weston_wm_window *window;
+	struct weston_wm *wm = window->wm;
 	struct weston_output *output;
 
-	if (our_resource(wm, map_request->window)) {
-		wm_log("XCB_MAP_REQUEST (window %d, ours)\n",
-		       map_request->window);
-		return;
-	}
-
-	if (!wm_lookup_window(wm, map_request->window, &window))
-		return;
-
-	weston_wm_window_read_properties(window);
-
 	/* For a new Window, MapRequest happens before the Window is realized
 	 * in Xwayland. We do the real xcb_map_window() here as a response to
 	 * MapRequest. The Window will get realized (wl_surface created in
@@ -1169,15 +1386,62 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 					   output);
 	}
 
-	xcb_map_window(wm->conn, map_request->window);
+	xcb_map_window(wm->conn, window->id);
 	xcb_map_window(wm->conn, window->frame_id);
 
+	/* The frame window gets a fresh pixmap on map. */
+	window->decor_mode = WM_DECOR_INVALID;
+
 	/* Mapped in the X server, we can draw immediately.
 	 * Cannot set pending state though, no weston_surface until
 	 * xserver_map_shell_surface() time. */
 	weston_wm_window_schedule_repaint(window);
 }
 
+static void
+weston_wm_window_finish_map_request(struct weston_wm_window *window)
+{
+	if (!window->map_request_deferred ||
+	    window->properties_pending || window->geometry_pending)
+		return;
+
+	window->map_request_deferred = false;
+	weston_wm_window_map_request(window);
+}
+
+/* Run whatever was waiting for the window's replies, in the order the
+ * X server asked for it. */
+static void
+weston_wm_window_finish_deferred(struct weston_wm_window *window)
+{
+	weston_wm_window_finish_map_request(window);
+	xserver_finish_map_shell_surface(window);
+}
+
+static void
+weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
+{
+	xcb_map_request_event_t *map_request =
+		(xcb_map_request_event_t *) event;
+	struct weston_wm_window *window;
+
+	if (our_resource(wm, map_request->window)) {
+		wm_log("XCB_MAP_REQUEST (window %d, ours)\n",
+		       map_request->window);
+		return;
+	}
+
+	if (!wm_lookup_window(wm, map_request->window, &window))
+		return;
+
+	/* Don't wait for the X server here: if the property or geometry
+	 * replies are still in flight, the map request is finished from
+	 * the event path once they have been applied. */
+	window->map_request_deferred = true;
+	weston_wm_window_poll_properties(window);
+	weston_wm_window_finish_map_request(window);
+}
+
 static void
 weston_wm_handle_map_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 {
@@ -1242,18 +1506,49 @@ weston_wm_window_draw_decoration(struct weston_wm_window *window)
 {
 	cairo_t *cr;
 	int width, height;
-
-	wm_log("XWM: draw decoration, win %d\n", window->id);
+	int32_t x, y, w, h;
+	enum wm_decor_mode mode;
+	bool active, title_only = false;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
 
+	if (window->fullscreen)
+		mode = WM_DECOR_FULLSCREEN;
+	else if (window->decorate)
+		mode = WM_DECOR_FRAME;
+	else
+		mode = WM_DECOR_SHADOW;
+	active = window->wm->focus_window == window;
+
+	if (mode == WM_DECOR_FRAME)
+		frame_set_title(window->frame, window->name);
+
+	if (mode == window->decor_mode &&
+	    width == window->decor_width &&
+	    height == window->decor_height) {
+		if (mode != WM_DECOR_FRAME ||
+		    !(frame_status(window->frame) & FRAME_STATUS_REPAINT))
+			return;
+
+		/* Same size and focus state, so only the title bar
+		 * (title text or button state) can have changed. */
+		title_only = active == window->decor_active;
+	}
+
+	wm_log("XWM: draw decoration, win %d%s\n", window->id,
+	       title_only ? " (title bar)" : "");
+
 	cairo_xcb_surface_set_size(window->cairo_surface, width, height);
 	cr = cairo_create(window->cairo_surface);
 
-	if (window->fullscreen) {
+	if (mode == WM_DECOR_FULLSCREEN) {
 		/* nothing */
-	} else if (window->decorate) {
-		frame_set_title(window->frame, window->name);
+	} else if (mode == WM_DECOR_FRAME) {
+		if (title_only) {
+			frame_interior(window->frame, &x, &y, &w, &h);
+			cairo_rectangle(cr, 0, 0, width, y);
+			cairo_clip(cr);
+		}
 		frame_repaint(window->frame, cr);
 	} else {
 		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
@@ -1267,6 +1562,11 @@ weston_wm_window_draw_decoration(struct weston_wm_window *window)
 	cairo_destroy(cr);
 	cairo_surface_flush(window->cairo_surface);
 	xcb_flush(window->wm->conn);
+
+	window->decor_mode = mode;
+	window->decor_width = width;
+	window->decor_height = height;
+	window->decor_active = active;
 }
 
 static void
@@ -1329,7 +1629,9 @@ weston_wm_window_do_repaint(void *data)
 
 	window->repaint_source = NULL;
 
-	weston_wm_window_read_properties(window);
+	/* Draw with what we have; we get scheduled again once a batch
+	 * that is still in flight has been applied. */
+	weston_wm_window_poll_properties(window);
 
 	weston_wm_window_draw_decoration(window);
 	weston_wm_window_set_pending_state(window);
@@ -1346,6 +1648,8 @@ weston_wm_window_set_pending_state_OR(struct weston_wm_window *window)
 	if (!window->surface)
 		return;
 
+	weston_wm_window_collect_geometry(window, true);
+
 	weston_wm_window_get_frame_size(window, &width, &height);
 	pixman_region32_fini(&window->surface->pending.opaque);
 	if (window->has_alpha) {
@@ -1387,11 +1691,22 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	xcb_property_notify_event_t *property_notify =
 		(xcb_property_notify_event_t *) event;
 	struct weston_wm_window *window;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	uint32_t i;
 
 	if (!wm_lookup_window(wm, property_notify->window, &window))
 		return;
 
-	window->properties_dirty = 1;
+	/* Only refetch for properties we actually track, clients
+	 * update things like _NET_WM_USER_TIME all the time. */
+	weston_wm_window_get_props(window, props);
+	for (i = 0; i < ARRAY_LENGTH(props); i++) {
+		if (props[i].atom == property_notify->atom) {
+			window->properties_dirty = 1;
+			weston_wm_window_request_properties(window);
+			break;
+		}
+	}
 
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
 	if (property_notify->state == XCB_PROPERTY_DELETE)
@@ -1412,8 +1727,6 @@ weston_wm_window_create(struct weston_wm *wm,
 {
 	struct weston_wm_window *window;
 	uint32_t values[1];
-	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1421,7 +1734,8 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_pending = true;
 
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
                     XCB_EVENT_MASK_FOCUS_CHANGE;
@@ -1439,15 +1753,16 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->map_request_x = INT_MIN; /* out of range for valid positions */
 	window->map_request_y = INT_MIN; /* out of range for valid positions */
 	weston_output_weak_ref_init(&window->legacy_fullscreen_output);
-
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if (geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
+	wl_list_init(&window->pending_link);
 
 	hash_table_insert(wm->window_hash, id, window);
+
+	if (wm->client_window_count++ == 0)
+		weston_xserver_update_idle(wm->server);
+
+	/* Get the properties on their way now, so that the replies
+	 * are usually in by the time the window gets mapped. */
+	weston_wm_window_request_properties(window);
 }
 
 static void
@@ -1456,6 +1771,7 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 	struct weston_wm *wm = window->wm;
 
 	weston_output_weak_ref_clear(&window->legacy_fullscreen_output);
+	weston_wm_window_discard_replies(window);
 
 	if (window->repaint_source)
 		wl_event_source_remove(window->repaint_source);
@@ -1481,6 +1797,10 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 		wl_list_remove(&window->surface_destroy_listener.link);
 
 	hash_table_remove(window->wm->window_hash, window->id);
+
+	if (--wm->client_window_count == 0)
+		weston_xserver_update_idle(wm->server);
+
 	free(window);
 }
 
@@ -1751,6 +2071,7 @@ surface_destroy(struct wl_listener *listener, void *data)
 	 * Don't try to use it later. */
 	window->shsurf = NULL;
 	window->surface = NULL;
+	window->shell_map_deferred = false;
 }
 
 static void
@@ -1905,25 +2226,34 @@ static const struct cursor_alternatives cursors[] = {
 	{left_ptrs, ARRAY_LENGTH(left_ptrs)},
 };
 
+/* Cursors are loaded on first use, as decoding the Xcursor theme
+ * files is a large part of the XWM startup time otherwise. */
 static void
 weston_wm_create_cursors(struct weston_wm *wm)
+{
+	int count = ARRAY_LENGTH(cursors);
+
+	wm->cursors = calloc(count, sizeof(xcb_cursor_t));
+	wm->last_cursor = -1;
+}
+
+static xcb_cursor_t
+weston_wm_get_cursor(struct weston_wm *wm, int cursor)
 {
 	const char *name;
-	int i, count = ARRAY_LENGTH(cursors);
 	size_t j;
 
-	wm->cursors = malloc(count * sizeof(xcb_cursor_t));
-	for (i = 0; i < count; i++) {
-		for (j = 0; j < cursors[i].count; j++) {
-			name = cursors[i].names[j];
-			wm->cursors[i] =
-				xcb_cursor_library_load_cursor(wm, name);
-			if (wm->cursors[i] != (xcb_cursor_t)-1)
-				break;
-		}
+	if (wm->cursors[cursor] != XCB_CURSOR_NONE)
+		return wm->cursors[cursor];
+
+	for (j = 0; j < cursors[cursor].count; j++) {
+		name = cursors[cursor].names[j];
+		wm->cursors[cursor] = xcb_cursor_library_load_cursor(wm, name);
+		if (wm->cursors[cursor] != (xcb_cursor_t)-1)
+			break;
 	}
 
-	wm->last_cursor = -1;
+	return wm->cursors[cursor];
 }
 
 static void
@@ -1932,7 +2262,9 @@ weston_wm_destroy_cursors(struct weston_wm *wm)
 	uint8_t i;
 
 	for (i = 0; i < ARRAY_LENGTH(cursors); i++)
-		xcb_free_cursor(wm->conn, wm->cursors[i]);
+		if (wm->cursors[i] != XCB_CURSOR_NONE &&
+		    wm->cursors[i] != (xcb_cursor_t)-1)
+			xcb_free_cursor(wm->conn, wm->cursors[i]);
 
 	free(wm->cursors);
 }
@@ -1975,7 +2307,7 @@ weston_wm_window_set_cursor(struct weston_wm *wm, xcb_window_t window_id,
 
 	wm->last_cursor = cursor;
 
-	cursor_value_list = wm->cursors[cursor];
+	cursor_value_list = weston_wm_get_cursor(wm, cursor);
 	xcb_change_window_attributes (wm->conn, window_id,
 				      XCB_CW_CURSOR, &cursor_value_list);
 	xcb_flush(wm->conn);
@@ -2249,10 +2581,78 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
-	if (count != 0)
-		xcb_flush(wm->conn);
+	weston_wm_collect_replies(wm);
+	weston_wm_selection_collect_reply(wm);
+
+	/* Applying replies may have issued requests too, e.g. when it
+	 * finished a deferred map request. */
+	xcb_flush(wm->conn);
+
+	return count;
+}
+
+static void
+weston_wm_handle_queued(void *data)
+{
+	struct weston_wm *wm = data;
+
+	wm->queued_idle = NULL;
+	weston_wm_handle_event(-1, 0, wm);
+}
+
+/* Call after blocking on an X reply.  Waiting for it reads every event
+ * and reply that came before it into xcb's queues, without the X fd
+ * becoming readable again, so make sure the event path gets to them,
+ * e.g. to finish deferred map requests or resume a selection transfer. */
+void
+weston_wm_check_queued(struct weston_wm *wm)
+{
+	if (wm->queued_idle)
+		return;
+
+	wm->queued_idle = wl_event_loop_add_idle(wm->server->loop,
+						 weston_wm_handle_queued, wm);
+}
+
+/* Count the X clients connected besides the window manager.  Clients
+ * without any window can only be seen through the X-Resource extension,
+ * so return -1 when it is missing. */
+int
+weston_wm_count_clients(struct weston_wm *wm)
+{
+#ifdef HAVE_XCB_RES
+	const xcb_query_extension_reply_t *xres;
+	xcb_res_query_clients_cookie_t cookie;
+	xcb_res_query_clients_reply_t *reply;
+	xcb_res_client_iterator_t it;
+	uint32_t own_base;
+	int count = 0;
+
+	xres = xcb_get_extension_data(wm->conn, &xcb_res_id);
+	if (!xres || !xres->present)
+		return -1;
+
+	cookie = xcb_res_query_clients(wm->conn);
+	reply = xcb_res_query_clients_reply(wm->conn, cookie, NULL);
+	weston_wm_check_queued(wm);
+	if (!reply)
+		return -1;
+
+	/* The server's own resources are based at 0 */
+	own_base = xcb_get_setup(wm->conn)->resource_id_base;
+	for (it = xcb_res_query_clients_clients_iterator(reply);
+	     it.rem; xcb_res_client_next(&it)) {
+		if (it.data->resource_base != 0 &&
+		    it.data->resource_base != own_base)
+			count++;
+	}
+
+	free(reply);
 
 	return count;
+#else
+	return -1;
+#endif
 }
 
 static void
@@ -2380,8 +2780,16 @@ weston_wm_get_resources(struct weston_wm *wm)
 
 	xcb_prefetch_extension_data (wm->conn, &xcb_xfixes_id);
 	xcb_prefetch_extension_data (wm->conn, &xcb_composite_id);
+#ifdef HAVE_XCB_RES
+	xcb_prefetch_extension_data (wm->conn, &xcb_res_id);
+#endif
 
+	/* Send every request up front, so that all of this costs a
+	 * single round trip to the X server. */
 	formats_cookie = xcb_render_query_pict_formats(wm->conn);
+	xfixes_cookie = xcb_xfixes_query_version(wm->conn,
+						 XCB_XFIXES_MAJOR_VERSION,
+						 XCB_XFIXES_MINOR_VERSION);
 
 	for (i = 0; i < ARRAY_LENGTH(atoms); i++)
 		cookies[i] = xcb_intern_atom (wm->conn, 0,
@@ -2398,14 +2806,12 @@ weston_wm_get_resources(struct weston_wm *wm)
 	if (!wm->xfixes || !wm->xfixes->present)
 		weston_log("xfixes not available\n");
 
-	xfixes_cookie = xcb_xfixes_query_version(wm->conn,
-						 XCB_XFIXES_MAJOR_VERSION,
-						 XCB_XFIXES_MINOR_VERSION);
 	xfixes_reply = xcb_xfixes_query_version_reply(wm->conn,
 						      xfixes_cookie, NULL);
-
-	weston_log("xfixes version: %d.%d\n",
-	       xfixes_reply->major_version, xfixes_reply->minor_version);
+	if (xfixes_reply)
+		weston_log("xfixes version: %d.%d\n",
+			   xfixes_reply->major_version,
+			   xfixes_reply->minor_version);
 
 	free(xfixes_reply);
 
@@ -2494,6 +2900,9 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	xcb_screen_iterator_t s;
 	uint32_t values[1];
 	xcb_atom_t supported[6];
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	wm = zalloc(sizeof *wm);
 	if (wm == NULL)
@@ -2573,6 +2982,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wl_signal_add(&wxs->compositor->kill_signal,
 		      &wm->kill_listener);
 	wl_list_init(&wm->unpaired_window_list);
+	wl_list_init(&wm->pending_window_list);
 
 	weston_wm_create_cursors(wm);
 	weston_wm_window_set_cursor(wm, wm->screen->root, XWM_CURSOR_LEFT_PTR);
@@ -2581,7 +2991,9 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	 * signals to Xwayland that we're done with setup. */
 	weston_wm_create_wm_window(wm);
 
-	weston_log("created wm, root %d\n", wm->screen->root);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	weston_log("created wm, root %d, in %" PRId64 " ms\n",
+		   wm->screen->root, timespec_sub_to_msec(&end, &start));
 
 	return wm;
 }
@@ -2593,6 +3005,8 @@ weston_wm_destroy(struct weston_wm *wm)
 	hash_table_destroy(wm->window_hash);
 	weston_wm_destroy_cursors(wm);
 	xcb_disconnect(wm->conn);
+	if (wm->queued_idle)
+		wl_event_source_remove(wm->queued_idle);
 	wl_event_source_remove(wm->source);
 	wl_list_remove(&wm->selection_listener.link);
 	wl_list_remove(&wm->activate_listener.link);
@@ -2804,12 +3218,16 @@ static void
 xserver_map_shell_surface(struct weston_wm_window *window,
 			  struct weston_surface *surface)
 {
-	struct weston_wm *wm = window->wm;
-	struct weston_desktop_xwayland *xwayland =
-		wm->server->compositor->xwayland;
-	const struct weston_desktop_xwayland_interface *xwayland_interface =
-		wm->server->compositor->xwayland_interface;
-	struct weston_wm_window *parent;
+	/* A weston_wm_window may have many different surfaces assigned
+	 * throughout its life, so we must make sure to remove the listener
+	 * from the old surface signal list. */
+	if (window->surface)
+		wl_list_remove(&window->surface_destroy_listener.link);
+
+	window->surface = surface;
+	window->surface_destroy_listener.notify = surface_destroy;
+	wl_signal_add(&window->surface->destroy_signal,
+		      &window->surface_destroy_listener);
 
 	/* This should be necessary only for override-redirected windows,
 	 * because otherwise MapRequest handler would have already updated
@@ -2818,20 +3236,31 @@ xserver_map_shell_surface(struct weston_wm_window *window,
 	 * have already been drawn once with the old property values, so if the
 	 * app changes something affecting decor after MapWindow, we glitch.
 	 * We only hit xserver_map_shell_surface() once per MapWindow and
-	 * wl_surface, so better ensure we get the window type right.
+	 * wl_surface, so better ensure we get the window type right: if
+	 * replies are still in flight, the shell surface is only set up from
+	 * the event path once they have been applied.
 	 */
-	weston_wm_window_read_properties(window);
+	window->shell_map_deferred = true;
+	weston_wm_window_poll_properties(window);
+	xserver_finish_map_shell_surface(window);
+	xcb_flush(window->wm->conn);
+}
 
-	/* A weston_wm_window may have many different surfaces assigned
-	 * throughout its life, so we must make sure to remove the listener
-	 * from the old surface signal list. */
-	if (window->surface)
-		wl_list_remove(&window->surface_destroy_listener.link);
+static void
+xserver_finish_map_shell_surface(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_desktop_xwayland *xwayland =
+		wm->server->compositor->xwayland;
+	const struct weston_desktop_xwayland_interface *xwayland_interface =
+		wm->server->compositor->xwayland_interface;
+	struct weston_wm_window *parent;
 
-	window->surface = surface;
-	window->surface_destroy_listener.notify = surface_destroy;
-	wl_signal_add(&window->surface->destroy_signal,
-		      &window->surface_destroy_listener);
+	if (!window->shell_map_deferred || !window->surface ||
+	    window->properties_pending || window->geometry_pending)
+		return;
+
+	window->shell_map_deferred = false;
 
 	if (!xwayland_interface)
 		return;
@@ -109,6 +109,33 @@ struct weston_xwayland_api {
 	 */
 	void
 	(*xserver_exited)(struct weston_xwayland *xwayland, int exit_status);
+
+	/** Spawn the Xwayland server without waiting for an X client.
+	 *
+	 * Normally the Xwayland server is only started when the first X
+	 * client connects, which then has to wait for the server and the
+	 * window manager to initialize. Calling this function after
+	 * \a listen starts the server right away instead.
+	 * If the server is already running this does nothing.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 *
+	 * \return 0 on success, a negative number otherwise.
+	 */
+	int
+	(*spawn)(struct weston_xwayland *xwayland);
+
+	/** Set the idle timeout of the Xwayland server.
+	 *
+	 * When no X client windows have existed for \a seconds, the
+	 * Xwayland server is terminated to reclaim its resources. It is
+	 * started again when the next X client connects.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 * \param seconds The idle timeout in seconds, 0 disables it.
+	 */
+	void
+	(*set_idle_timeout)(struct weston_xwayland *xwayland, int seconds);
 };
 
 /** Retrieve the API object for the libweston Xwayland module.
@@ -51,12 +51,15 @@ struct weston_xserver {
 	struct wl_listener destroy_listener;
 	weston_xwayland_spawn_xserver_func_t spawn_func;
 	void *user_data;
+	int idle_timeout;
+	struct wl_event_source *idle_timer;
 };
 
 struct weston_wm {
 	xcb_connection_t *conn;
 	const xcb_query_extension_reply_t *xfixes;
 	struct wl_event_source *source;
+	struct wl_event_source *queued_idle;
 	xcb_screen_t *screen;
 	struct hash_table *window_hash;
 	struct weston_xserver *server;
@@ -72,6 +75,8 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	struct wl_list pending_window_list;
+	int client_window_count;
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
@@ -80,6 +85,10 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
+	uint32_t property_offset;
+	xcb_get_property_cookie_t property_cookie;
+	int property_cookie_pending;
+	uint32_t selection_chunk_size;
 	struct wl_array source_data;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;
@@ -170,6 +179,13 @@ weston_wm_selection_init(struct weston_wm *wm);
 int
 weston_wm_handle_selection_event(struct weston_wm *wm,
 				 xcb_generic_event_t *event);
+void
+weston_wm_selection_collect_reply(struct weston_wm *wm);
+
+void
+weston_wm_check_queued(struct weston_wm *wm);
+int
+weston_wm_count_clients(struct weston_wm *wm);
 
 struct weston_wm *
 weston_wm_create(struct weston_xserver *wxs, int fd);
@@ -179,6 +195,9 @@ weston_wm_destroy(struct weston_wm *wm);
 struct weston_seat *
 weston_wm_pick_seat(struct weston_wm *wm);
 
+void
+weston_xserver_update_idle(struct weston_xserver *wxs);
+
 int
 weston_wm_handle_dnd_event(struct weston_wm *wm,
 			   xcb_generic_event_t *event);